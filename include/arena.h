@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "ijvm.h"
+#include "ijvm_ext.h"
+
+// Memory of a machine (see ijvm_arena in ijvm_ext.h). Everything init_ijvm()
+// allocates for a machine, except the ijvm struct itself, comes from the
+// machine's arena m->arena: the constant pool, the text and its quickened
+// copy, and the decoded program (decode.h). It is bump allocated and only
+// given back all at once, when the machine is destroyed. init_ijvm() sizes
+// the arena from the header before it allocates anything, so a machine
+// normally takes one block; a guess that was too small gets another block,
+// and resetting the arena merges them into one for the next machine.
+//
+// The arena also keeps the stack mapping (stack.h) of the last machine, so a
+// recycled arena does not map a new stack either.
+
+typedef struct arena_block arena_block;
+
+struct ijvm_arena {
+  byte *block;
+  size_t size;
+  size_t used;
+  arena_block *extra;        // blocks added when block ran out
+  size_t extra_size;
+  word *stack;               // stack mapping kept for the next machine
+  unsigned int stack_max;
+  bool in_use;               // a machine is using it
+};
+
+// Makes sure the arena has size bytes, in one block if it is empty. Returns
+// false if they could not be allocated.
+bool arena_reserve(ijvm_arena *arena, size_t size);
+
+// Allocates size bytes, aligned for any type. Returns NULL if out of memory.
+void *arena_alloc(ijvm_arena *arena, size_t size);
+
+// Gives back everything allocated from the arena, keeping the memory.
+void arena_reset(ijvm_arena *arena);
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include "ijvm.h"
+
+// Pre-decoded program text, built once by init_ijvm() and executed by the
+// threaded interpreter in interp.c.
+//
+// Every reachable instruction becomes one fixed-size entry with its operands
+// resolved: branch and call targets are entry indices, LDC_W carries the
+// constant itself and WIDE forms carry their 16 bit local index. Entries are
+// laid out in text order so falling through means moving to the next entry.
+
+// decoded opcodes, these index the dispatch table in interp.c
+enum {
+  DOP_SLOW,           // executed by step(), see below
+  DOP_END,            // ran off the end of the text
+  DOP_NOP,
+  DOP_PUSH,           // BIPUSH and LDC_W, arg is the value
+  DOP_DUP,
+  DOP_POP,
+  DOP_SWAP,
+  DOP_IADD,
+  DOP_ISUB,
+  DOP_IAND,
+  DOP_IOR,
+  DOP_ILOAD,          // local is the (possibly wide) index
+  DOP_ISTORE,
+  DOP_IINC,           // local is the index, arg the increment
+  DOP_GOTO,           // target is the entry index to jump to
+  DOP_IFEQ,
+  DOP_IFLT,
+  DOP_IF_ICMPEQ,
+  DOP_INVOKEVIRTUAL,  // local is the arg count, arg the method (index in m->methods),
+                      // target the first entry of the method body
+  DOP_IRETURN,
+  DOP_IN,
+  DOP_OUT,
+  DOP_HALT,
+  DOP_ERR,
+  DOP_NEWARRAY,       // arrays, see heap.h
+  DOP_IALOAD,
+  DOP_IASTORE,
+  DOP_ANEWARRAY,      // the same as the three above, for arrays of references
+  DOP_AIALOAD,        // (see refmap.h)
+  DOP_AIASTORE,
+  DOP_GC,
+
+  // superinstructions, see super.c
+  DOP_ILOAD_PUSH_IF_ICMPEQ,
+  DOP_ILOAD_ILOAD_IADD,
+  DOP_ILOAD_ILOAD_ISUB,
+  DOP_ILOAD_ILOAD,
+  DOP_ILOAD_PUSH,
+  DOP_ILOAD_IFEQ,
+  DOP_ISTORE_ILOAD,
+  DOP_ISTORE_GOTO,
+  DOP_IADD_ISTORE,
+  DOP_PUSH_IF_ICMPEQ,
+  DOP_PUSH_IADD,
+  DOP_DUP_IFEQ,
+  DOP_DUP_IADD,
+  DOP_ISUB_IFLT,
+  DOP_IAND_IFEQ,
+  DOP_IINC_GOTO,
+  DOP_COUNT
+};
+
+// first superinstruction, everything from here on is a fused sequence
+#define DOP_FIRST_SUPER DOP_ILOAD_PUSH_IF_ICMPEQ
+
+// DOP_SLOW is used for everything the decoder can not resolve up front:
+// invalid or unimplemented opcodes, branches leaving the text, invalid
+// constant indices, broken method headers and truncated instructions. The
+// interpreter hands those to step() so errors are reported exactly once, in
+// one place.
+
+typedef struct decoded_insn {
+  byte op;            // DOP_* value
+  byte size;          // length of the original instruction in bytes
+  uint16_t local;     // local variable index, or arg count for INVOKEVIRTUAL
+  word arg;           // immediate operand, or method index for INVOKEVIRTUAL
+  uint32_t target;    // entry index of the branch or call target
+  uint32_t pc;        // byte offset of the original instruction
+} decoded_insn;
+
+// Method table, built by decode_text() with one entry per constant (so
+// INVOKEVIRTUAL indexes it with its constant index). The entry of a
+// constant holding the address of a method header has the header decoded,
+// so calls (from step() and from the decoded program alike) never read the
+// text or the constant pool. Constants that do not point at a method header
+// get an entry with pc 0, no method body starts there. max_stack is filled
+// in by the verifier (verify.h), so a call to a verified method checks for
+// room on the stack once, for the whole frame.
+typedef struct method_info {
+  uint32_t pc;          // byte offset of the first instruction of the body
+  uint16_t arg_count;
+  uint16_t local_count;
+  uint32_t frame_size;  // arg_count + local_count, the locals a call takes
+  uint32_t max_stack;   // deepest its operand stack gets, 0 unless verified
+  uint32_t call_words;  // what a call needs above the arguments: the header
+                        // locals, the saved words and max_stack
+} method_info;
+
+// Decodes m->text into m->code and builds m->pc_map and m->methods, all
+// three allocated from m->arena (arena.h). Sets m->main_locals to one past
+// the highest local index any instruction uses, main's frame size. Returns
+// false if memory for the decoded program could not be allocated.
+bool decode_text(ijvm *m);
+
+// Fuses hot instruction sequences in m->code into superinstructions (super.c).
+// A fused sequence keeps all of its entries, only the op of the first one is
+// replaced, so jumping into the middle of a sequence still works.
+void fuse_superinstructions(ijvm *m);
+
+// Returns the op the entry had before fusion.
+byte unfused_op(byte op);
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "ijvm.h"
+#include "ijvm_ext.h"
+
+// The heap of arrays, used by NEWARRAY, IALOAD and IASTORE. It is created
+// by the first NEWARRAY (or set_gc_options()), so a machine that never
+// allocates has none (m->heap is NULL).
+//
+// A reference is a handle: HANDLE_TAG with the index of the array's entry
+// in the handle table below it. The entry has the array's elements and
+// length, so checking a reference, and whether its array was freed
+// (is_heap_freed()), is one lookup, and arrays need no header. The tag keeps
+// small integers from passing for references.
+//
+// Most arrays die young, so arrays of up to HEAP_SMALL_WORDS elements start
+// out in the nursery (see generations below). The old generation is:
+// arrays of up to HEAP_SMALL_WORDS elements are allocated from slabs: blocks
+// of HEAP_SLAB_BYTES, each holding arrays of one size class. Every size
+// class has a current slab and allocates by bumping a pointer through it,
+// taking a new slab when it is full. Larger arrays get an allocation of
+// their own, the large object space. Slabs and large arrays come zeroed
+// from the system, so a new array is all zeros without clearing it.
+//
+// GC runs a mark-sweep collector. A word that looks like a reference to a
+// live array keeps it alive if it is in an array kept alive, or on the stack
+// (the locals and operands of all frames) where the stack maps do not know
+// it to be an integer (refmap.h). Elements are not told apart, so arrays
+// are scanned whole, like the stacks of programs without maps. The mark bits
+// are a bitmap beside the handle table, one bit per handle, as is the set of
+// handles in use. Marking only visits the stack and live arrays, and the
+// sweep frees what is in use but not marked 64 handles at a time, so a
+// collection takes time for the live data and a word per 64 handles rather
+// than for the garbage. A freed array's memory goes to a free list of its
+// size class (or back to the system, for a large one), taken before bumping,
+// and its handle to a list of free handles that NEWARRAY takes before new
+// ones. Until then is_heap_freed() is true for it.
+//
+// Compaction: a freed array leaves a hole in its slab that only arrays of
+// the same size class fill again, so a program whose arrays change size
+// over time would keep slabs it hardly uses. After the old generation is
+// swept, by GC or at the end of an incremental cycle, a size class with a
+// slab or more to spare and at least 1/COMPACT_HOLES of its slots free is
+// compacted: its arrays move from its emptiest slabs into the holes of the
+// fullest, and the slabs left empty are unmapped, back to the system.
+// Arrays are only found through the handle table, so their entries are all
+// that changes. Handles stay where they are, a freed one still is freed
+// until NEWARRAY takes it.
+//
+// Generations: the nursery is two halves of nursery_bytes (ijvm_gc_options),
+// and NEWARRAY allocates young arrays by bumping a pointer through one of
+// them. When it is full, a minor collection marks the young arrays reachable
+// from the stack and from the old arrays whose card is marked, copies the
+// ones that survived fewer than promote_after of them to the other half and
+// promotes the others into the slabs. Dead young arrays cost nothing, and
+// the young ones left are packed at the start of the half allocated from
+// next. Handles stay the same when an array moves, only the table entry
+// changes. The card table is one bit per handle: IASTORE of a reference
+// into an old array marks its card (array_store()), so a minor collection
+// scans just the old arrays that may refer to young ones, not the whole old
+// generation. GC collects both generations and promotes every survivor,
+// leaving the nursery empty.
+//
+// Incremental marking (pause_words in ijvm_gc_options) collects the old
+// generation without stopping for all of it. A cycle starts when the old
+// arrays take twice what was left after the previous collection (and at
+// least CYCLE_START_BYTES), by marking grey the old arrays the stack and the
+// young arrays refer to. From then on every NEWARRAY scans grey arrays for
+// at most about pause_words elements, marking grey what they refer to and
+// turning them black, and sweeps once no grey ones are left. Marking keeps
+// the snapshot of the heap at the start of the cycle (tri-color, snapshot at
+// the beginning): IASTORE logs the reference it overwrites, the log is marked
+// grey before the next slice, and arrays promoted or allocated old during the
+// cycle start out black. Arrays that died during the cycle are left for the
+// next one. The pauses are paced by allocation rather than by instructions:
+// marking only has to keep up with new arrays, and NEWARRAY is where every
+// engine has all of the stack in memory. GC finishes the cycle under way, if
+// there is one, and collects as above otherwise.
+//
+// With mark_threads above 1, GC marks and sweeps on that many threads once
+// the arrays take PARALLEL_MARK_BYTES (below that, waking the threads costs
+// more than it saves). The workers are started by the first such GC and
+// wait for the next one. It frees the same arrays and gives out the same
+// handles afterwards as on one thread, see heap.c. Incremental marking
+// stays on the machine's thread.
+//
+// With concurrent_marking, the cycles start the same way but a thread of
+// the heap's own does the marking, MARK_BATCH_WORDS (or pause_words)
+// elements at a time, while the machine runs on. Between batches it lets go
+// of the heap's lock, which the machine takes for NEWARRAY, GC and when the
+// IASTORE log fills up; IALOAD and IASTORE otherwise go ahead without it.
+// Should the old arrays grow to twice what started the cycle before it is
+// done, NEWARRAY marks a slice as well. Once the marker runs out of grey
+// arrays, the next NEWARRAY makes the final remark: it marks what is left in
+// the IASTORE log and sweeps. Under a snapshot at the beginning the stack is
+// scanned when the snapshot is taken, at the start of the cycle; a remark
+// scanning it again would find nothing the snapshot does not already keep.
+//
+// The workers and the marker are pthreads, which the C library has built
+// in since glibc 2.34. With an older one, link with -pthread
+// (USERFLAGS=-pthread make), or build with -DIJVM_NO_THREADS: then neither
+// ever starts, GC marks on the machine's thread whatever mark_threads is,
+// and concurrent cycles are marked in slices of MARK_BATCH_WORDS (or
+// pause_words).
+
+#define HANDLE_TAG 0x7E000000
+#define HANDLE_MASK 0x00FFFFFF   // the index, at most 16M arrays
+#define HEAP_SMALL_WORDS 256
+#define HEAP_SLAB_BYTES (64u << 10)
+#define NURSERY_BYTES (256u << 10) // each half, the default
+#define PROMOTE_AFTER 2            // minor collections, the default
+#define CYCLE_START_BYTES (1u << 20) // old arrays that start incremental marking
+#define PARALLEL_MARK_BYTES (1u << 20) // arrays worth marking in parallel
+#define MARK_BATCH_WORDS 4096      // the marker thread's, if pause_words is 0
+#define SATB_LOG_WORDS 1024
+#define COMPACT_HOLES 4           // compact a size class once 1/4 of its slots are free
+
+// NEWARRAY: allocates an array of count words, sets *ref to its reference.
+// Reports an error and finishes m if count is negative or there is no
+// memory left, returning false.
+bool new_array(ijvm *m, word count, word *ref);
+
+// The element index of the array ref, for IALOAD. Reports an error and
+// finishes m if ref is not a live array or index is out of bounds,
+// returning NULL.
+word *array_element(ijvm *m, word ref, word index);
+
+// IASTORE: sets element index of the array ref to value, marking the
+// array's card if needed. Reports an error and finishes m as
+// array_element() does, returning false.
+bool array_store(ijvm *m, word ref, word index, word value);
+
+// Whether v refers to a live array.
+bool is_array(ijvm *m, word v);
+
+// GC: frees every array no reference reaches, see above.
+void collect_garbage(ijvm *m);
+
+// The heap part of get_memory_stats().
+ijvm_heap_stats get_heap_stats(ijvm *m);
+
+// Frees the heap and all arrays, if any.
+void free_heap(ijvm *m);
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef IJVM_EXT_H
+#define IJVM_EXT_H
+
+#include "ijvm.h"
+
+// Additions to the interface in ijvm.h, which has to stay as handed out.
+
+// Execution engines run() can use. All of them leave the machine in the state
+// calling step() until finished() would have.
+typedef enum {
+  ENGINE_INTERPRETER, // threaded interpreter (interp.c), the default
+  ENGINE_JIT,         // native x86-64 code (jit.c)
+  ENGINE_TRACING,     // the interpreter, compiling hot loops (trace.c)
+  ENGINE_TIERED,      // the interpreter, switching hot loops to optimized code (osr.c)
+  ENGINE_REGISTER,    // register IR (regir.c) on a register VM (regvm.c)
+} ijvm_engine;
+
+// Selects the engine used by the following calls to run(). ENGINE_JIT,
+// ENGINE_TRACING and ENGINE_TIERED fall back to the plain interpreter on
+// platforms they can not generate code for.
+void set_engine(ijvm *m, ijvm_engine engine);
+
+// Memory held by one stack, in bytes.
+typedef struct {
+  size_t current;   // in use by the frames now
+  size_t peak;      // the most that has been in use (to the page, if it
+                    // was between calls)
+  size_t resident;  // backed by memory now, at most peak rounded up to pages
+  size_t reserved;  // address space set aside for it, guard pages included
+} ijvm_stack_stats;
+
+// The heap of arrays (see heap.h).
+typedef struct {
+  size_t arrays;      // live, not freed by a collection yet
+  size_t used;        // bytes in their elements
+  size_t reserved;    // bytes allocated for the heap and its tables
+  size_t collections; // garbage collections (or incremental cycles) so far
+  size_t minor_collections; // of the nursery only
+  size_t slices;      // of incremental marking
+  size_t compactions; // of a size class, giving slabs back
+} ijvm_heap_stats;
+
+typedef struct {
+  ijvm_stack_stats stack; // the one stack, all frames and operands
+  ijvm_heap_stats heap;
+} ijvm_memory_stats;
+
+// How the heap collects garbage (see heap.h).
+typedef struct {
+  size_t nursery_bytes;       // each half of the nursery, too small for one
+                              // array (0) for none: all arrays start out old
+  unsigned int promote_after; // minor collections a young array survives
+                              // before it is promoted, at least 1
+  size_t pause_words;         // 0: the old generation is only collected by
+                              // GC, stopping the world. Otherwise it is
+                              // marked incrementally, at most about this
+                              // many words at a time
+  unsigned int mark_threads;  // threads GC marks and sweeps a large heap
+                              // with, the machine's own included
+  bool concurrent_marking;    // old generation cycles are marked on a
+                              // thread of their own, not in slices
+} ijvm_gc_options;
+
+// Sets the options of m's heap. Any young arrays are promoted first (as GC
+// would, also collecting the garbage, after finishing an incremental
+// cycle). Returns false if out of memory.
+bool set_gc_options(ijvm *m, ijvm_gc_options options);
+
+// The options of m's heap, the defaults if it has none yet.
+ijvm_gc_options get_gc_options(ijvm *m);
+
+// Memory for machines, to be recycled across many short-lived ones. A
+// machine started with init_ijvm_in() takes everything it allocates (except
+// the ijvm struct) from arena in as good as one allocation, and
+// destroy_ijvm() hands it back to the arena for the next machine instead of
+// freeing it. An arena holds one machine at a time. init_ijvm() uses an
+// arena of the machine's own.
+typedef struct ijvm_arena ijvm_arena;
+
+// Returns an empty arena, NULL if out of memory.
+ijvm_arena *create_arena(void);
+
+// Frees arena, which no machine may be using.
+void destroy_arena(ijvm_arena *arena);
+
+// init_ijvm(), with the memory of arena. Returns NULL (leaving the arena
+// alone) if it fails or a machine is using the arena already.
+ijvm *init_ijvm_in(ijvm_arena *arena, char *binary_path, FILE *input, FILE *output);
+
+// Reports the memory m uses. Stack memory a deep recursion left behind is
+// given back once the stack has stayed much shallower for a while (see
+// stack.h), resident shows that.
+ijvm_memory_stats get_memory_stats(ijvm *m);
+
+#endif
@@ -24,31 +24,49 @@ typedef struct IJVM {
   //chapter 1
   byte *text; // pointer to the program text (bytecode)
   unsigned int text_size; // num of bytes in text
+  byte *quick_text; // copy of text that step() runs and quickens, see interp.h
 
   word *constant_pool; // pointer to constant pool (array of 32-bit values)
   unsigned int constant_pool_count; // num of 32-bit vals (constants)
 
-  //chapter 2
-  word *stack;
-  unsigned int stack_size;
-  unsigned int stack_max;
+  //chapter 2, 4 + 5: one stack of frames, see the frame layout in interp.h
+  word *stack; // the whole stack, bottom frame (main's) first, see stack.h
+  unsigned int stack_max; // capacity in words
+  bool stack_opened;  // ran into a guard page outside of run(), now open
+  unsigned int stack_peak; // most words in use so far, see trim_stack()
+  unsigned int stack_window; // most words in use at calls since the last trim
+  unsigned int stack_touched; // words that may be backed by memory
+  unsigned int stack_trim_countdown; // calls and returns until the next trim
+  struct IJVM *next_stack; // list of mapped stacks, for the fault handler
+  word *sp; // one past the top of the operand stack
+  word *lv; // local variables of the current frame
+  word *operands; // bottom of the operand stack of the current frame
+  unsigned int main_locals; // size of main's frame
+  unsigned int call_depth; // frames above main's
 
   unsigned int program_counter;
+
+  struct ijvm_arena *arena; // where the machine's memory comes from, see arena.h
+  bool own_arena; // created by init_ijvm(), destroyed with the machine
+  struct heap *heap; // arrays, created by the first NEWARRAY, see heap.h
+  struct ref_maps *ref_maps; // where the stack holds references, see refmap.h
+  bool ref_maps_built; // by the first collection that needed them
   
   bool done;
 
-  //chapter 4 + 5
-
-  word* locals;
-  unsigned int lv; // top used index + 1
-  unsigned int lv_max; // capacity
-  unsigned int new_lv;
-  unsigned int local_count; // number of local variables
-  unsigned int arg_count; // number of arguments
+  // pre-decoded text executed by run(), see decode.h
+  struct decoded_insn *code;
+  unsigned int code_count;
+  int32_t *pc_map; // byte offset -> index in code, -1 if no instruction starts there
+  struct method_info *methods; // per constant, the method it points to, see decode.h
+  bool verified; // the decoded program passed the load time verifier, see verify.h
+  unsigned int max_stack; // deepest a verified method's operand stack gets
 
-  word* control_data;
-  unsigned int control_size; // top used index + 1
-  unsigned int control_max; // capacity
+  int engine; // ijvm_engine used by run(), see ijvm_ext.h
+  struct jit_code *jit; // native code, compiled by the first run() with ENGINE_JIT
+  struct trace_cache *traces; // hot loop counters and traces, see trace.h
+  struct osr_cache *osr; // hot loop counters and optimized code, see osr.h
+  struct reg_program *regs; // register IR, translated by the first run() with ENGINE_REGISTER
   
 } ijvm;
 
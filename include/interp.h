@@ -0,0 +1,107 @@
+#ifndef INTERP_H
+#define INTERP_H
+
+#include "ijvm.h"
+
+// Number of OP_HALT bytes appended after the program text, so the operands of
+// a truncated last instruction can be read (by the decoder or by step())
+// without reading past the allocation.
+#define TEXT_PADDING 4
+
+// Quickening. step() runs m->quick_text, a private copy of the text, rather
+// than m->text (which get_text() returns, unchanged). The first time it runs
+// an instruction whose operands only need checking once, it rewrites the
+// opcode byte in the copy to a quickened form that skips the checks from
+// then on: LDC_W with a valid constant index, the three WIDE forms (no
+// second dispatch on the widened opcode) and INVOKEVIRTUAL of a valid
+// method. Operand bytes stay as they are, since execution may still jump
+// into them, so step() keeps reading operands from m->text.
+#define QUICK_LDC_W          ((byte) 0xF0)
+#define QUICK_WIDE_ILOAD     ((byte) 0xF1)
+#define QUICK_WIDE_ISTORE    ((byte) 0xF2)
+#define QUICK_WIDE_IINC      ((byte) 0xF3)
+#define QUICK_INVOKEVIRTUAL  ((byte) 0xF4)
+#define QUICK_FIRST QUICK_LDC_W
+#define QUICK_LAST QUICK_INVOKEVIRTUAL
+#define QUICK_NONE           ((byte) 0xF5) // replaces these values in the original text
+
+// Internal interface shared between the reference interpreter (step() in
+// ijvm.c) and the faster execution engines behind run().
+
+// Frames. All machine state lives in the one array m->stack, main's frame at
+// the bottom and a frame per method call above it:
+//
+//   m->lv ->        local 0 (the OBJREF) .. arguments, then the locals from
+//                   the method header
+//                   saved program counter, where IRETURN continues
+//                   saved LV of the caller (an index into m->stack)
+//                   link: the caller's m->operands (an index too)
+//   m->operands ->  operand stack, up to m->sp
+//
+// main's frame is just its locals (m->main_locals of them, enough for every
+// local index in the program) and its operand stack. A call leaves the
+// arguments where the caller pushed them, they become the callee's first
+// locals. IRETURN puts the return value where the OBJREF was, dropping
+// whatever else the callee left. Saved words hold indices into m->stack, a
+// pointer does not fit in a word. The stack never moves (see stack.h).
+#define FRAME_SAVED 3
+
+// Stack primitives, see ijvm.c
+void push(ijvm *m, word val);
+word pop(ijvm *m);
+word top(ijvm *m);
+
+// Threaded interpreter (interp.c). Runs the pre-decoded program from the
+// current machine state until the machine is finished, using one indirect
+// jump per instruction instead of calling step(). Leaves m in the same state
+// step() would have.
+void run_threaded(ijvm *m);
+
+// Backward branch counting, for the engines that compile hot loops. The
+// threaded interpreter counts the backward branches taken to every entry and
+// calls enter() (with the machine state complete and the program counter at
+// the loop header) once a header has been reached that way hot times, and
+// from then on whenever compiled is set for it. enter() may leave m anywhere.
+typedef struct loop_profile {
+  uint32_t *counters;    // backward branches taken, per entry
+  byte *compiled;        // per entry, set once a loop header has native code
+  uint32_t hot;
+  void (*enter)(ijvm *m, uint32_t header);
+} loop_profile;
+
+// Steps m with the reference interpreter until its program counter is at a
+// decoded instruction again. Returns false if the machine finished instead.
+bool resync(ijvm *m);
+
+// Whether m->stack has room for words more above m->sp, for engines writing
+// further than the next word without push() (see stack.h).
+bool reserve_stack(ijvm *m, uint32_t words);
+
+// The locals the current frame has.
+unsigned int frame_locals(ijvm *m);
+
+// Calls method (an entry of m->methods, see decode.h) with its arguments on
+// the stack, returning to return_pc. Used by step() and all engines, see
+// ijvm.c.
+struct method_info;
+void call_method(ijvm *m, const struct method_info *method, uint32_t return_pc);
+
+// INVOKEVIRTUAL and IRETURN as step() does them, for the engines that do not
+// leave calls to step(). invoke_method() calls the method of entry d with its
+// arguments on the stack. return_method() returns false without changing m
+// if the IRETURN has to be left to step() (empty operand stack, no frame to
+// return to, a bad return address or broken saved words). Both set the
+// program counter.
+struct decoded_insn;
+void invoke_method(ijvm *m, const struct decoded_insn *d);
+bool return_method(ijvm *m);
+
+// Baseline JIT (jit.c). Compiles the decoded program to native code on first
+// use and runs it, handing whatever it can not compile to step(). Falls back
+// to run_threaded() if no code can be generated.
+void run_jit(ijvm *m);
+
+// Frees the native code, if any.
+void free_jit(ijvm *m);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef OSR_H
+#define OSR_H
+
+#include "ijvm.h"
+#include "interp.h"
+
+// Tiered execution (ENGINE_TIERED, see ijvm_ext.h): everything starts in the
+// threaded interpreter, which counts backward branches (see loop_profile in
+// interp.h). Once a loop header is hot, osr.c compiles the part of its method
+// reachable from the header to optimized native code and switches the
+// running frame over to it mid-loop (on-stack replacement).
+//
+// The optimized code keeps the most used locals and the top operand stack
+// slots in registers. That needs the operand stack depth at every
+// instruction to be known at compile time, so it is computed relative to the
+// depth at the loop header, and code whose depth depends on the path taken
+// to it is not compiled. On entry, the locals window of the frame is loaded
+// into registers and the operand stack base is taken from m->sp; whenever
+// execution reaches an instruction the optimized code does not handle
+// (calls, returns, I/O, anything left to step(), code outside the compiled
+// region), it deoptimizes: the registers are written back to the locals
+// window and the stack, m->sp and the program counter are set as the
+// interpreter expects them, and the interpreter carries on.
+
+// backward branches to a loop header before it is compiled
+#define OSR_HOT 256
+
+// deepest operand stack, relative to the loop header, the code handles
+#define OSR_MAX_DEPTH 64
+
+struct osr_code;
+
+typedef struct osr_cache {
+  loop_profile loops;        // enter() compiles or runs optimized code
+  struct osr_code **code;    // optimized code entered at a loop header entry
+} osr_cache;
+
+// Returns the loop profile of the optimized code cache of m, allocating it
+// on first use. Returns NULL if it could not be allocated, the interpreter
+// then runs without compiling.
+loop_profile *get_osr_profile(ijvm *m);
+
+// Frees the cache and all optimized code.
+void free_osr(ijvm *m);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef REFMAP_H
+#define REFMAP_H
+
+#include "ijvm.h"
+
+// Reference maps: which words of the stack may hold references, so GC
+// (heap.h) only follows those.
+//
+// The machine does not tag its words, the maps are worked out from the
+// decoded program instead, the first time they are needed. Like the
+// verifier (verify.h), a pass over every method follows its control flow,
+// here keeping a kind per local and per operand:
+//
+//  SLOT_INT  an integer: what BIPUSH, LDC_W, IN and arithmetic push, and
+//            the locals of main and those from a method header to start
+//            with. ref+1 stays an integer, even after ISUB takes the 1 off.
+//  SLOT_REF  what NEWARRAY, ANEWARRAY and AIALOAD push
+//  SLOT_ANY  unknown, the word is looked at like before: the arguments of a
+//            method, what a call returns, what IALOAD loads from an array
+//            of integers and where paths with different kinds meet
+//
+// DUP, SWAP, ILOAD and ISTORE move kinds along with the words. Every decoded
+// entry gets the kind of the top operand before it (tos_kind()), and the
+// entries after NEWARRAY, ANEWARRAY, GC and INVOKEVIRTUAL get the kinds of
+// their whole frame. Those are where a collection can happen: while one of
+// the first three runs the program counter is already past it (step()
+// increments it first, run() sets it the same way), and the frames below the
+// current one are stopped at the return address of a call. A map taken
+// between two instructions holds while the one before it runs too, it only
+// has its operands on top of what is still there.
+//
+// Frames without a map are scanned whole, as are the stacks of programs
+// that do not verify. So are methods whose maps would take more than
+// REFMAP_MAX_BYTES to work out, and code reached from more than one method.
+// Since the words are not tagged, the JIT and the other engines keep the
+// stack as it is, with nothing to maintain.
+
+#define SLOT_INT 0
+#define SLOT_REF 1
+#define SLOT_ANY 2
+
+#define REFMAP_MAX_BYTES (16u << 20) // kinds kept while working out a method
+
+// Copies the words on m's stack that may refer to an array to roots, which
+// has room for all of the stack (m->sp - m->stack words). Returns how many
+// it copied.
+size_t stack_roots(ijvm *m, word *roots);
+
+// The kind of the top word of m's operand stack, SLOT_ANY if there is no
+// map for where m is.
+byte tos_kind(ijvm *m);
+
+void free_ref_maps(ijvm *m);
+
+#endif
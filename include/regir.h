@@ -0,0 +1,104 @@
+#ifndef REGIR_H
+#define REGIR_H
+
+#include "ijvm.h"
+
+// Register IR, translated from the decoded program (see decode.h) by regir.c
+// and run by the register VM in regvm.c (ENGINE_REGISTER, see ijvm_ext.h).
+//
+// Within a method the depth of the operand stack is known at nearly every
+// instruction, so each stack slot can be named like a local variable. The IR
+// has virtual registers for both: L x is local variable x of the current
+// frame, S k the k-th stack word above the depth the method started at. The
+// translator keeps a symbolic stack while it walks a method, so ILOAD and
+// constant pushes turn into operands of the instruction consuming them, a
+// result followed by ISTORE is written to the local directly and operations
+// on constants are folded. "ILOAD a; ILOAD b; IADD; ISTORE c" becomes the
+// single instruction "ADD L c, L a, L b".
+//
+// S registers live on the frame's operand stack at the position they name,
+// and L registers are the frame's locals, so only m->sp has to be brought
+// up to date when control leaves the register code. Code whose stack depth
+// depends on the path taken to it (a loop that leaves a word on the stack
+// every iteration) is run in stack mode instead: one ROP_STACK per decoded
+// entry, executed on the stack like the interpreter does.
+
+// A virtual register as the translator names it: (index << 1) | 1 for S
+// index, index << 1 for L index.
+typedef uint16_t vreg;
+
+#define VREG_LOCAL(x) ((vreg)((x) << 1))
+#define VREG_SLOT(k) ((vreg)(((k) << 1) | 1))
+
+// highest L or S index a vreg can name
+#define VREG_MAX_INDEX 0x7FFF
+
+// Instructions only hold register indices, whether each operand is an L or
+// an S register is part of the opcode: an instruction with operands has a
+// variant per combination, numbered from its base opcode by the kinds of its
+// operands (in the order d, a, b, with the first as the highest bit, set for
+// an S register). ROP_ADD + 5 is "ADD S d, L a, S b".
+enum {
+  ROP_MOV = 0,                      // d = a
+  ROP_MOVK = ROP_MOV + 4,           // d = k
+  ROP_ADD = ROP_MOVK + 2,           // d = a + b
+  ROP_SUB = ROP_ADD + 8,            // d = a - b
+  ROP_AND = ROP_SUB + 8,            // d = a & b
+  ROP_OR = ROP_AND + 8,             // d = a | b
+  ROP_ADDK = ROP_OR + 8,            // d = a + k
+  ROP_ANDK = ROP_ADDK + 4,          // d = a & k
+  ROP_ORK = ROP_ANDK + 4,           // d = a | k
+  ROP_INC = ROP_ORK + 4,            // L d += k (IINC)
+  ROP_INC_GOTO,                     // L d += k and continue at target
+  ROP_SWAP,                         // exchange S a and S b
+  ROP_GOTO,                         // continue at target
+  ROP_IFEQ,                         // continue at target if a == 0
+  ROP_IFLT = ROP_IFEQ + 2,          // continue at target if a < 0
+  ROP_IF_CMPEQ = ROP_IFLT + 2,      // continue at target if a == b
+  ROP_IF_CMPEQK = ROP_IF_CMPEQ + 4, // continue at target if a == k
+  ROP_SYNC = ROP_IF_CMPEQK + 2,     // set the stack size to k words above
+                                    // the method's and continue at target,
+                                    // entering stack mode
+  ROP_STACK,                        // execute entry in stack mode
+  ROP_EXIT,                         // set the stack size (unless k is -1)
+                                    // and hand entry to the call and return
+                                    // code or step()
+  ROP_COUNT
+};
+
+typedef struct reg_insn {
+  byte op;            // ROP_* value
+  uint16_t d;         // destination register
+  uint16_t a;         // source registers
+  uint16_t b;
+  word k;             // immediate operand or stack depth
+  uint32_t target;    // instruction index, or entry index for ROP_STACK and
+                      // ROP_EXIT
+} reg_insn;
+
+// start of entries execution can not continue at in register code
+#define NO_START UINT32_MAX
+
+// depth of entries run in stack mode
+#define STACK_MODE (-1)
+
+typedef struct reg_program {
+  reg_insn *insns;
+  uint32_t count;
+  uint32_t *start;      // per decoded entry, instruction to continue at
+  int32_t *depth;       // per decoded entry, stack depth above the method's
+  uint32_t max_depth;   // deepest any register code gets
+} reg_program;
+
+// Translates the decoded program of m. Returns NULL if there is not enough
+// memory.
+reg_program *translate_registers(ijvm *m);
+
+void free_reg_program(reg_program *p);
+
+// Register VM (regvm.c). Translates the program on first use and runs it
+// until the machine is finished, leaving m in the same state step() would
+// have. Falls back to run_threaded() if the program can not be translated.
+void run_register(ijvm *m);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include "ijvm.h"
+#include "ijvm_ext.h"
+
+// The machine stack (m->stack, frame layout in interp.h) is one mapping of
+// address space reserved up front and never moved, so engines may keep
+// pointers into it across anything they do:
+//
+//   guard page          PROT_NONE, catches words popped below the stack
+//   m->stack            STACK_WORDS words, backed by memory as they are
+//                       first touched
+//   spill page          PROT_NONE until the stack overflows into it
+//   guard page          PROT_NONE
+//
+// push() and the engines' pushes write without comparing against the end of
+// the stack: running into the spill page raises SIGSEGV, and the handler
+// stops the machine. Under run() (see run_guarded()) it jumps back out of
+// whatever engine was running, which reports "Stack overflow" and finishes
+// the machine. Outside of run() (step(), or push() called directly) the
+// handler opens the page for the faulting access, finishes the machine and
+// lets the instruction complete, the same for the spill page, the last guard
+// page after it and the guard page below. The pages are closed again when
+// the stack is unmapped. Faults anywhere else go to the handler from before
+// ours.
+//
+// Code writing more than a word past m->sp without push() still has to check
+// that the words are there with reserve_stack() (interp.h), so that it can
+// not skip over the guard pages.
+//
+// Pages stay backed once touched. After a deep recursion, trim_stack()
+// gives them back: calls note how deep the stack gets, and every
+// STACK_TRIM_INTERVAL calls and returns (and whenever run() returns) the
+// pages above twice the deepest use since the previous trim are released, if
+// that use is less than a quarter of what may be backed. The hysteresis
+// keeps a program that goes up and down the same depth from faulting its
+// pages back in every time. A finished machine keeps only what it uses.
+// How deep the stack got between calls is only known from the pages
+// touched, which run() looks up with mincore() before its trim; the other
+// trims go by the depths calls saw.
+//
+// The mapping belongs to the machine's arena (arena.h) and outlives the
+// machine: destroy_ijvm() releases its pages and leaves it there for the
+// next machine.
+
+#define STACK_WORDS (32u << 20)
+#define STACK_TRIM_INTERVAL 4096
+#define STACK_KEEP_BYTES (64u << 10) // never released
+
+// Maps the stack of m, with room for at least words words (at least
+// STACK_WORDS), the first words of them zero. Takes the mapping m->arena
+// kept if it is large enough. Sets m->stack and m->stack_max, returns false
+// if it could not be mapped.
+bool map_stack(ijvm *m, size_t words);
+
+// Hands the stack of m, if it has one, back to m->arena.
+void unmap_stack(ijvm *m);
+
+// Unmaps the stack mapping arena kept, if any.
+void unmap_arena_stack(ijvm_arena *arena);
+
+// Calls body(m), finishing m with an error if it overflows (or underflows)
+// the stack into the guard pages.
+void run_guarded(ijvm *m, void (*body)(ijvm *m));
+
+// Releases the stack pages m has not needed lately, see above. Called from
+// call_method() and return_method() through m->stack_trim_countdown, and
+// with scan set (look up the touched pages first) when run() returns.
+void trim_stack(ijvm *m, bool scan);
+
+// Stops m for an overflow found by reserve_stack() rather than a fault, the
+// way the fault handler would: it does not return inside run_guarded(),
+// outside it finishes m.
+void stack_overflow(ijvm *m);
+
+#endif
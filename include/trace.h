@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "ijvm.h"
+#include "interp.h"
+
+// Tracing JIT for hot loops, used by the threaded interpreter with
+// ENGINE_TRACING (see ijvm_ext.h).
+//
+// The interpreter counts the backward branches taken to every entry (see
+// loop_profile in interp.h). Once a loop header gets hot, trace.c records the
+// instructions of one iteration as it executes them, together with the
+// direction every conditional branch went, and jit.c compiles that linear
+// trace to native code. The trace runs as long as every branch goes the
+// recorded way; a guard on each branch leaves to the interpreter as soon as
+// one does not.
+
+// backward branches to a loop header before it is traced
+#define TRACE_HOT 64
+
+// longest trace recorded, in instructions
+#define TRACE_MAX_LENGTH 512
+
+// failed recordings before a loop header is given up on
+#define TRACE_MAX_ABORTS 3
+
+typedef struct trace_insn {
+  uint32_t index;     // entry in m->code
+  bool taken;         // direction of a conditional branch
+} trace_insn;
+
+struct native_trace;
+
+typedef struct trace_cache {
+  loop_profile loops;              // enter() records or runs a trace
+  struct native_trace **traces;    // trace starting at a loop header entry
+  byte *aborts;                    // failed recordings, per entry
+} trace_cache;
+
+// Returns the loop profile of the trace cache of m, allocating the cache on
+// first use. Returns NULL if it could not be allocated, the interpreter then
+// runs without tracing.
+loop_profile *get_trace_profile(ijvm *m);
+
+// Frees the trace cache and all traces.
+void free_traces(ijvm *m);
+
+// Native code for traces (jit.c). compile_trace() returns NULL if it can not
+// generate code, run_native_trace() returns the program counter at which
+// the trace was left.
+struct native_trace *compile_trace(ijvm *m, const trace_insn *insns, unsigned int length);
+uint32_t run_native_trace(ijvm *m, struct native_trace *trace);
+void free_native_trace(struct native_trace *trace);
+
+#endif
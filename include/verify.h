@@ -0,0 +1,39 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "ijvm.h"
+
+// Load time verifier, run by init_ijvm() on the decoded program (decode.h).
+//
+// Checks once what the interpreter would otherwise check on every
+// instruction. Starting from pc 0 and from every method called through
+// INVOKEVIRTUAL, it follows the control flow of each method and works out
+// the operand stack depth at every instruction, relative to the depth the
+// method started at. A program verifies if, in every method:
+//
+//  - every instruction is reached with one depth, whatever the path to it
+//  - no instruction pops more than the method pushed
+//  - local variable indices are within the frame given by the method header
+//    (main has no header, its frame is large enough for any index)
+//  - IRETURN has a word to return, and main has none
+//  - no DOP_SLOW entry is reachable. The decoder leaves everything it could
+//    not resolve as DOP_SLOW: invalid opcodes and WIDE forms, branches
+//    leaving the text, constant indices outside the pool, bad method
+//    addresses and truncated instructions.
+//
+// A verified program can not underflow the operand stack of a frame, return
+// without a frame or access locals outside its frame (so it never
+// overwrites the saved words of a frame, see interp.h). The verifier also
+// records how deep the operand stack of each method gets (max_stack in
+// decode.h), so a call checks once that the stack has room for the whole
+// frame, operand stack included. The threaded interpreter then runs the
+// program without checks on the stack operations, after checking for room
+// for m->max_stack words, the deepest of all methods, where it starts.
+// Programs that do not verify run on the checked interpreter.
+
+// Verifies the decoded program of m, sets m->verified, m->max_stack and the
+// max_stack and call_words of every method in m->methods. Returns
+// m->verified.
+bool verify_program(ijvm *m);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef X86_H
+#define X86_H
+
+#include <stddef.h>
+#include "ijvm.h"
+
+// Machine code emission shared by the native code generators (jit.c for
+// methods and traces, osr.c for the optimizing tier). Only available on
+// x86-64 systems with mmap().
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define HAVE_X86_JIT 1
+
+typedef struct emitter {
+  byte *buf;
+  size_t pos;
+} emitter;
+
+// Allocates size bytes for code, writable until seal_code() makes them
+// executable instead. Return NULL / false on failure.
+byte *alloc_code(size_t size);
+bool seal_code(byte *code, size_t size);
+void free_code(byte *code, size_t size);
+
+void emit(emitter *e, const byte *bytes, size_t n);
+void emit32(emitter *e, uint32_t value);
+void emit64(emitter *e, uint64_t value);
+
+// emits the bytes given as arguments
+#define EMIT(e, ...) do { \
+    static const byte bytes_[] = { __VA_ARGS__ }; \
+    emit((e), bytes_, sizeof(bytes_)); \
+  } while (0)
+
+// Stores the rel32 operand at pos that makes it jump to dest.
+void patch_rel32(emitter *e, size_t pos, size_t dest);
+
+// jcc rel32 (cc is the second opcode byte, e.g. JE) or jmp rel32 (cc == 0)
+// to dest. Jumps to code that is not emitted yet are patched later with
+// patch_rel32().
+void emit_jump(emitter *e, byte cc, size_t dest);
+
+// condition codes, the inverse condition differs in the lowest bit
+#define JB 0x82
+#define JAE 0x83
+#define JE 0x84
+#define JNE 0x85
+#define JBE 0x86
+#define JA 0x87
+#define JL 0x8C
+#define JGE 0x8D
+
+// Saves the callee-saved registers of the C caller, aligns the stack for
+// calls (leaving 8 bytes at [rsp] for the code to use) and keeps the first
+// argument in r14.
+void emit_save_registers(emitter *e);
+
+// Restores them and returns to the C caller.
+void emit_return(emitter *e);
+
+// Converts the start of generated code to a function pointer of type T.
+#define CODE_AS(T, fn, code) do { \
+    void *code_ = (code); \
+    memcpy(&(fn), &code_, sizeof(fn)); /* object to function pointer */ \
+  } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include "ijvm.h"
+#include "arena.h"
+#include "stack.h"
+
+// See arena.h.
+
+#define ALIGN 16
+
+struct arena_block {
+  arena_block *next;
+  size_t size;
+  size_t used;
+  _Alignas(ALIGN) byte data[];
+};
+
+static size_t align(size_t size)
+{
+  return (size + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+ijvm_arena *create_arena(void)
+{
+  ijvm_arena *arena = malloc(sizeof(ijvm_arena));
+  if (arena == NULL) {
+    return NULL;
+  }
+  arena->block = NULL;
+  arena->size = 0;
+  arena->used = 0;
+  arena->extra = NULL;
+  arena->extra_size = 0;
+  arena->stack = NULL;
+  arena->stack_max = 0;
+  arena->in_use = false;
+  return arena;
+}
+
+static void free_extra(ijvm_arena *arena)
+{
+  while (arena->extra != NULL) {
+    arena_block *next = arena->extra->next;
+    free(arena->extra);
+    arena->extra = next;
+  }
+  arena->extra_size = 0;
+}
+
+void destroy_arena(ijvm_arena *arena)
+{
+  if (arena == NULL) {
+    return;
+  }
+  free_extra(arena);
+  free(arena->block);
+  unmap_arena_stack(arena);
+  free(arena);
+}
+
+bool arena_reserve(ijvm_arena *arena, size_t size)
+{
+  if (arena->size - arena->used >= size) {
+    return true;
+  }
+  if (arena->used != 0 || arena->extra != NULL) {
+    return true; // arena_alloc() adds blocks as needed
+  }
+  byte *block = malloc(size);
+  if (block == NULL) {
+    return false;
+  }
+  free(arena->block);
+  arena->block = block;
+  arena->size = size;
+  return true;
+}
+
+void *arena_alloc(ijvm_arena *arena, size_t size)
+{
+  size = align(size);
+  if (arena->size - arena->used >= size) {
+    void *p = arena->block + arena->used;
+    arena->used += size;
+    return p;
+  }
+  arena_block *extra = arena->extra;
+  if (extra == NULL || extra->size - extra->used < size) {
+    size_t block_size = size > arena->size ? size : arena->size;
+    extra = malloc(sizeof(arena_block) + block_size);
+    if (extra == NULL) {
+      return NULL;
+    }
+    extra->next = arena->extra;
+    extra->size = block_size;
+    extra->used = 0;
+    arena->extra = extra;
+    arena->extra_size += block_size;
+  }
+  void *p = extra->data + extra->used;
+  extra->used += size;
+  return p;
+}
+
+void arena_reset(ijvm_arena *arena)
+{
+  arena->used = 0;
+  if (arena->extra == NULL) {
+    return;
+  }
+  // one block large enough for all of it next time
+  size_t size = arena->size + arena->extra_size;
+  free_extra(arena);
+  byte *block = malloc(size);
+  if (block != NULL) {
+    free(arena->block);
+    arena->block = block;
+    arena->size = size;
+  }
+}
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "arena.h"
+#include "interp.h"
+#include "util.h"
+
+// Load time decoding pass, see decode.h.
+//
+// Decoding follows the control flow from pc 0 and from every method called
+// through INVOKEVIRTUAL, so method headers and other data inside the text are
+// never mistaken for instructions. The decoded entries are then laid out in
+// text order.
+
+#define NO_ENTRY (-1)
+
+// Decodes the instruction at pc into d (everything except the target entry,
+// which is only known after layout). Stores the byte offset of the branch or
+// call target in *target (or text_size + 1 if there is none) and returns
+// whether execution can fall through to pc + d->size.
+static bool decode_insn(ijvm *m, uint32_t pc, decoded_insn *d, uint32_t *target)
+{
+  byte *text = m->text;
+  uint32_t text_size = m->text_size;
+
+  d->op = DOP_SLOW;
+  d->size = 1;
+  d->local = 0;
+  d->arg = 0;
+  d->target = 0;
+  d->pc = pc;
+  *target = text_size + 1;
+
+  bool falls_through = true;
+  switch (text[pc]) {
+    case OP_NOP: d->op = DOP_NOP; break;
+    case OP_DUP: d->op = DOP_DUP; break;
+    case OP_POP: d->op = DOP_POP; break;
+    case OP_SWAP: d->op = DOP_SWAP; break;
+    case OP_IADD: d->op = DOP_IADD; break;
+    case OP_ISUB: d->op = DOP_ISUB; break;
+    case OP_IAND: d->op = DOP_IAND; break;
+    case OP_IOR: d->op = DOP_IOR; break;
+    case OP_IN: d->op = DOP_IN; break;
+    case OP_OUT: d->op = DOP_OUT; break;
+    case OP_IRETURN: d->op = DOP_IRETURN; falls_through = false; break;
+    case OP_HALT: d->op = DOP_HALT; falls_through = false; break;
+    case OP_ERR: d->op = DOP_ERR; falls_through = false; break;
+    case OP_NEWARRAY: d->op = DOP_NEWARRAY; break;
+    case OP_IALOAD: d->op = DOP_IALOAD; break;
+    case OP_IASTORE: d->op = DOP_IASTORE; break;
+    case OP_ANEWARRAY: d->op = DOP_ANEWARRAY; break;
+    case OP_AIALOAD: d->op = DOP_AIALOAD; break;
+    case OP_AIASTORE: d->op = DOP_AIASTORE; break;
+    case OP_GC: d->op = DOP_GC; break;
+    case OP_BIPUSH:
+      d->op = DOP_PUSH;
+      d->size = 2;
+      d->arg = (int8_t)text[pc + 1];
+      break;
+    case OP_LDC_W: {
+      uint16_t index = read_uint16(&text[pc + 1]);
+      d->size = 3;
+      if (index < m->constant_pool_count) {
+        d->op = DOP_PUSH;
+        d->arg = m->constant_pool[index];
+      }
+      break;
+    }
+    case OP_ILOAD:
+    case OP_ISTORE:
+      d->op = text[pc] == OP_ILOAD ? DOP_ILOAD : DOP_ISTORE;
+      d->size = 2;
+      d->local = text[pc + 1];
+      break;
+    case OP_IINC:
+      d->op = DOP_IINC;
+      d->size = 3;
+      d->local = text[pc + 1];
+      d->arg = (int8_t)text[pc + 2];
+      break;
+    case OP_WIDE:
+      d->local = read_uint16(&text[pc + 2]);
+      switch (text[pc + 1]) {
+        case OP_ILOAD: d->op = DOP_ILOAD; d->size = 4; break;
+        case OP_ISTORE: d->op = DOP_ISTORE; d->size = 4; break;
+        case OP_IINC:
+          d->op = DOP_IINC;
+          d->size = 5;
+          d->arg = (int8_t)text[pc + 4];
+          break;
+        default: falls_through = false; break;
+      }
+      break;
+    case OP_GOTO:
+    case OP_IFEQ:
+    case OP_IFLT:
+    case OP_IF_ICMPEQ: {
+      uint32_t dest = pc + (uint32_t)(int16_t)read_uint16(&text[pc + 1]);
+      d->size = 3;
+      if (dest < text_size) {
+        switch (text[pc]) {
+          case OP_GOTO: d->op = DOP_GOTO; falls_through = false; break;
+          case OP_IFEQ: d->op = DOP_IFEQ; break;
+          case OP_IFLT: d->op = DOP_IFLT; break;
+          default: d->op = DOP_IF_ICMPEQ; break;
+        }
+        *target = dest;
+      }
+      break;
+    }
+    case OP_INVOKEVIRTUAL: {
+      uint16_t index = read_uint16(&text[pc + 1]);
+      d->size = 3;
+      if (index >= m->constant_pool_count || m->methods[index].pc == 0) {
+        break;
+      }
+      d->op = DOP_INVOKEVIRTUAL;
+      d->local = m->methods[index].arg_count;
+      d->arg = index;
+      *target = m->methods[index].pc;
+      break;
+    }
+    default:
+      falls_through = false;
+      break;
+  }
+
+  if (d->op == DOP_SLOW) {
+    // step() decides where to go from here
+    *target = text_size + 1;
+    return false;
+  }
+  if (pc + d->size > text_size) {
+    // truncated instruction, its operands run into the padding
+    d->op = DOP_SLOW;
+    *target = text_size + 1;
+    return false;
+  }
+  return falls_through;
+}
+
+// Fills in m->methods, see method_info in decode.h. Returns false if it can
+// not be allocated.
+static bool build_method_table(ijvm *m)
+{
+  // one more, so the table is never empty
+  m->methods = arena_alloc(m->arena, (m->constant_pool_count + 1) * sizeof(method_info));
+  if (m->methods == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < m->constant_pool_count; i++) {
+    method_info *method = &m->methods[i];
+    uint32_t method_addr = (uint32_t)m->constant_pool[i];
+    if (m->text_size < 4 || method_addr > m->text_size - 4) {
+      method->pc = 0;
+      method->arg_count = 0;
+      method->local_count = 0;
+      method->frame_size = 0;
+      method->max_stack = 0;
+      method->call_words = 0;
+      continue;
+    }
+    method->pc = method_addr + 4;
+    method->arg_count = read_uint16(&m->text[method_addr]);
+    method->local_count = read_uint16(&m->text[method_addr + 2]);
+    method->frame_size = (uint32_t)method->arg_count + method->local_count;
+    method->max_stack = 0;
+    method->call_words = method->local_count + FRAME_SAVED;
+  }
+  return true;
+}
+
+bool decode_text(ijvm *m)
+{
+  uint32_t text_size = m->text_size;
+  m->code = NULL;
+  m->code_count = 0;
+  m->pc_map = arena_alloc(m->arena, (text_size + 1) * sizeof(int32_t));
+  byte *is_start = calloc(text_size + 1, 1);
+  // every start pushes at most two successors
+  uint32_t *work = malloc((2 * text_size + 1) * sizeof(uint32_t));
+  if (!build_method_table(m) || m->pc_map == NULL || is_start == NULL || work == NULL) {
+    free(is_start);
+    free(work);
+    return false;
+  }
+
+  // find every reachable instruction start
+  unsigned int work_size = 0;
+  work[work_size++] = 0;
+  while (work_size > 0) {
+    uint32_t pc = work[--work_size];
+    if (pc >= text_size || is_start[pc]) {
+      continue;
+    }
+    is_start[pc] = 1;
+
+    decoded_insn d;
+    uint32_t target;
+    if (decode_insn(m, pc, &d, &target)) {
+      work[work_size++] = pc + d.size;
+    }
+    if (target < text_size) {
+      work[work_size++] = target;
+    }
+  }
+
+  // count entries: one per instruction, an extra jump wherever the
+  // fall-through successor is not the next entry (code that jumps into the
+  // middle of another instruction), and the end-of-text entry
+  unsigned int count = 1;
+  uint32_t next_start = text_size;
+  for (uint32_t pc = text_size; pc-- > 0;) {
+    if (!is_start[pc]) {
+      continue;
+    }
+    decoded_insn d;
+    uint32_t target;
+    count++;
+    if (decode_insn(m, pc, &d, &target) && pc + d.size != next_start) {
+      count++;
+    }
+    next_start = pc;
+  }
+
+  free(work);
+  m->code = arena_alloc(m->arena, count * sizeof(decoded_insn));
+  uint32_t *targets = malloc(count * sizeof(uint32_t));
+  if (m->code == NULL || targets == NULL) {
+    free(is_start);
+    free(targets);
+    return false;
+  }
+
+  // lay out the entries in text order, remembering the target offsets
+  for (uint32_t pc = 0; pc <= text_size; pc++) {
+    m->pc_map[pc] = NO_ENTRY;
+  }
+  unsigned int n = 0;
+  for (uint32_t pc = 0; pc < text_size; pc++) {
+    if (!is_start[pc]) {
+      continue;
+    }
+    decoded_insn *d = &m->code[n];
+    m->pc_map[pc] = (int32_t)n;
+    bool falls_through = decode_insn(m, pc, d, &targets[n]);
+    n++;
+
+    uint32_t next = pc + 1;
+    while (next < text_size && !is_start[next]) {
+      next++;
+    }
+    if (falls_through && pc + d->size != next) {
+      decoded_insn *jump = &m->code[n];
+      jump->op = DOP_GOTO;
+      jump->size = 0;
+      jump->local = 0;
+      jump->arg = 0;
+      jump->pc = pc + d->size;
+      targets[n] = pc + d->size;
+      n++;
+    }
+  }
+  m->pc_map[text_size] = (int32_t)n;
+  m->code[n].op = DOP_END;
+  m->code[n].size = 0;
+  m->code[n].local = 0;
+  m->code[n].arg = 0;
+  m->code[n].target = 0;
+  m->code[n].pc = text_size;
+  n++;
+
+  // resolve branch and call targets to entry indices
+  for (unsigned int i = 0; i < n - 1; i++) {
+    m->code[i].target = targets[i] <= text_size ? (uint32_t)m->pc_map[targets[i]] : 0;
+  }
+  m->code_count = n;
+
+  // main has no header, give it room for every local index used
+  m->main_locals = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    byte op = m->code[i].op;
+    if ((op == DOP_ILOAD || op == DOP_ISTORE || op == DOP_IINC) && m->code[i].local >= m->main_locals) {
+      m->main_locals = m->code[i].local + 1u;
+    }
+  }
+
+  d3printf("decoded %u bytes of text into %u instructions\n", text_size, n);
+
+  free(is_start);
+  free(targets);
+  return true;
+}
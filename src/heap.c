@@ -0,0 +1,1411 @@
+#define _DEFAULT_SOURCE // pthreads and sched_yield() under -std=c11
+#ifndef IJVM_NO_THREADS
+#include <pthread.h>
+#include <sched.h>
+#else
+#include <sys/types.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ijvm.h"
+#include "heap.h"
+#include "refmap.h"
+
+// See heap.h.
+
+#ifdef IJVM_NO_THREADS
+// Built without threads (see heap.h): the marker and the workers never
+// start, which the heap already copes with, and there is nothing to lock.
+// The types are still there, in <sys/types.h>.
+#define pthread_create(thread, attr, start, arg) ((void)(start), -1)
+#define pthread_join(thread, result) ((void)0)
+#define pthread_mutex_init(mutex, attr) ((void)0)
+#define pthread_mutex_destroy(mutex) ((void)0)
+#define pthread_mutex_lock(mutex) ((void)0)
+#define pthread_mutex_unlock(mutex) ((void)0)
+#define pthread_cond_init(cond, attr) ((void)0)
+#define pthread_cond_destroy(cond) ((void)0)
+#define pthread_cond_wait(cond, mutex) ((void)0)
+#define pthread_cond_signal(cond) ((void)0)
+#define pthread_cond_broadcast(cond) ((void)0)
+#define sched_yield() ((void)0)
+#endif
+
+#define HEAP_CLASSES 16
+#define HEAP_LARGE 0xFF          // size_class of arrays in the large object space
+
+// words per array of each size class, at most half again the one before so
+// no more than a third of a slab is wasted on rounding up
+static const uint16_t class_words[HEAP_CLASSES] = {
+  1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, HEAP_SMALL_WORDS
+};
+
+typedef struct heap_cell {
+  word *data;           // the elements, NULL once the array is freed
+  uint32_t length;
+  byte size_class;      // index in class_words (where it goes when promoted,
+                        // for a young array), or HEAP_LARGE
+  byte age;             // minor collections survived in the nursery
+} heap_cell;
+
+typedef struct heap_slab {
+  struct heap_slab *next;
+  word data[];
+} heap_slab;
+
+typedef struct size_class {
+  word *bump;           // next unused array in the current slab
+  word *end;
+  heap_slab *slabs;     // all of them, the current one first
+  word **free;          // freed arrays, taken before bumping
+  uint32_t free_count;
+  uint32_t free_capacity;
+  uint32_t slots;       // arrays its slabs have room for
+  uint32_t live;        // arrays in them
+} size_class;
+
+// The bitmaps have a bit per handle, in words of 64.
+#define BIT(index) (1ull << ((index) % 64))
+#define HAS(bitmap, index) (((bitmap)[(index) / 64] & BIT(index)) != 0)
+#define IS_HANDLE(v) (((uint32_t)(v) & ~(uint32_t)HANDLE_MASK) == HANDLE_TAG)
+
+struct heap {
+  heap_cell *cells;     // the handle table, indexed by the handle
+  uint32_t cell_count;  // handles given out so far
+  uint32_t cell_capacity; // a multiple of 64
+  uint64_t *in_use;     // whether the handle's array is live
+  uint64_t *young;      // whether it is in the nursery
+  uint64_t *marks;      // whether the collector reached it
+  uint64_t *cards;      // old arrays that may refer to young ones
+  uint32_t *free_handles; // freed handles, reused last freed first
+  uint32_t free_handle_count;
+  uint32_t *mark_stack; // handles marked but not scanned yet, each at most once
+  uint32_t *young_handles; // the handles of the young arrays
+  uint32_t young_count;
+
+  // the nursery, two halves of nursery_words, allocating from one of them
+  word *nursery[2];
+  int current;
+  size_t nursery_words;
+  word *young_bump;
+  word *young_end;
+  bool promotion_failed; // see collect_young()
+
+  // the words on the stack that may be references, see find_roots()
+  const word *roots;
+  size_t root_count;
+  word *root_copy;
+  size_t root_capacity;
+
+  // incremental marking of the old generation, see heap.h
+  bool marking;         // a cycle is under way
+  uint32_t *grey;       // old arrays marked but not scanned yet
+  uint32_t grey_count;
+  bool scanning;        // stopped halfway through scanned, before scan_pos
+  uint32_t scanned;
+  uint32_t scan_pos;
+  size_t old_bytes;     // in the elements of old arrays
+  size_t next_cycle;    // old_bytes that starts the next cycle
+  size_t black_bytes;   // of them allocated or promoted during the cycle
+  word satb[SATB_LOG_WORDS]; // references IASTORE overwrote, to be marked
+  uint32_t satb_count;
+
+  // the marker thread, see heap.h
+  bool marker_started;
+  bool marker_quit;
+  bool marked;          // it is out of grey arrays, the cycle can finish
+  pthread_t marker;
+  pthread_mutex_t lock; // held by the marker while it marks, and by the
+                        // machine while it changes what the marker reads
+  pthread_cond_t marker_wake;
+
+  size_class classes[HEAP_CLASSES];
+  byte class_of[HEAP_SMALL_WORDS + 1]; // the size class for a length
+  ijvm_gc_options options;
+  struct mark_pool *pool; // the threads marking in parallel, if any
+  ijvm_heap_stats stats; // reserved is worked out when asked for
+  size_t slab_bytes;
+  size_t large_bytes;
+};
+
+static struct heap *create_heap(void)
+{
+  struct heap *h = calloc(1, sizeof(struct heap));
+  if (h == NULL) {
+    return NULL;
+  }
+  byte c = 0;
+  for (uint32_t length = 0; length <= HEAP_SMALL_WORDS; length++) {
+    while (class_words[c] < length) {
+      c++;
+    }
+    h->class_of[length] = c;
+  }
+  h->options.nursery_bytes = NURSERY_BYTES;
+  h->options.promote_after = PROMOTE_AFTER;
+  h->options.mark_threads = 1;
+  h->next_cycle = CYCLE_START_BYTES;
+  pthread_mutex_init(&h->lock, NULL);
+  pthread_cond_init(&h->marker_wake, NULL);
+  return h;
+}
+
+// Arrays of size class c a slab holds.
+static uint32_t slab_slots(byte c)
+{
+  return (uint32_t)((HEAP_SLAB_BYTES - sizeof(heap_slab)) / sizeof(word) / class_words[c]);
+}
+
+// Slabs are mapped on their own, so compaction can give them back to the
+// system.
+static heap_slab *map_slab(void)
+{
+  void *slab = mmap(NULL, HEAP_SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return slab == MAP_FAILED ? NULL : slab;
+}
+
+// The next array of size class c, zeroed, NULL if there is no memory left.
+static word *allocate_small(struct heap *h, byte c)
+{
+  size_class *sc = &h->classes[c];
+  uint32_t words = class_words[c];
+  if (sc->free_count > 0) {
+    word *data = sc->free[--sc->free_count];
+    memset(data, 0, words * sizeof(word));
+    sc->live++;
+    return data;
+  }
+  if ((size_t)(sc->end - sc->bump) < words) {
+    heap_slab *slab = map_slab();
+    if (slab == NULL) {
+      return NULL;
+    }
+    slab->next = sc->slabs;
+    sc->slabs = slab;
+    h->slab_bytes += HEAP_SLAB_BYTES;
+    sc->slots += slab_slots(c);
+    sc->bump = slab->data;
+    sc->end = slab->data + slab_slots(c) * words;
+  }
+  word *data = sc->bump;
+  sc->bump += words;
+  sc->live++;
+  return data;
+}
+
+static bool grow(void **p, size_t size)
+{
+  void *q = realloc(*p, size);
+  if (q == NULL) {
+    return false;
+  }
+  *p = q;
+  return true;
+}
+
+// Makes room for more handles. Every per-handle array is as large as the
+// table, so pushing a handle never needs to check for room.
+static bool grow_cells(struct heap *h)
+{
+  uint32_t capacity = h->cell_capacity == 0 ? 64 : h->cell_capacity * 2;
+  if (capacity > HANDLE_MASK + 1u) {
+    capacity = HANDLE_MASK + 1u;
+  }
+  if (capacity == h->cell_capacity) {
+    return false; // out of handles
+  }
+  uint32_t old_words = h->cell_capacity / 64;
+  uint32_t words = capacity / 64;
+  uint64_t **bitmaps[] = { &h->in_use, &h->young, &h->marks, &h->cards };
+  if (!grow((void **)&h->cells, capacity * sizeof(heap_cell))
+      || !grow((void **)&h->free_handles, capacity * sizeof(uint32_t))
+      || !grow((void **)&h->mark_stack, capacity * sizeof(uint32_t))
+      || !grow((void **)&h->young_handles, capacity * sizeof(uint32_t))
+      || !grow((void **)&h->grey, capacity * sizeof(uint32_t))) {
+    return false; // the ones that did grow just have room to spare
+  }
+  for (size_t k = 0; k < sizeof(bitmaps) / sizeof(bitmaps[0]); k++) {
+    if (!grow((void **)bitmaps[k], words * sizeof(uint64_t))) {
+      return false;
+    }
+    memset(*bitmaps[k] + old_words, 0, (words - old_words) * sizeof(uint64_t));
+  }
+  h->cell_capacity = capacity;
+  return true;
+}
+
+static void collect_young(ijvm *m);
+static void start_cycle(ijvm *m);
+static void *marker_main(void *arg);
+static void flush_satb(struct heap *h);
+static void mark_slice(struct heap *h, size_t budget);
+
+// Only needed while the marker thread may be running.
+static void lock_heap(struct heap *h)
+{
+  if (h->marker_started) {
+    pthread_mutex_lock(&h->lock);
+  }
+}
+
+static void unlock_heap(struct heap *h)
+{
+  if (h->marker_started) {
+    pthread_mutex_unlock(&h->lock);
+  }
+}
+
+// The most elements marking scans at a time, when not set by pause_words.
+static size_t batch_words(struct heap *h)
+{
+  return h->options.pause_words > 0 ? h->options.pause_words : MARK_BATCH_WORDS;
+}
+
+// A zeroed young array of length words, NULL if it does not fit in the
+// nursery even after a minor collection.
+static word *allocate_young(ijvm *m, uint32_t length)
+{
+  struct heap *h = m->heap;
+  if (h->nursery[0] == NULL) {
+    size_t words = h->options.nursery_bytes / sizeof(word);
+    if (words < HEAP_SMALL_WORDS) {
+      return NULL; // no nursery
+    }
+    h->nursery[0] = malloc(words * sizeof(word));
+    h->nursery[1] = malloc(words * sizeof(word));
+    if (h->nursery[0] == NULL || h->nursery[1] == NULL) {
+      free(h->nursery[0]);
+      free(h->nursery[1]);
+      h->nursery[0] = NULL;
+      h->nursery[1] = NULL;
+      return NULL;
+    }
+    h->nursery_words = words;
+    h->current = 0;
+    h->young_bump = h->nursery[0];
+    h->young_end = h->nursery[0] + words;
+  }
+  if ((size_t)(h->young_end - h->young_bump) < length) {
+    collect_young(m);
+    if ((size_t)(h->young_end - h->young_bump) < length) {
+      return NULL; // full of survivors
+    }
+  }
+  word *data = h->young_bump;
+  h->young_bump += length;
+  memset(data, 0, length * sizeof(word));
+  return data;
+}
+
+static bool allocate_array(ijvm *m, word count, word *ref)
+{
+  struct heap *h = m->heap;
+  if (h->marking && (!h->marker_started || h->old_bytes >= 2 * h->next_cycle)) {
+    // marking in slices, or helping a marker thread that is falling behind
+    mark_slice(h, batch_words(h));
+  } else if (h->marking && h->marked) {
+    mark_slice(h, SIZE_MAX); // the final remark
+  } else if (!h->marking && (h->options.pause_words > 0 || h->options.concurrent_marking)
+             && h->old_bytes >= h->next_cycle) {
+    start_cycle(m);
+  }
+  if (h->free_handle_count == 0 && h->cell_count == h->cell_capacity && !grow_cells(h)) {
+    fprintf(stderr, "Out of heap memory\n");
+    m->done = true;
+    return false;
+  }
+
+  uint32_t length = (uint32_t)count;
+  byte cls = HEAP_LARGE;
+  bool young = false;
+  word *data;
+  if (length <= HEAP_SMALL_WORDS) {
+    cls = h->class_of[length];
+    data = allocate_young(m, length); // may collect, before a handle is taken
+    young = data != NULL;
+    if (!young) {
+      data = allocate_small(h, cls);
+    }
+  } else {
+    data = calloc(length, sizeof(word));
+    h->large_bytes += data != NULL ? length * sizeof(word) : 0;
+  }
+  if (data == NULL) {
+    fprintf(stderr, "Out of heap memory\n");
+    m->done = true;
+    return false;
+  }
+
+  uint32_t index = h->free_handle_count > 0 ? h->free_handles[--h->free_handle_count] : h->cell_count++;
+  heap_cell *cell = &h->cells[index];
+  cell->data = data;
+  cell->length = length;
+  cell->size_class = cls;
+  cell->age = 0;
+  h->in_use[index / 64] |= BIT(index);
+  if (young) {
+    h->young[index / 64] |= BIT(index);
+    h->young_handles[h->young_count++] = index;
+  } else {
+    h->old_bytes += length * sizeof(word);
+    if (h->marking) {
+      h->marks[index / 64] |= BIT(index); // black, it holds nothing yet
+      h->black_bytes += length * sizeof(word);
+    }
+  }
+  h->stats.arrays++;
+  h->stats.used += length * sizeof(word);
+  *ref = (word)(HANDLE_TAG | index);
+  return true;
+}
+
+bool new_array(ijvm *m, word count, word *ref)
+{
+  if (count < 0) {
+    fprintf(stderr, "Invalid array size: %d\n", count);
+    m->done = true;
+    return false;
+  }
+  if (m->heap == NULL) {
+    m->heap = create_heap();
+    if (m->heap == NULL) {
+      fprintf(stderr, "Out of heap memory\n");
+      m->done = true;
+      return false;
+    }
+  }
+  lock_heap(m->heap);
+  bool allocated = allocate_array(m, count, ref);
+  unlock_heap(m->heap);
+  return allocated;
+}
+
+// Marks the array v refers to grey, if it is an old array not marked yet.
+static void shade(struct heap *h, word v)
+{
+  uint32_t index = (uint32_t)v & HANDLE_MASK;
+  if (!IS_HANDLE(v) || index >= h->cell_count) {
+    return;
+  }
+  if (HAS(h->in_use, index) && !HAS(h->young, index) && !HAS(h->marks, index)) {
+    h->marks[index / 64] |= BIT(index);
+    h->grey[h->grey_count++] = index;
+  }
+}
+
+// Marks grey what IASTORE logged as overwritten.
+static void flush_satb(struct heap *h)
+{
+  uint32_t grey_count = h->grey_count;
+  for (uint32_t k = 0; k < h->satb_count; k++) {
+    shade(h, h->satb[k]);
+  }
+  h->satb_count = 0;
+  if (h->grey_count > grey_count && h->marked) {
+    h->marked = false;
+    pthread_cond_signal(&h->marker_wake);
+  }
+}
+
+// The entry of the live array ref if index is in bounds. Reports an error
+// and finishes m otherwise, returning NULL.
+static heap_cell *element_cell(ijvm *m, word ref, word index)
+{
+  uint32_t i = (uint32_t)ref & HANDLE_MASK;
+  if (m->heap == NULL || !IS_HANDLE(ref) || i >= m->heap->cell_count || !HAS(m->heap->in_use, i)) {
+    fprintf(stderr, "Invalid array reference: %d\n", ref);
+    m->done = true;
+    return NULL;
+  }
+  heap_cell *cell = &m->heap->cells[i];
+  if ((uint32_t)index >= cell->length) {
+    fprintf(stderr, "Array index out of bounds: %d (length %u)\n", index, cell->length);
+    m->done = true;
+    return NULL;
+  }
+  return cell;
+}
+
+word *array_element(ijvm *m, word ref, word index)
+{
+  heap_cell *cell = element_cell(m, ref, index);
+  return cell != NULL ? &cell->data[index] : NULL;
+}
+
+bool array_store(ijvm *m, word ref, word index, word value)
+{
+  heap_cell *cell = element_cell(m, ref, index);
+  if (cell == NULL) {
+    return false;
+  }
+  struct heap *h = m->heap;
+  word old = cell->data[index];
+  if (h->marking && IS_HANDLE(old)) {
+    // the snapshot keeps what this overwrites
+    if (h->satb_count == SATB_LOG_WORDS) {
+      lock_heap(h);
+      flush_satb(h);
+      unlock_heap(h);
+    }
+    h->satb[h->satb_count++] = old;
+  }
+  // the marker thread may be reading it
+  __atomic_store_n(&cell->data[index], value, __ATOMIC_RELAXED);
+  // an old array that may now refer to a young one
+  uint32_t i = (uint32_t)ref & HANDLE_MASK;
+  if (IS_HANDLE(value) && !HAS(h->young, i)) {
+    h->cards[i / 64] |= BIT(i);
+  }
+  return true;
+}
+
+bool is_array(ijvm *m, word v)
+{
+  uint32_t index = (uint32_t)v & HANDLE_MASK;
+  return m->heap != NULL && IS_HANDLE(v) && index < m->heap->cell_count
+         && HAS(m->heap->in_use, index);
+}
+
+bool is_heap_freed(ijvm *m, word reference)
+{
+  uint32_t index = (uint32_t)reference & HANDLE_MASK;
+  return m->heap != NULL && IS_HANDLE(reference) && index < m->heap->cell_count
+         && !HAS(m->heap->in_use, index);
+}
+
+// Marks the array v refers to, if it is a reference to a live array that is
+// not marked yet, and pushes it to be scanned.
+static void mark(struct heap *h, word v, uint32_t *top)
+{
+  uint32_t index = (uint32_t)v & HANDLE_MASK;
+  if (!IS_HANDLE(v) || index >= h->cell_count) {
+    return;
+  }
+  if (HAS(h->in_use, index) && !HAS(h->marks, index)) {
+    h->marks[index / 64] |= BIT(index);
+    h->mark_stack[(*top)++] = index;
+  }
+}
+
+// mark() for a minor collection, which only marks young arrays. Marking one
+// is when it survives, its age goes up. Returns whether v refers to a young
+// array that stays in the nursery.
+static bool mark_young(struct heap *h, word v, uint32_t *top)
+{
+  uint32_t index = (uint32_t)v & HANDLE_MASK;
+  if (!IS_HANDLE(v) || index >= h->cell_count || !HAS(h->young, index)) {
+    return false;
+  }
+  heap_cell *cell = &h->cells[index];
+  if (!HAS(h->marks, index)) {
+    h->marks[index / 64] |= BIT(index);
+    h->mark_stack[(*top)++] = index;
+    if (cell->age < UINT8_MAX) {
+      cell->age++;
+    }
+  }
+  return cell->age < h->options.promote_after;
+}
+
+// Gives back the handle of a freed array.
+static void release_handle(struct heap *h, uint32_t index)
+{
+  heap_cell *cell = &h->cells[index];
+  h->stats.arrays--;
+  h->stats.used -= cell->length * sizeof(word);
+  h->in_use[index / 64] &= ~BIT(index);
+  cell->data = NULL;
+  h->free_handles[h->free_handle_count++] = index;
+}
+
+static void free_cell(struct heap *h, uint32_t index)
+{
+  heap_cell *cell = &h->cells[index];
+  h->old_bytes -= cell->length * sizeof(word);
+  if (cell->size_class == HEAP_LARGE) {
+    free(cell->data);
+    h->large_bytes -= cell->length * sizeof(word);
+  } else {
+    size_class *sc = &h->classes[cell->size_class];
+    sc->live--;
+    if (sc->free_count == sc->free_capacity) {
+      uint32_t capacity = sc->free_capacity == 0 ? 64 : sc->free_capacity * 2;
+      if (grow((void **)&sc->free, capacity * sizeof(word *))) {
+        sc->free_capacity = capacity;
+      }
+    }
+    if (sc->free_count < sc->free_capacity) {
+      sc->free[sc->free_count++] = cell->data;
+    } // else it stays unused in its slab
+  }
+  release_handle(h, index);
+}
+
+// Frees the old arrays in use but not marked, clearing their marks. The
+// marks of young arrays are left to evacuate().
+static void sweep(struct heap *h)
+{
+  uint32_t words = (h->cell_count + 63) / 64;
+  for (uint32_t w = 0; w < words; w++) {
+    uint64_t dead = h->in_use[w] & ~h->marks[w] & ~h->young[w];
+    h->marks[w] &= h->young[w];
+    for (; dead != 0; dead &= dead - 1) {
+      free_cell(h, w * 64 + (uint32_t)__builtin_ctzll(dead));
+    }
+  }
+}
+
+// Empties the half of the nursery allocated from: frees the young arrays
+// that are not marked, promotes the marked ones that are old enough (all of
+// them if all is set) into the slabs, and copies the others to the other
+// half, which is allocated from next. Clears the marks of young arrays.
+static void evacuate(struct heap *h, bool all)
+{
+  word *to = h->nursery[!h->current];
+  word *bump = to;
+  uint32_t kept = 0;
+  for (uint32_t k = 0; k < h->young_count; k++) {
+    uint32_t index = h->young_handles[k];
+    heap_cell *cell = &h->cells[index];
+    if (!HAS(h->marks, index)) {
+      h->young[index / 64] &= ~BIT(index);
+      release_handle(h, index);
+      continue;
+    }
+    h->marks[index / 64] &= ~BIT(index);
+    if (all || cell->age >= h->options.promote_after) {
+      word *data = allocate_small(h, cell->size_class);
+      if (data != NULL) {
+        memcpy(data, cell->data, cell->length * sizeof(word));
+        cell->data = data;
+        h->young[index / 64] &= ~BIT(index);
+        h->old_bytes += cell->length * sizeof(word);
+        if (h->marking) {
+          // black: what it refers to is in the snapshot or new
+          h->marks[index / 64] |= BIT(index);
+          h->black_bytes += cell->length * sizeof(word);
+        }
+        continue;
+      }
+      h->promotion_failed = true; // stays young, there is room for it
+    }
+    memcpy(bump, cell->data, cell->length * sizeof(word));
+    cell->data = bump;
+    bump += cell->length;
+    h->young_handles[kept++] = index;
+  }
+  h->young_count = kept;
+  h->current = !h->current;
+  h->young_bump = bump;
+  h->young_end = to + h->nursery_words;
+}
+
+// After a promotion failed, a young array may be referred to from any old
+// one: the next minor collection scans them all.
+static void dirty_all_cards(struct heap *h)
+{
+  uint32_t words = (h->cell_count + 63) / 64;
+  for (uint32_t w = 0; w < words; w++) {
+    h->cards[w] = h->in_use[w] & ~h->young[w];
+  }
+  h->promotion_failed = false;
+}
+
+// Compaction, see heap.h. A slab of the size class being compacted, with
+// its slots taken by live arrays if it is one of those kept.
+typedef struct slab_use {
+  heap_slab *slab;
+  uint32_t live;
+  uint64_t *taken;      // a bit per slot, NULL for a slab given back
+} slab_use;
+
+static int by_address(const void *a, const void *b)
+{
+  const heap_slab *x = ((const slab_use *)a)->slab;
+  const heap_slab *y = ((const slab_use *)b)->slab;
+  return (x > y) - (x < y);
+}
+
+// The fullest first.
+static int by_live(const void *a, const void *b)
+{
+  uint32_t x = ((const slab_use *)a)->live;
+  uint32_t y = ((const slab_use *)b)->live;
+  return x != y ? (x < y) - (x > y) : by_address(a, b);
+}
+
+// The slab data is in, of the count in slabs (sorted by address).
+static slab_use *slab_of(slab_use *slabs, uint32_t count, const word *data)
+{
+  uint32_t lo = 0;
+  uint32_t hi = count;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if ((const byte *)slabs[mid].slab <= (const byte *)data) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return &slabs[lo];
+}
+
+// Whether cell is a live old array of size class c.
+static bool in_class(struct heap *h, uint32_t index, byte c)
+{
+  return HAS(h->in_use, index) && !HAS(h->young, index) && h->cells[index].size_class == c;
+}
+
+// Moves the live arrays of size class c out of its emptiest slabs into the
+// holes of the others and gives the empty slabs back. Returns false, having
+// moved nothing, if there is no memory to work it out.
+static bool compact_class(struct heap *h, byte c)
+{
+  size_class *sc = &h->classes[c];
+  uint32_t words = class_words[c];
+  uint32_t per_slab = slab_slots(c);
+  uint32_t count = sc->slots / per_slab;
+  uint32_t keep = sc->live == 0 ? 1 : (sc->live + per_slab - 1) / per_slab;
+  uint32_t bitmap_words = (per_slab + 63) / 64;
+  slab_use *slabs = malloc(count * sizeof(slab_use));
+  uint64_t *taken = calloc((size_t)keep * bitmap_words, sizeof(uint64_t));
+  uint32_t holes = keep * per_slab - sc->live;
+  if (slabs == NULL || taken == NULL
+      || (holes > sc->free_capacity && !grow((void **)&sc->free, holes * sizeof(word *)))) {
+    free(slabs);
+    free(taken);
+    return false;
+  }
+  if (holes > sc->free_capacity) {
+    sc->free_capacity = holes;
+  }
+
+  // keep the fullest slabs, the fewest arrays move
+  uint32_t n = 0;
+  for (heap_slab *slab = sc->slabs; slab != NULL; slab = slab->next) {
+    slabs[n++] = (slab_use){ slab, 0, NULL };
+  }
+  qsort(slabs, count, sizeof(slab_use), by_address);
+  for (uint32_t i = 0; i < h->cell_count; i++) {
+    if (in_class(h, i, c)) {
+      slab_of(slabs, count, h->cells[i].data)->live++;
+    }
+  }
+  qsort(slabs, count, sizeof(slab_use), by_live);
+  for (uint32_t k = 0; k < keep; k++) {
+    slabs[k].taken = taken + (size_t)k * bitmap_words;
+  }
+  qsort(slabs, count, sizeof(slab_use), by_address);
+  for (uint32_t i = 0; i < h->cell_count; i++) {
+    if (in_class(h, i, c)) {
+      slab_use *u = slab_of(slabs, count, h->cells[i].data);
+      if (u->taken != NULL) {
+        uint32_t slot = (uint32_t)(h->cells[i].data - u->slab->data) / words;
+        u->taken[slot / 64] |= BIT(slot);
+      }
+    }
+  }
+
+  // the others' arrays into the first holes, only the handle table changes
+  uint32_t to = 0;
+  uint32_t slot = 0;
+  for (uint32_t i = 0; i < h->cell_count; i++) {
+    if (!in_class(h, i, c) || slab_of(slabs, count, h->cells[i].data)->taken != NULL) {
+      continue;
+    }
+    while (slabs[to].taken == NULL || HAS(slabs[to].taken, slot)) {
+      if (slabs[to].taken == NULL || ++slot == per_slab) {
+        to++;
+        slot = 0;
+      }
+    }
+    word *data = slabs[to].slab->data + slot * words;
+    memcpy(data, h->cells[i].data, words * sizeof(word));
+    h->cells[i].data = data;
+    slabs[to].taken[slot / 64] |= BIT(slot);
+  }
+
+  // the holes left are the free list, lowest first
+  sc->slabs = NULL;
+  sc->free_count = 0;
+  sc->bump = NULL;
+  sc->end = NULL;
+  for (uint32_t k = count; k-- > 0;) {
+    if (slabs[k].taken == NULL) {
+      munmap(slabs[k].slab, HEAP_SLAB_BYTES);
+      h->slab_bytes -= HEAP_SLAB_BYTES;
+      continue;
+    }
+    slabs[k].slab->next = sc->slabs;
+    sc->slabs = slabs[k].slab;
+    for (uint32_t s = per_slab; s-- > 0;) {
+      if (!HAS(slabs[k].taken, s)) {
+        sc->free[sc->free_count++] = slabs[k].slab->data + s * words;
+      }
+    }
+  }
+  sc->slots = keep * per_slab;
+  free(slabs);
+  free(taken);
+  h->stats.compactions++;
+  return true;
+}
+
+// Compacts the size classes with a slab or more to give back, after the
+// old generation was swept.
+static void compact(struct heap *h)
+{
+  for (byte c = 0; c < HEAP_CLASSES; c++) {
+    size_class *sc = &h->classes[c];
+    uint32_t per_slab = slab_slots(c);
+    uint32_t needed = (sc->live + per_slab - 1) / per_slab;
+    uint32_t holes = sc->slots - sc->live;
+    if (sc->slots / per_slab > (needed > 0 ? needed : 1) && holes >= sc->slots / COMPACT_HOLES) {
+      compact_class(h, c);
+    }
+  }
+}
+
+// Sets h->roots to the words on the stack that may be references, see
+// refmap.h, and returns them. Without memory for a copy of them, all of the
+// stack is.
+static const word *find_roots(ijvm *m)
+{
+  struct heap *h = m->heap;
+  size_t words = (size_t)(m->sp - m->stack);
+  h->roots = m->stack;
+  h->root_count = words;
+  if (words > h->root_capacity) {
+    if (!grow((void **)&h->root_copy, words * sizeof(word))) {
+      return h->roots;
+    }
+    h->root_capacity = words;
+  }
+  h->roots = h->root_copy;
+  h->root_count = stack_roots(m, h->root_copy);
+  return h->roots;
+}
+
+// Minor collection: collects the nursery only. The roots are the stack and
+// the old arrays with their card marked, the only old ones that may refer
+// to young arrays. Afterwards an old array (scanned or just promoted) keeps
+// its card marked only if it refers to an array still in the nursery.
+static void collect_young(ijvm *m)
+{
+  struct heap *h = m->heap;
+  uint32_t top = 0;
+  const word *roots = find_roots(m);
+  for (size_t k = 0; k < h->root_count; k++) {
+    mark_young(h, roots[k], &top);
+  }
+  uint32_t words = (h->cell_count + 63) / 64;
+  for (uint32_t w = 0; w < words; w++) {
+    uint64_t cards = h->cards[w] & h->in_use[w];
+    h->cards[w] = 0;
+    for (; cards != 0; cards &= cards - 1) {
+      uint32_t index = w * 64 + (uint32_t)__builtin_ctzll(cards);
+      heap_cell *cell = &h->cells[index];
+      bool refers_young = false;
+      for (uint32_t k = 0; k < cell->length; k++) {
+        refers_young |= mark_young(h, cell->data[k], &top);
+      }
+      if (refers_young) {
+        h->cards[w] |= BIT(index);
+      }
+    }
+  }
+  while (top > 0) {
+    uint32_t index = h->mark_stack[--top];
+    heap_cell *cell = &h->cells[index];
+    bool refers_young = false;
+    for (uint32_t k = 0; k < cell->length; k++) {
+      refers_young |= mark_young(h, cell->data[k], &top);
+    }
+    if (refers_young && cell->age >= h->options.promote_after) {
+      h->cards[index / 64] |= BIT(index); // about to be promoted
+    }
+  }
+  evacuate(h, false);
+  if (h->promotion_failed) {
+    dirty_all_cards(h);
+  }
+  h->stats.minor_collections++;
+}
+
+// Starts an incremental cycle: marks grey what the roots refer to, the
+// stack and the young arrays, which is the snapshot of the old generation
+// the cycle keeps.
+static void start_cycle(ijvm *m)
+{
+  struct heap *h = m->heap;
+  const word *roots = find_roots(m);
+  for (size_t k = 0; k < h->root_count; k++) {
+    shade(h, roots[k]);
+  }
+  for (uint32_t k = 0; k < h->young_count; k++) {
+    heap_cell *cell = &h->cells[h->young_handles[k]];
+    for (uint32_t i = 0; i < cell->length; i++) {
+      shade(h, cell->data[i]);
+    }
+  }
+  h->marking = true;
+  h->marked = false;
+  if (h->marker_started) {
+    pthread_cond_signal(&h->marker_wake);
+  } else if (h->options.concurrent_marking) {
+    h->marker_started = pthread_create(&h->marker, NULL, marker_main, h) == 0;
+    if (h->marker_started) {
+      pthread_mutex_lock(&h->lock); // as if taken by new_array()
+    }
+  }
+}
+
+// Sweeps the old generation after the grey arrays ran out.
+static void finish_cycle(struct heap *h)
+{
+  sweep(h);
+  h->marking = false;
+  compact(h);
+  // what survived the snapshot, the black arrays may be garbage already
+  size_t live = h->old_bytes - h->black_bytes;
+  h->next_cycle = 2 * live > CYCLE_START_BYTES ? 2 * live : CYCLE_START_BYTES;
+  h->black_bytes = 0;
+  h->stats.collections++;
+}
+
+// Scans grey arrays, about budget elements of them. A large array may take
+// several calls. Returns whether none are left.
+static bool mark_some(struct heap *h, size_t budget)
+{
+  while (budget > 0 && (h->scanning || h->grey_count > 0)) {
+    if (!h->scanning) {
+      h->scanning = true;
+      h->scanned = h->grey[--h->grey_count];
+      h->scan_pos = 0;
+      budget--; // zero length arrays are work too
+    }
+    heap_cell *cell = &h->cells[h->scanned];
+    size_t end = cell->length - h->scan_pos > budget ? h->scan_pos + budget : cell->length;
+    budget -= end - h->scan_pos;
+    for (size_t i = h->scan_pos; i < end; i++) {
+      shade(h, __atomic_load_n(&cell->data[i], __ATOMIC_RELAXED));
+    }
+    h->scan_pos = (uint32_t)end;
+    h->scanning = end < cell->length;
+  }
+  h->stats.slices++;
+  return !h->scanning && h->grey_count == 0;
+}
+
+// A slice of marking on the machine's thread, finishing the cycle if it
+// runs out of grey arrays.
+static void mark_slice(struct heap *h, size_t budget)
+{
+  flush_satb(h);
+  if (mark_some(h, budget)) {
+    finish_cycle(h);
+  }
+}
+
+// Marks while a cycle is under way, a batch at a time, until out of grey
+// arrays. The machine finishes the cycle.
+static void *marker_main(void *arg)
+{
+  struct heap *h = arg;
+  pthread_mutex_lock(&h->lock);
+  for (;;) {
+    while (!h->marker_quit && !(h->marking && !h->marked)) {
+      pthread_cond_wait(&h->marker_wake, &h->lock);
+    }
+    if (h->marker_quit) {
+      break;
+    }
+    h->marked = mark_some(h, batch_words(h));
+    // let the machine at the heap
+    pthread_mutex_unlock(&h->lock);
+    sched_yield();
+    pthread_mutex_lock(&h->lock);
+  }
+  pthread_mutex_unlock(&h->lock);
+  return NULL;
+}
+
+static void stop_marker(struct heap *h)
+{
+  if (!h->marker_started) {
+    return;
+  }
+  pthread_mutex_lock(&h->lock);
+  h->marker_quit = true;
+  pthread_cond_signal(&h->marker_wake);
+  pthread_mutex_unlock(&h->lock);
+  pthread_join(h->marker, NULL);
+  h->marker_started = false;
+  h->marker_quit = false;
+}
+
+// Parallel marking. The threads of the pool (the machine's own as thread
+// 0) mark from their share of the stack, each pushing what it marks on a
+// deque of its own (Chase and Lev's) and taking from it until it is empty.
+// Then they steal from the other deques, and they are done when all of them
+// are idle with nothing left to steal. A mark bit is set with an atomic or,
+// so each array is pushed and scanned once. The sweep is split into a chunk
+// of the bitmaps per thread, which only finds the dead arrays: they are
+// freed in handle order afterwards, so the handles given out next are those
+// a collection on one thread would give out.
+
+typedef struct mark_deque {
+  _Alignas(64) int64_t top;      // where the others steal
+  _Alignas(64) int64_t bottom;   // where the owner pushes and takes
+  uint32_t *items;               // capacity of them, used round robin
+  uint32_t capacity;
+} mark_deque;
+
+typedef struct mark_worker {
+  struct mark_pool *pool;
+  unsigned int id;
+} mark_worker;
+
+typedef struct mark_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned int threads;          // the machine's and the workers
+  unsigned int round;            // bumped to start a round
+  unsigned int running;          // workers still in the round
+  bool quit;
+  void (*task)(ijvm *m, unsigned int id);
+  ijvm *m;
+  int idle;                      // threads with nothing left to steal
+  uint64_t *dead;                // what the sweep found, a bitmap
+  mark_deque *deques;            // one per thread
+  mark_worker *workers;
+  pthread_t *handles;            // threads - 1 of them
+} mark_pool;
+
+static void *mark_worker_main(void *arg)
+{
+  mark_worker *w = arg;
+  mark_pool *pool = w->pool;
+  unsigned int round = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->round == round) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    round = pool->round;
+    pthread_mutex_unlock(&pool->lock);
+    pool->task(pool->m, w->id);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void stop_pool(struct heap *h)
+{
+  mark_pool *pool = h->pool;
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (unsigned int k = 0; k + 1 < pool->threads; k++) {
+    pthread_join(pool->handles[k], NULL);
+  }
+  for (unsigned int k = 0; k < pool->threads; k++) {
+    free(pool->deques[k].items);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->dead);
+  free(pool->deques);
+  free(pool->workers);
+  free(pool->handles);
+  free(pool);
+  h->pool = NULL;
+}
+
+// Starts threads - 1 workers, fewer if the system will not have more.
+// Returns NULL if there is not even one.
+static mark_pool *start_pool(unsigned int threads)
+{
+  mark_pool *pool = calloc(1, sizeof(mark_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->deques = aligned_alloc(_Alignof(mark_deque), threads * sizeof(mark_deque));
+  pool->workers = calloc(threads, sizeof(mark_worker));
+  pool->handles = calloc(threads, sizeof(pthread_t));
+  if (pool->deques == NULL || pool->workers == NULL || pool->handles == NULL) {
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->handles);
+    free(pool);
+    return NULL;
+  }
+  memset(pool->deques, 0, threads * sizeof(mark_deque));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->threads = 1;
+  for (unsigned int k = 1; k < threads; k++) {
+    pool->workers[k].pool = pool;
+    pool->workers[k].id = k;
+    if (pthread_create(&pool->handles[k - 1], NULL, mark_worker_main, &pool->workers[k]) != 0) {
+      break;
+    }
+    pool->threads++;
+  }
+  return pool;
+}
+
+// Runs task on every thread of the pool, returning when all are done.
+static void run_pool(ijvm *m, void (*task)(ijvm *m, unsigned int id))
+{
+  mark_pool *pool = m->heap->pool;
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->m = m;
+  pool->running = pool->threads - 1;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  task(m, 0);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void push_deque(mark_deque *d, uint32_t index)
+{
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->items[(uint64_t)b % d->capacity], index, __ATOMIC_RELAXED);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+static bool take_deque(mark_deque *d, uint32_t *index)
+{
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+  if (t > b) {
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  *index = __atomic_load_n(&d->items[(uint64_t)b % d->capacity], __ATOMIC_RELAXED);
+  if (t == b) {
+    // the last one, a thief may be after it too
+    bool won = __atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return won;
+  }
+  return true;
+}
+
+// 1 if it stole *index, 0 if d is empty, -1 if it lost a race for it.
+static int steal_deque(mark_deque *d, uint32_t *index)
+{
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b) {
+    return 0;
+  }
+  *index = __atomic_load_n(&d->items[(uint64_t)t % d->capacity], __ATOMIC_RELAXED);
+  return __atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ? 1 : -1;
+}
+
+// mark(), for any thread.
+static void mark_shared(struct heap *h, mark_deque *d, word v)
+{
+  uint32_t index = (uint32_t)v & HANDLE_MASK;
+  if (!IS_HANDLE(v) || index >= h->cell_count || !HAS(h->in_use, index)) {
+    return;
+  }
+  uint64_t *marks = &h->marks[index / 64];
+  if ((__atomic_load_n(marks, __ATOMIC_RELAXED) & BIT(index)) != 0
+      || (__atomic_fetch_or(marks, BIT(index), __ATOMIC_RELAXED) & BIT(index)) != 0) {
+    return;
+  }
+  push_deque(d, index);
+}
+
+// Steals an array to scan for thread id. Returns false once every thread
+// is out of work.
+static bool steal_work(mark_pool *pool, unsigned int id, uint32_t *index)
+{
+  for (;;) {
+    bool lost = false;
+    for (unsigned int k = 1; k < pool->threads; k++) {
+      int stolen = steal_deque(&pool->deques[(id + k) % pool->threads], index);
+      if (stolen == 1) {
+        return true;
+      }
+      lost |= stolen < 0;
+    }
+    if (lost) {
+      continue;
+    }
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == (int)pool->threads) {
+        return false;
+      }
+      bool found = false;
+      for (unsigned int k = 0; k < pool->threads && !found; k++) {
+        mark_deque *d = &pool->deques[k];
+        found = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) < __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+      }
+      if (found) {
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+static void mark_task(ijvm *m, unsigned int id)
+{
+  struct heap *h = m->heap;
+  mark_pool *pool = h->pool;
+  mark_deque *d = &pool->deques[id];
+  size_t end = h->root_count * (id + 1) / pool->threads;
+  for (size_t k = h->root_count * id / pool->threads; k < end; k++) {
+    mark_shared(h, d, h->roots[k]);
+  }
+  uint32_t index;
+  while (take_deque(d, &index) || steal_work(pool, id, &index)) {
+    heap_cell *cell = &h->cells[index];
+    for (uint32_t k = 0; k < cell->length; k++) {
+      mark_shared(h, d, cell->data[k]);
+    }
+  }
+}
+
+// sweep() for a chunk of the bitmaps, up to freeing.
+static void sweep_task(ijvm *m, unsigned int id)
+{
+  struct heap *h = m->heap;
+  mark_pool *pool = h->pool;
+  uint32_t words = (h->cell_count + 63) / 64;
+  uint32_t end = (uint32_t)((uint64_t)words * (id + 1) / pool->threads);
+  for (uint32_t w = (uint32_t)((uint64_t)words * id / pool->threads); w < end; w++) {
+    pool->dead[w] = h->in_use[w] & ~h->marks[w] & ~h->young[w];
+    h->marks[w] &= h->young[w];
+  }
+}
+
+// Marks and sweeps with the pool, see above. Returns false, having done
+// nothing, if the pool could not be set up.
+static bool parallel_mark_sweep(ijvm *m)
+{
+  struct heap *h = m->heap;
+  if (h->pool == NULL) {
+    h->pool = start_pool(h->options.mark_threads);
+  }
+  mark_pool *pool = h->pool;
+  if (pool == NULL) {
+    return false;
+  }
+  if (pool->threads == 1) {
+    return false; // could not start a worker
+  }
+  uint32_t words = h->cell_capacity / 64;
+  if (!grow((void **)&pool->dead, words * sizeof(uint64_t))) {
+    return false;
+  }
+  for (unsigned int k = 0; k < pool->threads; k++) {
+    mark_deque *d = &pool->deques[k];
+    if (d->capacity < h->cell_capacity) {
+      if (!grow((void **)&d->items, h->cell_capacity * sizeof(uint32_t))) {
+        return false;
+      }
+      d->capacity = h->cell_capacity; // every array is pushed at most once
+    }
+    d->top = 0;
+    d->bottom = 0;
+  }
+  pool->idle = 0;
+  find_roots(m);
+  run_pool(m, mark_task);
+  run_pool(m, sweep_task);
+  uint32_t used = (h->cell_count + 63) / 64;
+  for (uint32_t w = 0; w < used; w++) {
+    for (uint64_t dead = pool->dead[w]; dead != 0; dead &= dead - 1) {
+      free_cell(h, w * 64 + (uint32_t)__builtin_ctzll(dead));
+    }
+  }
+  return true;
+}
+
+// Stop-the-world collection of both generations.
+static void full_collection(ijvm *m)
+{
+  struct heap *h = m->heap;
+  if (h->options.mark_threads < 2 || h->stats.used < PARALLEL_MARK_BYTES || !parallel_mark_sweep(m)) {
+    uint32_t top = 0;
+    const word *roots = find_roots(m);
+    for (size_t k = 0; k < h->root_count; k++) {
+      mark(h, roots[k], &top);
+    }
+    while (top > 0) {
+      heap_cell *cell = &h->cells[h->mark_stack[--top]];
+      for (uint32_t k = 0; k < cell->length; k++) {
+        mark(h, cell->data[k], &top);
+      }
+    }
+    sweep(h);
+  }
+  if (h->nursery[0] != NULL) {
+    // everything left is old, no card is needed
+    evacuate(h, true);
+    memset(h->cards, 0, (h->cell_count + 63) / 64 * sizeof(uint64_t));
+    if (h->promotion_failed) {
+      dirty_all_cards(h);
+    }
+  }
+  compact(h);
+  h->next_cycle = 2 * h->old_bytes > CYCLE_START_BYTES ? 2 * h->old_bytes : CYCLE_START_BYTES;
+  h->stats.collections++;
+}
+
+void collect_garbage(ijvm *m)
+{
+  struct heap *h = m->heap;
+  if (h == NULL) {
+    return;
+  }
+  lock_heap(h);
+  if (h->marking) {
+    mark_slice(h, SIZE_MAX); // all of what is left
+  } else {
+    full_collection(m);
+  }
+  unlock_heap(h);
+}
+
+ijvm_gc_options get_gc_options(ijvm *m)
+{
+  if (m->heap == NULL) {
+    ijvm_gc_options options = { NURSERY_BYTES, PROMOTE_AFTER, 0, 1, false };
+    return options;
+  }
+  return m->heap->options;
+}
+
+bool set_gc_options(ijvm *m, ijvm_gc_options options)
+{
+  if (m->heap == NULL) {
+    m->heap = create_heap();
+    if (m->heap == NULL) {
+      return false;
+    }
+  }
+  struct heap *h = m->heap;
+  if (h->marking) {
+    collect_garbage(m);
+  }
+  stop_marker(h); // started again by the next cycle
+  if (h->nursery[0] != NULL) {
+    full_collection(m); // empties the nursery
+    if (h->young_count > 0) {
+      return false; // promoting failed
+    }
+    free(h->nursery[0]);
+    free(h->nursery[1]);
+    h->nursery[0] = NULL;
+    h->nursery[1] = NULL;
+    h->nursery_words = 0;
+    h->young_bump = NULL;
+    h->young_end = NULL;
+  }
+  if (options.mark_threads != h->options.mark_threads) {
+    stop_pool(h); // started again with the next collection
+  }
+  h->options = options;
+  if (h->options.mark_threads == 0) {
+    h->options.mark_threads = 1;
+  }
+  if (h->options.promote_after == 0) {
+    h->options.promote_after = 1;
+  } else if (h->options.promote_after > UINT8_MAX) {
+    h->options.promote_after = UINT8_MAX; // as old as a cell gets
+  }
+  return true;
+}
+
+ijvm_heap_stats get_heap_stats(ijvm *m)
+{
+  ijvm_heap_stats stats = { 0 };
+  struct heap *h = m->heap;
+  if (h == NULL) {
+    return stats;
+  }
+  lock_heap(h);
+  stats = h->stats;
+  unlock_heap(h);
+  stats.reserved = sizeof(struct heap) + h->slab_bytes + h->large_bytes
+                   + 2 * h->nursery_words * sizeof(word)
+                   + h->cell_capacity * (sizeof(heap_cell) + 4 * sizeof(uint32_t))
+                   + h->cell_capacity / 64 * 4 * sizeof(uint64_t);
+  for (int c = 0; c < HEAP_CLASSES; c++) {
+    stats.reserved += h->classes[c].free_capacity * sizeof(word *);
+  }
+  return stats;
+}
+
+void free_heap(ijvm *m)
+{
+  struct heap *h = m->heap;
+  if (h == NULL) {
+    return;
+  }
+  // no thread may be marking what is freed below
+  stop_pool(h);
+  stop_marker(h);
+  pthread_mutex_destroy(&h->lock);
+  pthread_cond_destroy(&h->marker_wake);
+  for (uint32_t i = 0; i < h->cell_count; i++) {
+    if (h->cells[i].size_class == HEAP_LARGE && h->cells[i].data != NULL) {
+      free(h->cells[i].data);
+    }
+  }
+  for (int c = 0; c < HEAP_CLASSES; c++) {
+    while (h->classes[c].slabs != NULL) {
+      heap_slab *next = h->classes[c].slabs->next;
+      munmap(h->classes[c].slabs, HEAP_SLAB_BYTES);
+      h->classes[c].slabs = next;
+    }
+    free(h->classes[c].free);
+  }
+  free(h->nursery[0]);
+  free(h->nursery[1]);
+  free(h->cells);
+  free(h->free_handles);
+  free(h->mark_stack);
+  free(h->young_handles);
+  free(h->grey);
+  free(h->in_use);
+  free(h->young);
+  free(h->marks);
+  free(h->cards);
+  free(h->root_copy);
+  free(h);
+  m->heap = NULL;
+}
@@ -1,52 +1,181 @@
 #include <stdio.h>  // for getc, printf
 #include <stdlib.h> // malloc, free
+#include <string.h> // memcpy
 #include "ijvm.h" 
+#include "decode.h"
+#include "interp.h"
+#include "ijvm_ext.h"
+#include "trace.h"
+#include "osr.h"
+#include "regir.h"
+#include "verify.h"
+#include "stack.h"
+#include "arena.h"
+#include "heap.h"
+#include "refmap.h"
 #include "util.h" // read this file for debug prints, endianness helper functions
 
 
 // see ijvm.h for descriptions of the below functions
 
 void push (ijvm* m, word val){
-  if (m->stack_size >= m->stack_max) {
-    m->stack_max *= 2;
-    m->stack = realloc(m->stack, m->stack_max * sizeof(word));
-  }
-  m->stack[m->stack_size] = val; // set val to memory location of top of the stack
-  m->stack_size++;
+  *m->sp = val; // set val to memory location of top of the stack, overflow hits a guard page (stack.h)
+  m->sp++;
 }
 
 word pop(ijvm *m){
-  if(m->stack_size == 0){
+  if(m->sp == m->operands){
     fprintf(stderr, "Stack uderflow!");
     exit(1);
   }
-  m->stack_size--;
-  return m->stack[m->stack_size]; // return the stack_top + 1 value 
+  m->sp--;
+  return *m->sp; // return the stack_top + 1 value 
 }
 
 word top(ijvm *m) {
-  if(m->stack_size == 0){
+  if(m->sp == m->operands){
     fprintf(stderr, "Stack empty.");
     exit(1);
   }
-  return m->stack[m->stack_size - 1];
+  return m->sp[-1];
 }
 
-ijvm* init_ijvm(char *binary_path, FILE* input, FILE* output)
+// Frames, see the layout in interp.h.
+
+bool reserve_stack(ijvm *m, uint32_t words)
 {
-  // do not change these first three lines
-  ijvm* m = (ijvm *) malloc(sizeof(ijvm));
-  // note that malloc gives you memory, but gives no guarantees on the initial
-  // values of that memory. It might be all zeroes, or be random data.
-  // It is hence important that you initialize all variables in the ijvm
-  // struct and do not assume these are set to zero.
-  m->in = input;
-  m->out = output;
+  return (size_t)(m->stack + m->stack_max - m->sp) >= words;
+}
+
+unsigned int frame_locals(ijvm *m)
+{
+  if (m->call_depth == 0) {
+    return m->main_locals;
+  }
+  return (unsigned int)(m->operands - FRAME_SAVED - m->lv);
+}
+
+void call_method(ijvm *m, const method_info *method, uint32_t return_pc)
+{
+  uint32_t arg_count = method->arg_count;
+  if ((uint32_t)(m->sp - m->operands) < arg_count) {
+    fprintf(stderr, "Stack uderflow!");
+    exit(1);
+  }
+  // the arguments are in place, the locals and saved words go on top
+  if (!reserve_stack(m, method->call_words)) {
+    stack_overflow(m);
+    return;
+  }
+  unsigned int used = (unsigned int)(m->sp - m->stack) + method->call_words;
+  if (used > m->stack_window) {
+    m->stack_window = used;
+  }
+  if (--m->stack_trim_countdown == 0) {
+    trim_stack(m, false);
+  }
+  memset(m->sp, 0, method->local_count * sizeof(word));
+
+  word *lv = m->sp - arg_count;
+  word *saved = lv + method->frame_size;
+  saved[0] = (word)return_pc;
+  saved[1] = (word)(m->lv - m->stack);
+  saved[2] = (word)(m->operands - m->stack);
+  m->lv = lv;
+  m->operands = saved + FRAME_SAVED;
+  m->sp = m->operands;
+  m->call_depth++;
+  m->program_counter = method->pc;
+}
+
+bool return_method(ijvm *m)
+{
+  if (m->sp == m->operands || m->call_depth == 0) {
+    return false;
+  }
+  word *saved = m->operands - FRAME_SAVED;
+  uint32_t return_pc = (uint32_t)saved[0];
+  uint32_t lv = (uint32_t)saved[1];
+  uint32_t operands = (uint32_t)saved[2];
+  // only wrong if the method stored to locals outside its frame
+  uint32_t frame = (uint32_t)(m->lv - m->stack);
+  if (return_pc > m->text_size || m->pc_map[return_pc] < 0 || lv > operands || operands > frame) {
+    return false;
+  }
+
+  // the return value replaces the OBJREF
+  word value = m->sp[-1];
+  m->sp = m->lv;
+  *m->sp++ = value;
+  m->lv = m->stack + lv;
+  m->operands = m->stack + operands;
+  m->call_depth--;
+  m->program_counter = return_pc;
+  if (--m->stack_trim_countdown == 0) {
+    trim_stack(m, false);
+  }
+  return true;
+}
+
+// The copy of the text step() runs and quickens. Bytes that happen to have
+// the value of a quickened opcode become QUICK_NONE, which step() does not
+// know either, so they are never taken for a checked instruction.
+static byte *copy_quick_text(ijvm *m)
+{
+  byte *quick_text = arena_alloc(m->arena, m->text_size + TEXT_PADDING);
+  if (quick_text == NULL) {
+    return NULL;
+  }
+  for (unsigned int i = 0; i < m->text_size + TEXT_PADDING; i++) {
+    byte op = m->text[i];
+    quick_text[i] = op >= QUICK_FIRST && op <= QUICK_LAST ? QUICK_NONE : op;
+  }
+  return quick_text;
+}
+
+// What a machine with a constant pool and text of these sizes allocates from
+// its arena, give or take the decoded program (see decode_text()).
+static size_t arena_size(uint32_t constant_pool_size, uint32_t text_size)
+{
+  return constant_pool_size
+       + 2 * ((size_t)text_size + TEXT_PADDING)                       // text, quick_text
+       + (constant_pool_size / 4 + 1) * sizeof(method_info)           // methods
+       + ((size_t)text_size + 1) * sizeof(int32_t)                    // pc_map
+       + ((size_t)text_size / 2 + 2) * sizeof(decoded_insn)           // code, about
+       + 8 * 16;                                                      // alignment
+}
+
+// Gives back the memory of m, keeping the arena if the caller provided it.
+static void release_arena(ijvm *m)
+{
+  if (m->own_arena) {
+    destroy_arena(m->arena);
+  } else {
+    arena_reset(m->arena);
+    m->arena->in_use = false;
+  }
+}
 
+// The rest of init_ijvm() and init_ijvm_in(): loads the binary into m, with
+// the memory of arena (NULL for one of its own).
+static ijvm *load_ijvm(ijvm *m, ijvm_arena *arena, char *binary_path)
+{
+  if (arena != NULL && arena->in_use) {
+    free(m);
+    return NULL;
+  }
+  m->own_arena = arena == NULL;
+  m->arena = arena != NULL ? arena : create_arena();
+  if (m->arena == NULL) {
+    free(m);
+    return NULL;
+  }
+  m->arena->in_use = true;
 
   // chapter 1 
   FILE *file = fopen(binary_path, "rb");
   if (file == NULL) { // test to see if file was opened / read
+    release_arena(m);
     free(m);
     return NULL;
   }
@@ -58,6 +187,7 @@ ijvm* init_ijvm(char *binary_path, FILE* input, FILE* output)
   if (magicNum != MAGIC_NUMBER) {
     fprintf(stderr, "Invalid magic num\n");
     fclose(file);
+    release_arena(m);
     free(m);
     return NULL;
   }
@@ -66,7 +196,28 @@ ijvm* init_ijvm(char *binary_path, FILE* input, FILE* output)
 
   fread(buf, 1, 4, file); // read 4byte constant pool size into buffer
   uint32_t constant_pool_size = read_int32(buf);
-  m->constant_pool = (word *)malloc(constant_pool_size); // allocate space for constant_pool
+
+  // look ahead for the text size, the arena is sized from both. Neither can
+  // be larger than the file (a text cut short is read as far as it goes).
+  long pool_start = ftell(file);
+  fseek(file, 0, SEEK_END);
+  uint64_t file_size = (uint64_t)ftell(file);
+  uint32_t text_size = 0;
+  if (fseek(file, pool_start + (long)constant_pool_size + 4, SEEK_SET) == 0
+      && fread(buf, 1, 4, file) == 4) {
+    text_size = read_int32(buf);
+  }
+  if (constant_pool_size > file_size || text_size > file_size
+      || fseek(file, pool_start, SEEK_SET) != 0
+      || !arena_reserve(m->arena, arena_size(constant_pool_size, text_size))) {
+    fprintf(stderr, "Invalid constant pool or text size\n");
+    fclose(file);
+    release_arena(m);
+    free(m);
+    return NULL;
+  }
+
+  m->constant_pool = (word *)arena_alloc(m->arena, constant_pool_size); // allocate space for constant_pool
   m->constant_pool_count = constant_pool_size / 4; // divided by 4 to yield words instead of bytes
 
   for (unsigned int i = 0 ; i < m->constant_pool_count; i++){
@@ -78,39 +229,87 @@ ijvm* init_ijvm(char *binary_path, FILE* input, FILE* output)
 
   fread(buf, 1, 4, file); // read text size into buffer
   m->text_size = read_int32(buf);
-  m->text = (byte *)malloc(m->text_size);
+  m->text = (byte *)arena_alloc(m->arena, m->text_size + TEXT_PADDING);
 
   fread(m->text, 1, m->text_size, file); // read (text_size) bytes of the text into "m->text"
+  for (int i = 0; i < TEXT_PADDING; i++) {
+    m->text[m->text_size + i] = OP_HALT; // see TEXT_PADDING in interp.h
+  }
 
  
-  // chatper 2 stuff
-  m->stack_max = 64;
-  m->stack_size = 0;
-  m->stack = malloc(m->stack_max * sizeof(word));
+  // chatper 2, 4 + 5 stuff, the stack is allocated once main's frame size
+  // is known (decode_text() works it out)
+  m->stack = NULL;
   m->program_counter = 0;
   m->done = false;
 
+  m->engine = ENGINE_INTERPRETER;
+  m->jit = NULL;
+  m->traces = NULL;
+  m->osr = NULL;
+  m->regs = NULL;
+  m->heap = NULL;
+  m->ref_maps = NULL;
+  m->ref_maps_built = false;
+  // pre-decoded instructions for run() (see decode.c), and the text step()
+  // runs (see interp.h)
+  m->quick_text = decode_text(m) ? copy_quick_text(m) : NULL;
+  if (m->quick_text == NULL) {
+    fclose(file);
+    destroy_ijvm(m);
+    return NULL;
+  }
 
+  if (!map_stack(m, m->main_locals + 256)) {
+    fclose(file);
+    destroy_ijvm(m);
+    return NULL;
+  }
+  m->lv = m->stack;
+  m->operands = m->stack + m->main_locals;
+  m->sp = m->operands;
+  m->call_depth = 0;
+  verify_program(m); // lets run() skip the stack checks, see verify.h
+  fuse_superinstructions(m);
+
+  fclose(file);
+  return m;
+}
 
-  //chapter 4 things
-  m->lv_max = 256;
-  m->locals = calloc(m->lv_max, sizeof(word));
-  m->lv = 0;  
-
-  m->control_max = 256;
-  m->control_size = 0;
-  m->control_data = malloc(m->control_max * sizeof(word));
+ijvm* init_ijvm(char *binary_path, FILE* input, FILE* output)
+{
+  // do not change these first three lines
+  ijvm* m = (ijvm *) malloc(sizeof(ijvm));
+  // note that malloc gives you memory, but gives no guarantees on the initial
+  // values of that memory. It might be all zeroes, or be random data.
+  // It is hence important that you initialize all variables in the ijvm
+  // struct and do not assume these are set to zero.
+  m->in = input;
+  m->out = output;
+  return load_ijvm(m, NULL, binary_path);
+}
 
-  return m;
+ijvm *init_ijvm_in(ijvm_arena *arena, char *binary_path, FILE *input, FILE *output)
+{
+  ijvm *m = (ijvm *)malloc(sizeof(ijvm));
+  if (m == NULL) {
+    return NULL;
+  }
+  m->in = input;
+  m->out = output;
+  return load_ijvm(m, arena, binary_path);
 }
 
 void destroy_ijvm(ijvm* m) 
 {
-  free(m->constant_pool);
-  free(m->text);
-  free(m->stack);
-  free(m->locals);
-  free(m->control_data);
+  unmap_stack(m);
+  free_jit(m);
+  free_traces(m);
+  free_osr(m);
+  free_reg_program(m->regs);
+  free_heap(m);
+  free_ref_maps(m);
+  release_arena(m); // everything else, see arena.h
   free(m); // free memory for struct
 }
 
@@ -141,11 +340,11 @@ unsigned int get_program_counter(ijvm* m)
 
 word tos(ijvm* m) 
 {
-  if (m->stack_size == 0) {
+  if (m->sp == m->operands) {
     fprintf(stderr, "Stack is empty.\n");
     exit(1);
   }
-  return m->stack[m->stack_size - 1];
+  return m->sp[-1];
 }
 
 bool finished(ijvm* m) 
@@ -158,29 +357,17 @@ bool finished(ijvm* m)
 
 word get_local_variable(ijvm* m, int i)
 {
-  if (i < 0) {
-    fprintf(stderr, "Invalid local variable access: i=%d\n", i);
+  if (i < 0 || (unsigned int)i >= frame_locals(m)) {
+    fprintf(stderr, "Invalid local variable access: i=%d (frame has %u)\n", i, frame_locals(m));
     exit(1);
   }
-  // If control stack is empty, we are in main(), so frame pointer is 0.
-  // Otherwise, the frame pointer is the last 'lv' saved on the control stack.
-  word frame_pointer;
-  if (m->control_size > 0) {
-        frame_pointer = m->control_data[m->control_size - 2];
-    } else {
-        frame_pointer = 0;
-    }
-
-  if (frame_pointer + i >= m->lv_max) {
-      fprintf(stderr, "Invalid local variable access: fp=%u, i=%d (max %u)\n", frame_pointer, i, m->lv_max);
-      exit(1);
-  }
-  return m->locals[frame_pointer + i];
+  return m->lv[i];
 }
 
 void step(ijvm* m) {
   
-  byte instruction = m->text[m->program_counter];
+  unsigned int insn_pc = m->program_counter; // for quickening, see interp.h
+  byte instruction = m->quick_text[insn_pc];
   m->program_counter++;
   // TODO: implement me
   switch (instruction) {
@@ -302,37 +489,19 @@ void step(ijvm* m) {
         uint16_t index = read_uint16(&m->text[m->program_counter]);
         m->program_counter += 2;
         push(m, get_constant(m, index));
+        m->quick_text[insn_pc] = QUICK_LDC_W;
       }
       break;
       case OP_ILOAD: {
         byte index = m->text[m->program_counter];
         m->program_counter++;
-        word frame_pointer;
-        if (m->control_size > 0) {
-            frame_pointer = m->control_data[m->control_size - 2];
-        } 
-        else {
-            frame_pointer = 0;
-        }
-        push(m, m->locals[frame_pointer + index]);
+        push(m, m->lv[index]);
       }
       break;
        case OP_ISTORE: {
         byte index = m->text[m->program_counter];
         m->program_counter++;
-        word frame_pointer;
-        if (m->control_size > 0) {
-            frame_pointer = m->control_data[m->control_size - 2];
-        } 
-        else {
-            frame_pointer = 0;
-        }
-        m->locals[frame_pointer + index] = pop(m);
-
-
-        if (frame_pointer + index >= m->lv) {
-            m->lv = frame_pointer + index + 1;
-        }
+        m->lv[index] = pop(m);
       }
       break;
       case OP_IINC: {
@@ -340,14 +509,7 @@ void step(ijvm* m) {
         m->program_counter++;
         int16_t constant = (int8_t)m->text[m->program_counter];
         m->program_counter++;
-        word frame_pointer;
-        if (m->control_size > 0) {
-            frame_pointer = m->control_data[m->control_size - 2];
-        } 
-        else {
-            frame_pointer = 0;
-        }
-        m->locals[frame_pointer + index] += constant;
+        m->lv[index] += constant;
       }
       break;
       case OP_WIDE: {
@@ -355,29 +517,21 @@ void step(ijvm* m) {
         m->program_counter++;
         uint16_t index = read_uint16(&m->text[m->program_counter]);
         m->program_counter += 2;
-        word frame_pointer;
-        if (m->control_size > 0) {
-            frame_pointer = m->control_data[m->control_size - 2];
-        } 
-        else {
-            frame_pointer = 0;
-        }
 
         switch (wide_op) {
           case OP_ILOAD:
-            push(m, m->locals[frame_pointer + index]);
+            push(m, m->lv[index]);
+            m->quick_text[insn_pc] = QUICK_WIDE_ILOAD;
             break;
           case OP_ISTORE:
-            m->locals[frame_pointer + index] = pop(m);
-
-            if (frame_pointer + index >= m->lv) {
-                m->lv = frame_pointer + index + 1;
-            }
+            m->lv[index] = pop(m);
+            m->quick_text[insn_pc] = QUICK_WIDE_ISTORE;
             break;
           case OP_IINC: {            
             int8_t constant = (int8_t)m->text[m->program_counter];
             m->program_counter++;
-            m->locals[frame_pointer + index] += constant;
+            m->lv[index] += constant;
+            m->quick_text[insn_pc] = QUICK_WIDE_IINC;
             break;
           }
           default:
@@ -388,61 +542,93 @@ void step(ijvm* m) {
         break;
       }
       case OP_INVOKEVIRTUAL: {
-      
         uint16_t method_index = read_uint16(&m->text[m->program_counter]);
         m->program_counter += 2;
-        uint32_t method_addr = get_constant(m, method_index);
-        uint16_t arg_count = read_uint16(&m->text[method_addr]);
-        uint16_t local_count = read_uint16(&m->text[method_addr + 2]);
-
-        word new_frame_size = arg_count + local_count;
-        if (m->lv + new_frame_size > m->lv_max) {
-          m->lv_max *= 2; 
-          if (m->lv + new_frame_size > m->lv_max) { 
-             m->lv_max = m->lv + new_frame_size;
-          }
-          m->locals = realloc(m->locals, m->lv_max * sizeof(word));
-        }
-
-        if (m->control_size + 2 > m->control_max) {
-            m->control_max *= 2; 
-            m->control_data = realloc(m->control_data, m->control_max * sizeof(word));
-            if (m->control_data == NULL) {
-                fprintf(stderr, "Failed to resize control stack\n");
-                exit(1);
-            }
+        get_constant(m, method_index); // reports a bad index
+        const method_info *method = &m->methods[method_index];
+        if (method->pc == 0) {
+          fprintf(stderr, "Invalid method address: %d\n", m->constant_pool[method_index]);
+          m->done = true;
+          break;
         }
+        call_method(m, method, m->program_counter);
+        m->quick_text[insn_pc] = QUICK_INVOKEVIRTUAL;
+        break;
+      }
 
-        m->control_data[m->control_size++] = m->lv;
-        m->control_data[m->control_size++] = m->program_counter;
-
-        for (int i = arg_count - 1; i >= 0; --i) {
-            m->locals[m->lv + i] = pop(m);
+      // quickened instructions, their operands were checked when they
+      // first ran (see interp.h)
+      case QUICK_LDC_W: {
+        uint16_t index = read_uint16(&m->text[m->program_counter]);
+        m->program_counter += 2;
+        push(m, m->constant_pool[index]);
+        break;
+      }
+      case QUICK_WIDE_ILOAD:
+      case QUICK_WIDE_ISTORE:
+      case QUICK_WIDE_IINC: {
+        uint16_t index = read_uint16(&m->text[m->program_counter + 1]);
+        m->program_counter += 3;
+        if (instruction == QUICK_WIDE_ILOAD) {
+          push(m, m->lv[index]);
+        } else if (instruction == QUICK_WIDE_ISTORE) {
+          m->lv[index] = pop(m);
+        } else {
+          m->lv[index] += (int8_t)m->text[m->program_counter];
+          m->program_counter++;
         }
-
-        m->lv += new_frame_size;
-
-        m->program_counter = method_addr + 4;
+        break;
+      }
+      case QUICK_INVOKEVIRTUAL: {
+        uint16_t method_index = read_uint16(&m->text[m->program_counter]);
+        m->program_counter += 2;
+        call_method(m, &m->methods[method_index], m->program_counter);
         break;
       }
       case OP_IRETURN: {
-        word return_value = pop(m);
+        top(m); // the return value
 
-        if (m->control_size < 2) {
+        if (m->call_depth == 0) {
           fprintf(stderr, "Control stack underflow\n");
           exit(1);
         }
-
-        word prev_pc = m->control_data[m->control_size - 1];
-        word prev_lv = m->control_data[m->control_size - 2];
-        m->control_size -= 2;
-
-        m->lv = prev_lv;
-        m->program_counter = prev_pc;
-
-        push(m, return_value);
+        if (!return_method(m)) {
+          fprintf(stderr, "Broken stack frame\n");
+          exit(1);
+        }
         break;
       }
+      // arrays, see heap.h. The ones of references work the same, only the
+      // stack maps (refmap.h) tell them apart.
+      case OP_NEWARRAY:
+      case OP_ANEWARRAY: {
+        word ref;
+        if (new_array(m, pop(m), &ref)) {
+          push(m, ref);
+        }
+        break;
+      }
+      case OP_IALOAD:
+      case OP_AIALOAD: {
+        word ref = pop(m);
+        word index = pop(m);
+        word *element = array_element(m, ref, index);
+        if (element != NULL) {
+          push(m, *element);
+        }
+        break;
+      }
+      case OP_IASTORE:
+      case OP_AIASTORE: {
+        word ref = pop(m);
+        word index = pop(m);
+        word value = pop(m);
+        array_store(m, ref, index, value);
+        break;
+      }
+      case OP_GC:
+        collect_garbage(m);
+        break;
       default:{
         m->done = true;
       } 
@@ -461,14 +647,29 @@ ijvm* init_ijvm_std(char *binary_path)
   return init_ijvm(binary_path, stdin, stdout);
 }
 
-void run(ijvm* m) 
+static void run_engine(ijvm *m)
 {
-  while (!finished(m)) 
-  {
-    step(m);
+  // all of them behave like calling step() until finished
+  if (m->engine == ENGINE_JIT) {
+    run_jit(m); // see jit.c
+  } else if (m->engine == ENGINE_REGISTER) {
+    run_register(m); // see regvm.c
+  } else {
+    run_threaded(m); // see interp.c, compiles hot loops with ENGINE_TRACING and ENGINE_TIERED
   }
 }
 
+void run(ijvm* m) 
+{
+  run_guarded(m, run_engine); // stack overflow finishes m, see stack.h
+  trim_stack(m, true);
+}
+
+void set_engine(ijvm* m, ijvm_engine engine)
+{
+  m->engine = engine;
+}
+
 
 // Below: methods needed by bonus assignments, see ijvm.h
 // You can leave these unimplemented if you are not doing these bonus 
@@ -481,18 +682,14 @@ int get_call_stack_size(ijvm* m)
 }
 
 
-// Checks if reference is a freed heap array. Note that this assumes that 
-// 
-bool is_heap_freed(ijvm* m, word reference) 
-{
-   // TODO: implement me if doing garbage collection bonus
-   return 0;
-}
+// is_heap_freed() is in heap.c
 
-// Checks if top of stack is a reference
+// Checks if top of stack is a reference: a live array, unless the stack
+// maps know the word is an integer (see refmap.h)
 bool is_tos_reference(ijvm* m)
 {
-	// TODO: implement me if doing precise garbage collection bonus
-	//  using ANEWARRAY, AIALOAD and AIASTORE
-	return 0;
+  if (m->sp == m->operands) {
+    return false;
+  }
+  return tos_kind(m) != SLOT_INT && is_array(m, top(m));
 }
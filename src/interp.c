@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "interp.h"
+#include "heap.h"
+#include "ijvm_ext.h"
+#include "trace.h"
+#include "osr.h"
+#include "stack.h"
+#include "util.h"
+
+// Threaded interpreter used by run().
+//
+// Executes the pre-decoded program (see decode.h) rather than the raw text:
+// operands, branch targets and constants were resolved at load time, so a
+// handler only touches its own decoded entry. Every handler ends with its own
+// indirect jump to the next handler (labels-as-values), so there is no call
+// to step()/finished() and no shared switch per instruction. Anything the
+// decoder could not resolve is handed to step() so both engines behave
+// identically.
+//
+// The top of the operand stack is cached in the locals t0 (top) and t1
+// (second), which the compiler keeps in registers. Which of them are valid
+// is encoded in the handler that runs, not in a variable: every instruction
+// has a variant for each cache state, and each state has its own dispatch
+// table:
+//
+//   state 0: nothing cached, the whole stack is in m->stack
+//   state 1: t0 holds the top of stack
+//   state 2: t0 holds the top, t1 the word below it
+//
+// Words only move between the cache and m->stack (through PUSH() and POP())
+// when an instruction needs more than is cached, or pushes into a full cache.
+// Instructions without cached variants (calls, returns, the heap, halting,
+// step() fallbacks) spill the cache first and run their state 0 handler, so m
+// is consistent whenever control leaves the interpreter.
+//
+// There are two sets of handlers. The checked one does its stack operations
+// with push(), pop() and top(), which check for underflow. Programs that
+// passed the load time verifier (see verify.h) run on the unchecked one,
+// which accesses m->stack directly: the verifier has shown the stack can not
+// underflow, and room for the deepest operand stack is checked once per
+// method call. The IRETURN checks are left out as well. Neither checks for
+// room on a push, overflow runs into a guard page (see stack.h).
+//
+// With ENGINE_TRACING and ENGINE_TIERED, every backward branch also counts
+// how often its target was reached that way, and hands hot loop headers to
+// the engine's compiler (see loop_profile in interp.h) with the cache
+// spilled.
+
+// labels-as-values and computed goto are GNU extensions (gcc and clang)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// continue with the entry n ahead, or at the branch target of entry d, in
+// cache state S
+#define ADVANCE(S, n) do { ip += (n); goto *dispatch##S[ip->op]; } while (0)
+#define NEXT(S) ADVANCE(S, 1)
+#define JUMP_FROM(S, d) do { \
+    decoded_insn *target_ = code + (d)->target; \
+    if (target_ <= ip && loops != NULL) { \
+      ip = target_; \
+      goto back_edge_##S; \
+    } \
+    ip = target_; \
+    goto *dispatch##S[ip->op]; \
+  } while (0)
+#define JUMP(S) JUMP_FROM(S, ip)
+
+#define STORE_LOCAL(d, value) (lv[(d)->local] = (value))
+
+// cache the locals of the current frame
+#define LOAD_FRAME() (lv = m->lv)
+
+// Handler generators, one per stack effect. Each expands to the three state
+// variants name_0, name_1 and name_2. The instruction-specific part is either
+// an expression or an action macro that is given the cache state to continue
+// in (and must end by dispatching).
+
+// no stack effect
+#define NEUTRAL_OP(name, action) \
+  name##_0: { action(0); } \
+  name##_1: { action(1); } \
+  name##_2: { action(2); }
+
+// pushes expr and skips n entries
+#define PUSH_OP(name, n, expr) \
+  name##_0: { t0 = (expr); ADVANCE(1, n); } \
+  name##_1: { word v = (expr); t1 = t0; t0 = v; ADVANCE(2, n); } \
+  name##_2: { word v = (expr); PUSH(t1); t1 = t0; t0 = v; ADVANCE(2, n); }
+
+// pops v, then runs action
+#define POP1_OP(name, action) \
+  name##_0: { word v = POP(); action(0); } \
+  name##_1: { word v = t0; action(0); } \
+  name##_2: { word v = t0; t0 = t1; action(1); }
+
+// pops b (the top) and a, then runs action
+#define POP2_OP(name, action) \
+  name##_0: { word b = POP(); word a = POP(); action(0); } \
+  name##_1: { word b = t0; word a = POP(); action(0); } \
+  name##_2: { word b = t0; word a = t1; action(0); }
+
+// replaces the top v by expr and skips n entries
+#define UNARY_OP(name, n, expr) \
+  name##_0: { word v = POP(); t0 = (expr); ADVANCE(1, n); } \
+  name##_1: { word v = t0; t0 = (expr); ADVANCE(1, n); } \
+  name##_2: { word v = t0; t0 = (expr); ADVANCE(2, n); }
+
+// pops b (the top) and a, pushes expr
+#define BINARY_OP(name, expr) \
+  name##_0: { word b = POP(); word a = POP(); t0 = (expr); NEXT(1); } \
+  name##_1: { word b = t0; word a = POP(); t0 = (expr); NEXT(1); } \
+  name##_2: { word b = t0; word a = t1; t0 = (expr); NEXT(1); }
+
+// pushes first, then second, and skips n entries
+#define PUSH2_OP(name, n, first, second) \
+  name##_0: { t1 = (first); t0 = (second); ADVANCE(2, n); } \
+  name##_1: { PUSH(t0); t1 = (first); t0 = (second); ADVANCE(2, n); } \
+  name##_2: { PUSH(t1); PUSH(t0); t1 = (first); t0 = (second); ADVANCE(2, n); }
+
+// the actions used with the generators above
+#define A_NEXT(S) NEXT(S)
+#define A_DISCARD(S) (void)v; NEXT(S)
+#define A_GOTO(S) JUMP(S)
+#define A_IINC(S) lv[ip->local] += ip->arg; NEXT(S)
+#define A_IINC_GOTO(S) lv[ip->local] += ip->arg; JUMP_FROM(S, &ip[1])
+#define A_ILOAD_IFEQ(S) if (lv[ip->local] == 0) JUMP_FROM(S, &ip[1]); ADVANCE(S, 2)
+#define A_ILOAD_PUSH_IF_ICMPEQ(S) if (lv[ip->local] == ip[1].arg) JUMP_FROM(S, &ip[2]); ADVANCE(S, 3)
+#define A_ISTORE(S) STORE_LOCAL(ip, v); NEXT(S)
+#define A_ISTORE_GOTO(S) STORE_LOCAL(ip, v); JUMP_FROM(S, &ip[1])
+#define A_OUT(S) fprintf(m->out, "%c", v); NEXT(S)
+#define A_IFEQ(S) if (v == 0) JUMP(S); NEXT(S)
+#define A_IFLT(S) if (v < 0) JUMP(S); NEXT(S)
+#define A_PUSH_IF_ICMPEQ(S) if (v == ip->arg) JUMP_FROM(S, &ip[1]); ADVANCE(S, 2)
+#define A_IF_ICMPEQ(S) if (a == b) JUMP(S); NEXT(S)
+#define A_IADD_ISTORE(S) STORE_LOCAL(&ip[1], a + b); ADVANCE(S, 2)
+#define A_ISUB_IFLT(S) if ((word)((uint32_t)a - (uint32_t)b) < 0) JUMP_FROM(S, &ip[1]); ADVANCE(S, 2)
+#define A_IAND_IFEQ(S) if ((a & b) == 0) JUMP_FROM(S, &ip[1]); ADVANCE(S, 2)
+
+bool resync(ijvm *m)
+{
+  while (!finished(m)) {
+    if (m->pc_map[m->program_counter] >= 0) {
+      return true;
+    }
+    step(m);
+  }
+  return false;
+}
+
+void invoke_method(ijvm *m, const decoded_insn *d)
+{
+  call_method(m, &m->methods[d->arg], d->pc + d->size);
+}
+
+static int read_input(ijvm *m)
+{
+  int character = fgetc(m->in);
+  return character == EOF ? 0 : character;
+}
+
+// the backward branch counters of the engine selected for m, if any
+static loop_profile *get_loop_profile(ijvm *m)
+{
+  switch (m->engine) {
+    case ENGINE_TRACING: return get_trace_profile(m);
+    case ENGINE_TIERED: return get_osr_profile(m);
+    default: return NULL;
+  }
+}
+
+// The loop itself is in interp_loop.h, instantiated once with the checked
+// stack operations of ijvm.c and once without checks for verified programs.
+
+#define RUN_LOOP run_checked
+#define CHECKED 1
+#define PUSH(v) push(m, (v))
+#define POP() pop(m)
+#define TOP() top(m)
+#include "interp_loop.h"
+#undef RUN_LOOP
+#undef CHECKED
+#undef PUSH
+#undef POP
+#undef TOP
+
+#define RUN_LOOP run_unchecked
+#define CHECKED 0
+#define PUSH(v) (*m->sp++ = (v))
+#define POP() (*--m->sp)
+#define TOP() (m->sp[-1])
+#include "interp_loop.h"
+#undef RUN_LOOP
+#undef CHECKED
+#undef PUSH
+#undef POP
+#undef TOP
+
+void run_threaded(ijvm *m)
+{
+  if (m->verified) {
+    run_unchecked(m); // leaves the rest to run_checked() if it runs out of memory
+  }
+  run_checked(m);
+}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,332 @@
+// The loop of the threaded interpreter, see interp.c. Included there once
+// for each handler set, with
+//
+//   RUN_LOOP   the name of the function to define
+//   CHECKED    1 to check every stack operation, 0 for verified programs
+//   PUSH(v), POP(), TOP()
+//              the stack operations on m->stack
+//
+// and the handler generators of interp.c defined. Without checks, the loop
+// checks for room for m->max_stack more words when it starts and returns
+// early (with m consistent) if there is none. Calls check for the room their
+// method needs, see verify.h.
+
+static void RUN_LOOP(ijvm *m)
+{
+  void *dispatch0[DOP_COUNT];
+  void *dispatch1[DOP_COUNT];
+  void *dispatch2[DOP_COUNT];
+  for (int i = 0; i < DOP_COUNT; i++) {
+    dispatch1[i] = &&spill_1;
+    dispatch2[i] = &&spill_2;
+  }
+  // instructions that only run with an empty cache
+  dispatch0[DOP_SLOW] = &&op_slow;
+  dispatch0[DOP_END] = &&op_end;
+  dispatch0[DOP_HALT] = &&op_halt;
+  dispatch0[DOP_ERR] = &&op_err;
+  dispatch0[DOP_INVOKEVIRTUAL] = &&op_invokevirtual;
+  dispatch0[DOP_IRETURN] = &&op_ireturn;
+  dispatch0[DOP_NEWARRAY] = &&op_newarray;
+  dispatch0[DOP_IALOAD] = &&op_iaload;
+  dispatch0[DOP_IASTORE] = &&op_iastore;
+  dispatch0[DOP_ANEWARRAY] = &&op_newarray;
+  dispatch0[DOP_AIALOAD] = &&op_iaload;
+  dispatch0[DOP_AIASTORE] = &&op_iastore;
+  dispatch0[DOP_GC] = &&op_gc;
+
+#define CACHED(op, name) \
+  dispatch0[op] = &&name##_0; \
+  dispatch1[op] = &&name##_1; \
+  dispatch2[op] = &&name##_2;
+
+  CACHED(DOP_NOP, op_nop)
+  CACHED(DOP_PUSH, op_push)
+  CACHED(DOP_DUP, op_dup)
+  CACHED(DOP_POP, op_pop)
+  CACHED(DOP_SWAP, op_swap)
+  CACHED(DOP_IADD, op_iadd)
+  CACHED(DOP_ISUB, op_isub)
+  CACHED(DOP_IAND, op_iand)
+  CACHED(DOP_IOR, op_ior)
+  CACHED(DOP_ILOAD, op_iload)
+  CACHED(DOP_ISTORE, op_istore)
+  CACHED(DOP_IINC, op_iinc)
+  CACHED(DOP_GOTO, op_goto)
+  CACHED(DOP_IFEQ, op_ifeq)
+  CACHED(DOP_IFLT, op_iflt)
+  CACHED(DOP_IF_ICMPEQ, op_if_icmpeq)
+  CACHED(DOP_IN, op_in)
+  CACHED(DOP_OUT, op_out)
+  CACHED(DOP_ILOAD_PUSH_IF_ICMPEQ, op_iload_push_if_icmpeq)
+  CACHED(DOP_ILOAD_ILOAD_IADD, op_iload_iload_iadd)
+  CACHED(DOP_ILOAD_ILOAD_ISUB, op_iload_iload_isub)
+  CACHED(DOP_ILOAD_ILOAD, op_iload_iload)
+  CACHED(DOP_ILOAD_PUSH, op_iload_push)
+  CACHED(DOP_ILOAD_IFEQ, op_iload_ifeq)
+  CACHED(DOP_ISTORE_ILOAD, op_istore_iload)
+  CACHED(DOP_ISTORE_GOTO, op_istore_goto)
+  CACHED(DOP_IADD_ISTORE, op_iadd_istore)
+  CACHED(DOP_PUSH_IF_ICMPEQ, op_push_if_icmpeq)
+  CACHED(DOP_PUSH_IADD, op_push_iadd)
+  CACHED(DOP_DUP_IFEQ, op_dup_ifeq)
+  CACHED(DOP_DUP_IADD, op_dup_iadd)
+  CACHED(DOP_ISUB_IFLT, op_isub_iflt)
+  CACHED(DOP_IAND_IFEQ, op_iand_ifeq)
+  CACHED(DOP_IINC_GOTO, op_iinc_goto)
+#undef CACHED
+
+  if (!resync(m)) {
+    return;
+  }
+#if !CHECKED
+  if (!reserve_stack(m, m->max_stack)) {
+    return;
+  }
+#endif
+
+  decoded_insn *code = m->code;
+  decoded_insn *ip = code + m->pc_map[m->program_counter];
+  word *lv;
+  word t0 = 0;
+  word t1 = 0;
+  loop_profile *loops = get_loop_profile(m);
+  LOAD_FRAME();
+
+  goto *dispatch0[ip->op];
+
+  // a backward branch to ip, a loop header (only with a loop profile)
+#define HOT_LOOP() (loops->compiled[ip - code] || ++loops->counters[ip - code] == loops->hot)
+  back_edge_0:
+    if (!HOT_LOOP()) {
+      goto *dispatch0[ip->op];
+    }
+    goto hot_loop;
+  back_edge_1:
+    if (!HOT_LOOP()) {
+      goto *dispatch1[ip->op];
+    }
+    PUSH(t0);
+    goto hot_loop;
+  back_edge_2:
+    if (!HOT_LOOP()) {
+      goto *dispatch2[ip->op];
+    }
+    PUSH(t1);
+    PUSH(t0);
+    goto hot_loop;
+#undef HOT_LOOP
+
+  hot_loop:
+    m->program_counter = ip->pc;
+    loops->enter(m, (uint32_t)(ip - code));
+    if (!resync(m)) {
+      return;
+    }
+    ip = code + m->pc_map[m->program_counter];
+    LOAD_FRAME();
+    goto *dispatch0[ip->op];
+
+  // a cached state reaching an instruction without a variant for it
+  spill_1:
+    PUSH(t0);
+    goto *dispatch0[ip->op];
+
+  spill_2:
+    PUSH(t1);
+    PUSH(t0);
+    goto *dispatch0[ip->op];
+
+  NEUTRAL_OP(op_nop, A_NEXT)
+  NEUTRAL_OP(op_goto, A_GOTO)
+  NEUTRAL_OP(op_iinc, A_IINC)
+  PUSH_OP(op_push, 1, ip->arg)
+  PUSH_OP(op_iload, 1, lv[ip->local])
+  PUSH_OP(op_in, 1, read_input(m))
+  POP1_OP(op_pop, A_DISCARD)
+  POP1_OP(op_istore, A_ISTORE)
+  POP1_OP(op_ifeq, A_IFEQ)
+  POP1_OP(op_iflt, A_IFLT)
+  POP1_OP(op_out, A_OUT)
+  POP2_OP(op_if_icmpeq, A_IF_ICMPEQ)
+  BINARY_OP(op_iadd, a + b)
+  BINARY_OP(op_isub, a - b)
+  BINARY_OP(op_iand, a & b)
+  BINARY_OP(op_ior, a | b)
+
+  op_dup_0:
+    t0 = TOP();
+    NEXT(1);
+  op_dup_1:
+    t1 = t0;
+    NEXT(2);
+  op_dup_2:
+    PUSH(t1);
+    t1 = t0;
+    NEXT(2);
+
+  op_swap_0:
+    t1 = POP();
+    t0 = POP();
+    NEXT(2);
+  op_swap_1:
+    t1 = t0;
+    t0 = POP();
+    NEXT(2);
+  op_swap_2: {
+    word v = t0;
+    t0 = t1;
+    t1 = v;
+    NEXT(2);
+  }
+
+  op_invokevirtual: {
+    invoke_method(m, ip); // checks for room for everything a verified method pushes
+    LOAD_FRAME();
+    ip = code + ip->target; // not a loop, even if the method comes first
+    goto *dispatch0[ip->op];
+  }
+
+  op_ireturn: {
+#if CHECKED
+    if (!return_method(m)) {
+      goto op_slow;
+    }
+    t0 = POP();
+#else
+    // the same as return_method(), the verifier has shown the frame is fine
+    word *saved = m->operands - FRAME_SAVED;
+    m->program_counter = (uint32_t)saved[0];
+    t0 = TOP();
+    m->sp = m->lv;
+    m->lv = m->stack + saved[1];
+    m->operands = m->stack + saved[2];
+    m->call_depth--;
+    if (--m->stack_trim_countdown == 0) {
+      trim_stack(m, false);
+    }
+#endif
+    // the return value goes back into the cache
+    ip = code + m->pc_map[m->program_counter];
+    LOAD_FRAME();
+    goto *dispatch1[ip->op];
+  }
+
+  // arrays, see heap.h. The result goes into the cache. A collection finds
+  // the references on the stack from the program counter, which is past the
+  // instruction as in step() (see refmap.h).
+  op_newarray: {
+    word count = POP();
+    word ref;
+    m->program_counter = ip->pc + 1;
+    if (!new_array(m, count, &ref)) {
+      goto heap_error;
+    }
+    t0 = ref;
+    NEXT(1);
+  }
+
+  op_iaload: {
+    word ref = POP();
+    word index = POP();
+    word *element = array_element(m, ref, index);
+    if (element == NULL) {
+      goto heap_error;
+    }
+    t0 = *element;
+    NEXT(1);
+  }
+
+  op_iastore: {
+    word ref = POP();
+    word index = POP();
+    word value = POP();
+    if (!array_store(m, ref, index, value)) {
+      goto heap_error;
+    }
+    NEXT(0);
+  }
+
+  op_gc:
+    m->program_counter = ip->pc + 1;
+    collect_garbage(m); // the roots are all on m->stack, nothing is cached
+    NEXT(0);
+
+  heap_error:
+    // reported, and m finished, with the operands popped like step() does
+    m->program_counter = ip->pc + 1;
+    return;
+
+  op_err:
+    fprintf(m->out, "!!!Error!!!\n");
+    m->program_counter = ip->pc + 1;
+    m->done = true;
+    return;
+
+  op_halt:
+    m->program_counter = ip->pc + 1;
+    m->done = true;
+    return;
+
+  op_end:
+    m->program_counter = ip->pc;
+    m->done = true;
+    return;
+
+  // superinstructions, see super.c
+
+  NEUTRAL_OP(op_iload_push_if_icmpeq, A_ILOAD_PUSH_IF_ICMPEQ)
+  NEUTRAL_OP(op_iload_ifeq, A_ILOAD_IFEQ)
+  NEUTRAL_OP(op_iinc_goto, A_IINC_GOTO)
+  PUSH_OP(op_iload_iload_iadd, 3, lv[ip->local] + lv[ip[1].local])
+  PUSH_OP(op_iload_iload_isub, 3, lv[ip->local] - lv[ip[1].local])
+  PUSH2_OP(op_iload_iload, 2, lv[ip->local], lv[ip[1].local])
+  PUSH2_OP(op_iload_push, 2, lv[ip->local], ip[1].arg)
+  POP1_OP(op_istore_goto, A_ISTORE_GOTO)
+  POP1_OP(op_push_if_icmpeq, A_PUSH_IF_ICMPEQ)
+  POP2_OP(op_iadd_istore, A_IADD_ISTORE)
+  POP2_OP(op_isub_iflt, A_ISUB_IFLT) // wraps like ISUB
+  POP2_OP(op_iand_ifeq, A_IAND_IFEQ)
+  UNARY_OP(op_push_iadd, 2, v + ip->arg)
+  UNARY_OP(op_dup_iadd, 2, v + v)
+
+  op_istore_iload_0:
+    STORE_LOCAL(ip, POP());
+    t0 = lv[ip[1].local];
+    ADVANCE(1, 2);
+  op_istore_iload_1:
+    STORE_LOCAL(ip, t0);
+    t0 = lv[ip[1].local];
+    ADVANCE(1, 2);
+  op_istore_iload_2:
+    STORE_LOCAL(ip, t0);
+    t0 = lv[ip[1].local];
+    ADVANCE(2, 2);
+
+  op_dup_ifeq_0:
+    if (TOP() == 0) {
+      JUMP_FROM(0, &ip[1]);
+    }
+    ADVANCE(0, 2);
+  op_dup_ifeq_1:
+    if (t0 == 0) {
+      JUMP_FROM(1, &ip[1]);
+    }
+    ADVANCE(1, 2);
+  op_dup_ifeq_2:
+    if (t0 == 0) {
+      JUMP_FROM(2, &ip[1]);
+    }
+    ADVANCE(2, 2);
+
+  op_slow:
+    // let the reference interpreter deal with it
+    m->program_counter = ip->pc;
+    step(m);
+    if (!resync(m)) {
+      return;
+    }
+    ip = code + m->pc_map[m->program_counter];
+    LOAD_FRAME();
+    goto *dispatch0[ip->op];
+}
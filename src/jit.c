@@ -0,0 +1,485 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "interp.h"
+#include "trace.h"
+#include "x86.h"
+#include "util.h"
+
+// Baseline template JIT used by run() with ENGINE_JIT.
+//
+// The decoded program (see decode.h), which holds the main body and every
+// method body reachable through INVOKEVIRTUAL, is compiled in one go the
+// first time it runs: every entry becomes a fixed x86-64 machine code
+// template for its (unfused) op, stitched together in an mmap'd buffer.
+// Branches become direct jumps between templates, so a loop without calls
+// or I/O runs without ever leaving native code.
+//
+// Native code works on the machine state in place, with these registers
+// (all callee-saved, so the code can return straight to C):
+//
+//   rbx  operand stack pointer, m->sp
+//   r15  bottom of the frame's operand stack, m->operands
+//   r13  locals of the current frame, m->lv
+//   r14  m
+//
+// Every template first checks that it can run: enough words on the stack to
+// pop (pushes need no check, overflow hits the guard page above the stack,
+// see stack.h). If not, or if the instruction has no
+// template at all (I/O, halting, anything the decoder left to step()),
+// native code stores the stack pointer back and calls jit_step(), which
+// executes that single instruction with step() and returns where to continue
+// in native code. INVOKEVIRTUAL and IRETURN call helpers of their own that
+// work like the interpreter handlers. Registers are reloaded from m after
+// every call into C, since the frame may have changed. Native code itself
+// never reports errors or changes frames.
+
+#ifdef HAVE_X86_JIT
+
+typedef struct jit_code {
+  byte *code;          // mmap'd, executable
+  size_t size;
+  uint32_t *offsets;   // native offset of the template of every entry
+} jit_code;
+
+// enters native code at target, returns once m is finished
+typedef void (*jit_enter)(ijvm *, void *);
+
+// upper bounds used to size the buffer
+#define PROLOGUE_SIZE 256
+#define STUB_SIZE 10
+#define MAX_TEMPLATE_SIZE 64
+
+// what emit_template() returns besides condition codes
+#define BRANCH_NONE 0
+#define BRANCH_ALWAYS 1
+
+static void *jit_step(ijvm *m, uint32_t index);
+static void *jit_invoke(ijvm *m, uint32_t index);
+static void *jit_return(ijvm *m, uint32_t index);
+
+// Loads the registers native code works with from m (in r14).
+static void emit_load_registers(emitter *e)
+{
+  EMIT(e, 0x49, 0x8B, 0x9E);              // mov rbx, [r14 + sp]
+  emit32(e, offsetof(ijvm, sp));
+  EMIT(e, 0x4D, 0x8B, 0xBE);              // mov r15, [r14 + operands]
+  emit32(e, offsetof(ijvm, operands));
+  EMIT(e, 0x4D, 0x8B, 0xAE);              // mov r13, [r14 + lv]
+  emit32(e, offsetof(ijvm, lv));
+}
+
+// Writes the stack pointer in rbx back to m->sp.
+static void emit_store_sp(emitter *e)
+{
+  EMIT(e, 0x49, 0x89, 0x9E);              // mov [r14 + sp], rbx
+  emit32(e, offsetof(ijvm, sp));
+}
+
+// Emits the shared code: the enter function, the register reload, the code
+// calling a C helper (stored in *call_helper) and the exit. Returns the
+// offset of the slow path, which expects the index of the entry to execute
+// in esi.
+static size_t emit_prologue(emitter *e, size_t *call_helper)
+{
+  // void enter(ijvm *m, void *target)
+  emit_save_registers(e);
+  EMIT(e, 0x48, 0x89, 0xF0);              // mov rax, rsi
+
+  // load the registers from m and continue at rax
+  size_t reload = e->pos;
+  emit_load_registers(e);
+  EMIT(e, 0xFF, 0xE0);                    // jmp rax
+
+  // slow path: run the entry in esi with jit_step()
+  size_t slow = e->pos;
+  EMIT(e, 0x48, 0xBA);                    // mov rdx, jit_step
+  emit64(e, (uint64_t)(uintptr_t)jit_step);
+
+  // call the helper in rdx with m and the entry index in esi, continue at
+  // the address it returns
+  size_t call = e->pos;
+  emit_store_sp(e);
+  EMIT(e, 0x4C, 0x89, 0xF7,               // mov rdi, r14
+          0xFF, 0xD2,                     // call rdx
+          0x48, 0x85, 0xC0);              // test rax, rax
+  emit_jump(e, JNE, reload);
+
+  // finished
+  emit_return(e);
+  *call_helper = call;
+  return slow;
+}
+
+// stack checks, leaving through stub when they fail
+static void need_words(emitter *e, int count, size_t stub)
+{
+  if (count == 1) {
+    EMIT(e, 0x4C, 0x39, 0xFB);            // cmp rbx, r15
+    emit_jump(e, JBE, stub);
+  } else {
+    EMIT(e, 0x49, 0x8D, 0x47, 0x08,       // lea rax, [r15 + 8]
+            0x48, 0x39, 0xC3);            // cmp rbx, rax
+    emit_jump(e, JB, stub);
+  }
+}
+
+// Emits the template of entry d, except for the jump to its branch target,
+// which is left to the caller. Returns BRANCH_NONE if there is none,
+// BRANCH_ALWAYS for a GOTO or the condition code (the second opcode byte of
+// a jcc) on which a conditional branch is taken, with the flags set by the
+// template.
+static byte emit_template(emitter *e, decoded_insn *d, uint32_t index,
+                          size_t stub, size_t call_helper)
+{
+  byte branch = BRANCH_NONE;
+  switch (unfused_op(d->op)) {
+    case DOP_INVOKEVIRTUAL:
+    case DOP_IRETURN: {
+      void *(*helper)(ijvm *, uint32_t) = unfused_op(d->op) == DOP_INVOKEVIRTUAL ? jit_invoke : jit_return;
+      EMIT(e, 0xBE);                      // mov esi, index
+      emit32(e, index);
+      EMIT(e, 0x48, 0xBA);                // mov rdx, helper
+      emit64(e, (uint64_t)(uintptr_t)helper);
+      emit_jump(e, 0, call_helper);
+      break;
+    }
+    case DOP_NOP:
+      break;
+    case DOP_PUSH:
+      EMIT(e, 0xC7, 0x03);                // mov dword [rbx], imm32
+      emit32(e, (uint32_t)d->arg);
+      EMIT(e, 0x48, 0x83, 0xC3, 0x04);    // add rbx, 4
+      break;
+    case DOP_DUP:
+      need_words(e, 1, stub);
+      EMIT(e, 0x8B, 0x43, 0xFC,           // mov eax, [rbx - 4]
+              0x89, 0x03,                 // mov [rbx], eax
+              0x48, 0x83, 0xC3, 0x04);    // add rbx, 4
+      break;
+    case DOP_POP:
+      need_words(e, 1, stub);
+      EMIT(e, 0x48, 0x83, 0xEB, 0x04);    // sub rbx, 4
+      break;
+    case DOP_SWAP:
+      need_words(e, 2, stub);
+      EMIT(e, 0x8B, 0x43, 0xFC,           // mov eax, [rbx - 4]
+              0x8B, 0x4B, 0xF8,           // mov ecx, [rbx - 8]
+              0x89, 0x4B, 0xFC,           // mov [rbx - 4], ecx
+              0x89, 0x43, 0xF8);          // mov [rbx - 8], eax
+      break;
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR: {
+      byte op = unfused_op(d->op);
+      byte alu = op == DOP_IADD ? 0x01 : op == DOP_ISUB ? 0x29 : op == DOP_IAND ? 0x21 : 0x09;
+      need_words(e, 2, stub);
+      EMIT(e, 0x48, 0x83, 0xEB, 0x04,     // sub rbx, 4
+              0x8B, 0x03);                // mov eax, [rbx]
+      byte insn[3] = { alu, 0x43, 0xFC }; // <alu> [rbx - 4], eax
+      emit(e, insn, 3);
+      break;
+    }
+    case DOP_ILOAD:
+      EMIT(e, 0x41, 0x8B, 0x85);          // mov eax, [r13 + local * 4]
+      emit32(e, d->local * 4u);
+      EMIT(e, 0x89, 0x03,                 // mov [rbx], eax
+              0x48, 0x83, 0xC3, 0x04);    // add rbx, 4
+      break;
+    case DOP_ISTORE:
+      need_words(e, 1, stub);
+      EMIT(e, 0x48, 0x83, 0xEB, 0x04,     // sub rbx, 4
+              0x8B, 0x03,                 // mov eax, [rbx]
+              0x41, 0x89, 0x85);          // mov [r13 + local * 4], eax
+      emit32(e, d->local * 4u);
+      break;
+    case DOP_IINC:
+      EMIT(e, 0x41, 0x81, 0x85);          // add dword [r13 + local * 4], imm32
+      emit32(e, d->local * 4u);
+      emit32(e, (uint32_t)d->arg);
+      break;
+    case DOP_GOTO:
+      branch = BRANCH_ALWAYS;
+      break;
+    case DOP_IFEQ:
+    case DOP_IFLT:
+      need_words(e, 1, stub);
+      EMIT(e, 0x48, 0x83, 0xEB, 0x04,     // sub rbx, 4
+              0x83, 0x3B, 0x00);          // cmp dword [rbx], 0
+      branch = unfused_op(d->op) == DOP_IFEQ ? JE : JL;
+      break;
+    case DOP_IF_ICMPEQ:
+      need_words(e, 2, stub);
+      EMIT(e, 0x48, 0x83, 0xEB, 0x08,     // sub rbx, 8
+              0x8B, 0x03,                 // mov eax, [rbx]
+              0x3B, 0x43, 0x04);          // cmp eax, [rbx + 4]
+      branch = JE;
+      break;
+    default:
+      // no template, always leave through the stub
+      emit_jump(e, 0, stub);
+      break;
+  }
+  return branch;
+}
+
+static bool compile(ijvm *m)
+{
+  unsigned int count = m->code_count;
+  size_t size = PROLOGUE_SIZE + (size_t)count * (STUB_SIZE + MAX_TEMPLATE_SIZE);
+  jit_code *jit = malloc(sizeof(jit_code));
+  uint32_t *offsets = malloc(count * sizeof(uint32_t));
+  size_t *branches = malloc(count * sizeof(size_t));
+  byte *buf = alloc_code(size);
+  if (jit == NULL || offsets == NULL || branches == NULL || buf == NULL) {
+    free(jit);
+    free(offsets);
+    free(branches);
+    if (buf != NULL) {
+      free_code(buf, size);
+    }
+    return false;
+  }
+
+  emitter e = { buf, 0 };
+  size_t call_helper;
+  size_t slow = emit_prologue(&e, &call_helper);
+
+  // one stub per entry: mov esi, index; jmp slow
+  size_t stubs = e.pos;
+  for (unsigned int i = 0; i < count; i++) {
+    EMIT(&e, 0xBE);
+    emit32(&e, i);
+    emit_jump(&e, 0, slow);
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    offsets[i] = (uint32_t)e.pos;
+    byte branch = emit_template(&e, &m->code[i], i, stubs + (size_t)i * STUB_SIZE, call_helper);
+    branches[i] = 0;
+    if (branch != BRANCH_NONE) {
+      // jmp or jcc to the target, patched below
+      emit_jump(&e, branch == BRANCH_ALWAYS ? 0 : branch, 0);
+      branches[i] = e.pos - 4;
+    }
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    if (branches[i] != 0) {
+      patch_rel32(&e, branches[i], offsets[m->code[i].target]);
+    }
+  }
+  free(branches);
+
+  if (!seal_code(buf, size)) {
+    free_code(buf, size);
+    free(jit);
+    free(offsets);
+    return false;
+  }
+
+  d3printf("compiled %u instructions into %zu bytes of native code\n", count, e.pos);
+  jit->code = buf;
+  jit->size = size;
+  jit->offsets = offsets;
+  m->jit = jit;
+  return true;
+}
+
+static void *native_entry(ijvm *m, uint32_t index)
+{
+  return m->jit->code + m->jit->offsets[index];
+}
+
+// Called from native code for the entry it could not run itself. Returns
+// where to continue, or NULL once the machine is finished.
+static void *jit_step(ijvm *m, uint32_t index)
+{
+  m->program_counter = m->code[index].pc;
+  if (finished(m)) {
+    return NULL;
+  }
+  step(m);
+  if (!resync(m)) {
+    return NULL;
+  }
+  return native_entry(m, m->pc_map[m->program_counter]);
+}
+
+// INVOKEVIRTUAL and IRETURN, called from native code, continue in native
+// code.
+static void *jit_invoke(ijvm *m, uint32_t index)
+{
+  decoded_insn *d = &m->code[index];
+  invoke_method(m, d);
+  return native_entry(m, d->target);
+}
+
+static void *jit_return(ijvm *m, uint32_t index)
+{
+  if (!return_method(m)) {
+    return jit_step(m, index);
+  }
+  return native_entry(m, m->pc_map[m->program_counter]);
+}
+
+void run_jit(ijvm *m)
+{
+  if (m->jit == NULL && !compile(m)) {
+    run_threaded(m);
+    return;
+  }
+  if (!resync(m)) {
+    return;
+  }
+
+  jit_enter enter;
+  CODE_AS(jit_enter, enter, m->jit->code);
+  enter(m, native_entry(m, m->pc_map[m->program_counter]));
+}
+
+void free_jit(ijvm *m)
+{
+  if (m->jit != NULL) {
+    free_code(m->jit->code, m->jit->size);
+    free(m->jit->offsets);
+    free(m->jit);
+    m->jit = NULL;
+  }
+}
+
+// Traces (see trace.h) are compiled on their own: the recorded instructions
+// in a straight line, with the conditional branches turned into guards that
+// leave the trace when the branch does not go the recorded way, and a jump
+// back to the start at the end. Every exit is a stub that returns the
+// program counter to continue at to C.
+
+typedef struct native_trace {
+  byte *code;
+  size_t size;
+} native_trace;
+
+// uint32_t trace(ijvm *m)
+typedef uint32_t (*trace_fn)(ijvm *);
+
+// emits a stub that leaves the trace at pc
+static size_t emit_trace_exit(emitter *e, uint32_t pc, size_t exit)
+{
+  size_t stub = e->pos;
+  EMIT(e, 0xBA);                          // mov edx, pc
+  emit32(e, pc);
+  emit_jump(e, 0, exit);
+  return stub;
+}
+
+native_trace *compile_trace(ijvm *m, const trace_insn *insns, unsigned int length)
+{
+  size_t size = PROLOGUE_SIZE + (size_t)length * (2 * STUB_SIZE + MAX_TEMPLATE_SIZE);
+  native_trace *trace = malloc(sizeof(native_trace));
+  size_t *stubs = malloc(2 * length * sizeof(size_t));
+  byte *buf = alloc_code(size);
+  if (trace == NULL || stubs == NULL || buf == NULL) {
+    free(trace);
+    free(stubs);
+    if (buf != NULL) {
+      free_code(buf, size);
+    }
+    return NULL;
+  }
+
+  emitter e = { buf, 0 };
+  emit_save_registers(&e);
+  emit_load_registers(&e);
+  EMIT(&e, 0xE9);                         // jmp start, patched below
+  size_t to_start = e.pos;
+  emit32(&e, 0);
+
+  size_t exit = e.pos;
+  emit_store_sp(&e);
+  EMIT(&e, 0x89, 0xD0);                   // mov eax, edx
+  emit_return(&e);
+
+  // two stubs per instruction: leaving before it runs (the stack checks)
+  // and leaving to the branch direction that was not recorded
+  for (unsigned int k = 0; k < length; k++) {
+    decoded_insn *d = &m->code[insns[k].index];
+    uint32_t off_trace = insns[k].taken ? d->pc + d->size : m->code[d->target].pc;
+    stubs[2 * k] = emit_trace_exit(&e, d->pc, exit);
+    stubs[2 * k + 1] = emit_trace_exit(&e, off_trace, exit);
+  }
+
+  size_t start = e.pos;
+  patch_rel32(&e, to_start, start);
+  for (unsigned int k = 0; k < length; k++) {
+    byte branch = emit_template(&e, &m->code[insns[k].index], insns[k].index,
+                                stubs[2 * k], 0); // no calls in traces
+    if (branch != BRANCH_NONE && branch != BRANCH_ALWAYS) {
+      // guard: jcc (or the inverse condition, the low bit) to the exit
+      emit_jump(&e, insns[k].taken ? branch ^ 1 : branch, stubs[2 * k + 1]);
+    }
+  }
+  emit_jump(&e, 0, start);
+  free(stubs);
+
+  if (!seal_code(buf, size)) {
+    free_code(buf, size);
+    free(trace);
+    return NULL;
+  }
+  trace->code = buf;
+  trace->size = size;
+  return trace;
+}
+
+uint32_t run_native_trace(ijvm *m, native_trace *trace)
+{
+  trace_fn fn;
+  CODE_AS(trace_fn, fn, trace->code);
+  return fn(m);
+}
+
+void free_native_trace(native_trace *trace)
+{
+  if (trace != NULL) {
+    free_code(trace->code, trace->size);
+    free(trace);
+  }
+}
+
+#else
+
+// no code generator for this platform
+
+void run_jit(ijvm *m)
+{
+  run_threaded(m);
+}
+
+void free_jit(ijvm *m)
+{
+  (void)m;
+}
+
+struct native_trace *compile_trace(ijvm *m, const trace_insn *insns, unsigned int length)
+{
+  (void)m;
+  (void)insns;
+  (void)length;
+  return NULL;
+}
+
+uint32_t run_native_trace(ijvm *m, struct native_trace *trace)
+{
+  (void)trace;
+  return m->program_counter; // never called, there are no traces
+}
+
+void free_native_trace(struct native_trace *trace)
+{
+  (void)trace;
+}
+
+#endif
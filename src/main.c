@@ -1,25 +1,59 @@
 #include <stdio.h>
+#include <string.h>
 #include "ijvm.h"
+#include "ijvm_ext.h"
 #include "util.h"
 static void print_help(void)
 { 
-  printf("Usage: ./ijvm binary \n"); 
+  printf("Usage: ./ijvm [--jit | --trace | --tiered | --register | --interpreter] binary \n"); 
 }
 
 int main(int argc, char **argv) 
 {
 
-  if (argc < 2) 
+  ijvm_engine engine = ENGINE_INTERPRETER;
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) 
+  {
+    if (strcmp(argv[arg], "--jit") == 0) 
+    {
+      engine = ENGINE_JIT;
+    } 
+    else if (strcmp(argv[arg], "--trace") == 0) 
+    {
+      engine = ENGINE_TRACING;
+    } 
+    else if (strcmp(argv[arg], "--tiered") == 0) 
+    {
+      engine = ENGINE_TIERED;
+    } 
+    else if (strcmp(argv[arg], "--register") == 0) 
+    {
+      engine = ENGINE_REGISTER;
+    } 
+    else if (strcmp(argv[arg], "--interpreter") == 0) 
+    {
+      engine = ENGINE_INTERPRETER;
+    } 
+    else 
+    {
+      print_help();
+      return 1;
+    }
+  }
+
+  if (arg >= argc) 
   {
     print_help();
     return 1;
   }
-  ijvm* m = init_ijvm_std(argv[1]);
+  ijvm* m = init_ijvm_std(argv[arg]);
   if (m == NULL) 
   {
-    fprintf(stderr, "Couldn't load binary %s\n", argv[1]);
+    fprintf(stderr, "Couldn't load binary %s\n", argv[arg]);
     return 1;
   }
+  set_engine(m, engine);
 
   run(m);
 
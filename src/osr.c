@@ -0,0 +1,618 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "osr.h"
+#include "x86.h"
+#include "util.h"
+
+// Optimizing tier and on-stack replacement, see osr.h.
+//
+// A loop is compiled starting from its header: every entry reachable from
+// it through instructions the tier handles is part of the compiled region,
+// the first unhandled instruction on every path is a frontier entry, where
+// the code deoptimizes to the interpreter. Since the depth of the operand
+// stack is known at every entry of the region, stack slots and local
+// variables are turned into fixed locations, registers where there are
+// enough, and the code becomes plain register moves and arithmetic instead
+// of stack traffic.
+
+// uint32_t enter(ijvm *m, word *lv, word *sp), returns the program counter
+// to continue at
+typedef uint32_t (*osr_fn)(ijvm *, word *, word *);
+
+typedef struct osr_code {
+  byte *code;           // mmap'd, executable
+  size_t size;
+  uint32_t window;      // locals the code accesses, from the frame start
+  uint32_t max_depth;   // deepest operand stack above the one at the header
+  osr_fn enter;
+} osr_code;
+
+static void run_osr(ijvm *m, uint32_t header);
+
+loop_profile *get_osr_profile(ijvm *m)
+{
+  if (m->osr != NULL) {
+    return &m->osr->loops;
+  }
+  osr_cache *oc = malloc(sizeof(osr_cache));
+  if (oc == NULL) {
+    return NULL;
+  }
+  oc->loops.counters = calloc(m->code_count, sizeof(uint32_t));
+  oc->loops.compiled = calloc(m->code_count, 1);
+  oc->loops.hot = OSR_HOT;
+  oc->loops.enter = run_osr;
+  oc->code = calloc(m->code_count, sizeof(osr_code *));
+  m->osr = oc;
+  if (oc->loops.counters == NULL || oc->loops.compiled == NULL || oc->code == NULL) {
+    free_osr(m);
+    return NULL;
+  }
+  return &oc->loops;
+}
+
+#ifdef HAVE_X86_JIT
+
+// Native code uses these registers:
+//
+//   rsi, rdi, r8, r9        the lowest operand stack slots above the header
+//                           depth, deeper slots stay in m->stack
+//   r10, r11, rbp, r12,     the most used local variables, the others stay
+//   r15, rdx                in the frame
+//   rbx                     m->sp at the header
+//   r13                     m->lv
+//   r14                     m
+//   rax, rcx                scratch
+
+#define SLOT_REGS 4
+#define LOCAL_REGS 6
+static const byte slot_regs[SLOT_REGS] = { 6, 7, 8, 9 };
+static const byte local_regs[LOCAL_REGS] = { 10, 11, 5, 12, 15, 2 };
+
+#define RBX 3
+#define R13 13
+
+// upper bounds used to size the buffer
+#define PROLOGUE_SIZE 256
+#define EXIT_SIZE 48
+#define STUB_SIZE 10
+#define MAX_ENTRY_SIZE 64
+
+// depth of entries not reached from the header
+#define NOT_REACHED (-1)
+
+// A 32 bit operand: a register, or memory at a displacement from one.
+typedef struct loc {
+  byte reg;
+  bool mem;
+  int32_t disp;
+} loc;
+
+typedef struct region {
+  int32_t *depth;       // stack depth on arrival, relative to the header
+  bool *inside;         // compiled, as opposed to a frontier entry
+  uint32_t max_depth;
+  int local_reg[LOCAL_REGS];  // local kept in each register, -1 if none
+  bool written[LOCAL_REGS];   // whether the code changes it
+} region;
+
+// Words popped and pushed by the instructions the tier handles. Returns
+// false for everything else.
+static bool stack_effect(byte op, int *pops, int *pushes)
+{
+  *pops = 0;
+  *pushes = 0;
+  switch (op) {
+    case DOP_NOP:
+    case DOP_IINC:
+    case DOP_GOTO:
+      break;
+    case DOP_PUSH:
+    case DOP_ILOAD:
+      *pushes = 1;
+      break;
+    case DOP_DUP:
+      *pops = 1;
+      *pushes = 2;
+      break;
+    case DOP_POP:
+    case DOP_ISTORE:
+    case DOP_IFEQ:
+    case DOP_IFLT:
+      *pops = 1;
+      break;
+    case DOP_SWAP:
+      *pops = 2;
+      *pushes = 2;
+      break;
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case DOP_IF_ICMPEQ:
+      *pops = 2;
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+// Computes the region of the loop at header. Returns false if it can not be
+// compiled: the header itself is not handled, or the stack depth at some
+// entry depends on the path taken to it.
+static bool find_region(ijvm *m, uint32_t header, region *r)
+{
+  uint32_t *work = malloc(m->code_count * sizeof(uint32_t));
+  if (work == NULL) {
+    return false;
+  }
+  for (unsigned int i = 0; i < m->code_count; i++) {
+    r->depth[i] = NOT_REACHED;
+    r->inside[i] = false;
+  }
+  r->max_depth = 0;
+
+  bool ok = true;
+  unsigned int count = 0;
+  r->depth[header] = 0;
+  work[count++] = header;
+  while (ok && count > 0) {
+    uint32_t i = work[--count];
+    decoded_insn *d = &m->code[i];
+    byte op = unfused_op(d->op);
+    int32_t depth = r->depth[i];
+    int pops, pushes;
+    if (!stack_effect(op, &pops, &pushes) || pops > depth
+        || depth - pops + pushes > OSR_MAX_DEPTH) {
+      continue; // frontier
+    }
+    r->inside[i] = true;
+    if (depth + pushes - pops > (int32_t)r->max_depth) {
+      r->max_depth = (uint32_t)(depth + pushes - pops);
+    }
+    depth += pushes - pops;
+
+    uint32_t next[2];
+    unsigned int n = 0;
+    if (op != DOP_GOTO) {
+      next[n++] = i + 1;
+    }
+    if (op == DOP_GOTO || op == DOP_IFEQ || op == DOP_IFLT || op == DOP_IF_ICMPEQ) {
+      next[n++] = d->target;
+    }
+    for (unsigned int k = 0; k < n; k++) {
+      if (r->depth[next[k]] == NOT_REACHED) {
+        r->depth[next[k]] = depth;
+        work[count++] = next[k];
+      } else if (r->depth[next[k]] != depth) {
+        ok = false;
+      }
+    }
+  }
+  free(work);
+  return ok && r->inside[header];
+}
+
+static bool accesses_local(byte op)
+{
+  return op == DOP_ILOAD || op == DOP_ISTORE || op == DOP_IINC;
+}
+
+// Gives the most used locals of the region registers.
+static void allocate_locals(ijvm *m, region *r)
+{
+  for (int k = 0; k < LOCAL_REGS; k++) {
+    r->local_reg[k] = -1;
+    r->written[k] = false;
+  }
+  uint32_t *uses = calloc(65536, sizeof(uint32_t)); // per local index
+  if (uses == NULL) {
+    return; // all locals stay in memory
+  }
+  for (unsigned int i = 0; i < m->code_count; i++) {
+    if (r->inside[i] && accesses_local(unfused_op(m->code[i].op))) {
+      uses[m->code[i].local]++;
+    }
+  }
+  for (int k = 0; k < LOCAL_REGS; k++) {
+    int best = -1;
+    for (unsigned int i = 0; i < m->code_count; i++) {
+      if (r->inside[i] && accesses_local(unfused_op(m->code[i].op))) {
+        uint16_t local = m->code[i].local;
+        if (uses[local] > 0 && (best < 0 || uses[local] > uses[best])) {
+          best = local;
+        }
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    r->local_reg[k] = best;
+    uses[best] = 0;
+  }
+  free(uses);
+
+  for (unsigned int i = 0; i < m->code_count; i++) {
+    byte op = unfused_op(m->code[i].op);
+    if (r->inside[i] && (op == DOP_ISTORE || op == DOP_IINC)) {
+      for (int k = 0; k < LOCAL_REGS; k++) {
+        if (r->local_reg[k] == m->code[i].local) {
+          r->written[k] = true;
+        }
+      }
+    }
+  }
+}
+
+static loc in_reg(byte reg)
+{
+  loc l = { reg, false, 0 };
+  return l;
+}
+
+// operand stack slot k above the header depth
+static loc slot_loc(uint32_t k)
+{
+  if (k < SLOT_REGS) {
+    return in_reg(slot_regs[k]);
+  }
+  loc l = { RBX, true, (int32_t)(k * 4) };
+  return l;
+}
+
+static loc local_loc(region *r, uint16_t local)
+{
+  for (int k = 0; k < LOCAL_REGS; k++) {
+    if (r->local_reg[k] == local) {
+      return in_reg(local_regs[k]);
+    }
+  }
+  loc l = { R13, true, (int32_t)(local * 4) };
+  return l;
+}
+
+// <opcode> with the ModRM operands reg (a register, or the /digit of the
+// opcode) and l, on 32 bits
+static void emit_op(emitter *e, byte opcode, byte reg, loc l)
+{
+  byte rex = (byte)(((reg & 8) ? 4 : 0) | ((l.reg & 8) ? 1 : 0));
+  if (rex != 0) {
+    byte prefix = 0x40 | rex;
+    emit(e, &prefix, 1);
+  }
+  emit(e, &opcode, 1);
+  byte modrm = (byte)(((reg & 7) << 3) | (l.reg & 7));
+  if (!l.mem) {
+    modrm |= 0xC0;
+    emit(e, &modrm, 1);
+    return;
+  }
+  modrm |= 0x80; // [base + disp32]
+  emit(e, &modrm, 1);
+  if ((l.reg & 7) == 4) {
+    EMIT(e, 0x24); // SIB for r12 as base
+  }
+  emit32(e, (uint32_t)l.disp);
+}
+
+// mov dst, src
+static void emit_mov(emitter *e, loc dst, loc src)
+{
+  if (!dst.mem && !src.mem) {
+    if (dst.reg != src.reg) {
+      emit_op(e, 0x89, src.reg, dst);
+    }
+  } else if (!dst.mem) {
+    emit_op(e, 0x8B, dst.reg, src);
+  } else if (!src.mem) {
+    emit_op(e, 0x89, src.reg, dst);
+  } else {
+    emit_op(e, 0x8B, 0, src);           // through eax
+    emit_op(e, 0x89, 0, dst);
+  }
+}
+
+// <alu> dst, src, alu being the r/m, reg form of add, sub, and, or or cmp
+static void emit_alu(emitter *e, byte alu, loc dst, loc src)
+{
+  if (!src.mem) {
+    emit_op(e, alu, src.reg, dst);
+  } else if (!dst.mem) {
+    emit_op(e, alu + 2, dst.reg, src);  // the reg, r/m form
+  } else {
+    emit_op(e, 0x8B, 0, src);           // through eax
+    emit_op(e, alu, 0, dst);
+  }
+}
+
+typedef struct fixup {
+  size_t pos;           // rel32 to patch
+  uint32_t index;       // entry it jumps to
+} fixup;
+
+// what emit_entry() returns besides condition codes
+#define BRANCH_NONE 0
+#define BRANCH_ALWAYS 1
+
+// Emits the code of entry i of the region, except for the jump to its branch
+// target. Returns BRANCH_NONE, BRANCH_ALWAYS for a GOTO or the condition
+// code on which a conditional branch is taken, with the flags set.
+static byte emit_entry(emitter *e, ijvm *m, region *r, uint32_t i)
+{
+  decoded_insn *d = &m->code[i];
+  uint32_t depth = (uint32_t)r->depth[i];
+  switch (unfused_op(d->op)) {
+    case DOP_PUSH:
+      emit_op(e, 0xC7, 0, slot_loc(depth));   // mov slot, imm32
+      emit32(e, (uint32_t)d->arg);
+      break;
+    case DOP_DUP:
+      emit_mov(e, slot_loc(depth), slot_loc(depth - 1));
+      break;
+    case DOP_SWAP:
+      emit_op(e, 0x8B, 1, slot_loc(depth - 1)); // mov ecx, top
+      emit_mov(e, slot_loc(depth - 1), slot_loc(depth - 2));
+      emit_op(e, 0x89, 1, slot_loc(depth - 2));
+      break;
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR: {
+      byte op = unfused_op(d->op);
+      byte alu = op == DOP_IADD ? 0x01 : op == DOP_ISUB ? 0x29 : op == DOP_IAND ? 0x21 : 0x09;
+      emit_alu(e, alu, slot_loc(depth - 2), slot_loc(depth - 1));
+      break;
+    }
+    case DOP_ILOAD:
+      emit_mov(e, slot_loc(depth), local_loc(r, d->local));
+      break;
+    case DOP_ISTORE:
+      emit_mov(e, local_loc(r, d->local), slot_loc(depth - 1));
+      break;
+    case DOP_IINC:
+      emit_op(e, 0x81, 0, local_loc(r, d->local)); // add local, imm32
+      emit32(e, (uint32_t)d->arg);
+      break;
+    case DOP_GOTO:
+      return BRANCH_ALWAYS;
+    case DOP_IFEQ:
+    case DOP_IFLT:
+      emit_op(e, 0x83, 7, slot_loc(depth - 1)); // cmp top, 0
+      EMIT(e, 0x00);
+      return unfused_op(d->op) == DOP_IFEQ ? JE : JL;
+    case DOP_IF_ICMPEQ:
+      emit_alu(e, 0x39, slot_loc(depth - 2), slot_loc(depth - 1));
+      return JE;
+    default: // DOP_NOP and DOP_POP, nothing to do
+      break;
+  }
+  return BRANCH_NONE;
+}
+
+// jmp or jcc to entry index, patched once the code is laid out
+static void emit_jump_to(emitter *e, byte cc, uint32_t index, fixup *fixups, unsigned int *count)
+{
+  emit_jump(e, cc, 0);
+  fixups[*count].pos = e->pos - 4;
+  fixups[*count].index = index;
+  (*count)++;
+}
+
+// Emits the code of region r. label[] gets the code of every entry of the
+// region and the deoptimization stub of every frontier entry.
+static void emit_region(emitter *e, ijvm *m, uint32_t header, region *r, size_t *label,
+                        fixup *fixups)
+{
+  unsigned int count = 0;
+
+  // uint32_t enter(ijvm *m, word *lv, word *sp)
+  emit_save_registers(e);
+  EMIT(e, 0x49, 0x89, 0xF5,               // mov r13, rsi
+          0x48, 0x89, 0xD3);              // mov rbx, rdx
+  for (int k = 0; k < LOCAL_REGS && r->local_reg[k] >= 0; k++) {
+    loc l = { R13, true, r->local_reg[k] * 4 };
+    emit_mov(e, in_reg(local_regs[k]), l);
+  }
+  emit_jump_to(e, 0, header, fixups, &count);
+
+  // leaving: write back the locals, set the stack pointer from the depth in
+  // eax and return the program counter in ecx
+  size_t exit = e->pos;
+  for (int k = 0; k < LOCAL_REGS && r->local_reg[k] >= 0; k++) {
+    if (r->written[k]) {
+      loc l = { R13, true, r->local_reg[k] * 4 };
+      emit_mov(e, l, in_reg(local_regs[k]));
+    }
+  }
+  EMIT(e, 0x48, 0x8D, 0x04, 0x83,         // lea rax, [rbx + rax * 4]
+          0x49, 0x89, 0x86);              // mov [r14 + sp], rax
+  emit32(e, offsetof(ijvm, sp));
+  EMIT(e, 0x89, 0xC8);                    // mov eax, ecx
+  emit_return(e);
+
+  // one exit per depth, spilling the slots kept in registers
+  size_t *exits = label + m->code_count; // label[] has room for them after the entries
+  for (uint32_t depth = 0; depth <= r->max_depth; depth++) {
+    exits[depth] = e->pos;
+    for (uint32_t k = 0; k < depth && k < SLOT_REGS; k++) {
+      loc l = { RBX, true, (int32_t)(k * 4) };
+      emit_mov(e, l, slot_loc(k));
+    }
+    EMIT(e, 0xB8);                        // mov eax, depth
+    emit32(e, depth);
+    emit_jump(e, 0, exit);
+  }
+
+  // deoptimization stubs: mov ecx, pc; jmp to the exit for the depth
+  for (uint32_t i = 0; i < m->code_count; i++) {
+    if (r->depth[i] != NOT_REACHED && !r->inside[i]) {
+      label[i] = e->pos;
+      EMIT(e, 0xB9);
+      emit32(e, m->code[i].pc);
+      emit_jump(e, 0, exits[r->depth[i]]);
+    }
+  }
+
+  for (uint32_t i = 0; i < m->code_count; i++) {
+    if (!r->inside[i]) {
+      continue;
+    }
+    label[i] = e->pos;
+    byte branch = emit_entry(e, m, r, i);
+    if (branch == BRANCH_ALWAYS) {
+      uint32_t target = m->code[i].target;
+      if (target != i + 1 || !r->inside[target]) {
+        emit_jump_to(e, 0, target, fixups, &count);
+      }
+      continue;
+    }
+    if (branch != BRANCH_NONE) {
+      emit_jump_to(e, branch, m->code[i].target, fixups, &count);
+    }
+    if (!r->inside[i + 1]) {
+      emit_jump_to(e, 0, i + 1, fixups, &count); // falls out of the region
+    }
+  }
+
+  for (unsigned int k = 0; k < count; k++) {
+    patch_rel32(e, fixups[k].pos, label[fixups[k].index]);
+  }
+}
+
+// Compiles the loop at header. Returns NULL if it is not suitable or there is
+// not enough memory.
+static osr_code *compile_osr(ijvm *m, uint32_t header)
+{
+  unsigned int count = m->code_count;
+  region r;
+  r.depth = malloc(count * sizeof(int32_t));
+  r.inside = malloc(count * sizeof(bool));
+  size_t *label = malloc((count + OSR_MAX_DEPTH + 1) * sizeof(size_t));
+  fixup *fixups = malloc((2 * (size_t)count + 1) * sizeof(fixup));
+  osr_code *c = malloc(sizeof(osr_code));
+  if (r.depth == NULL || r.inside == NULL || label == NULL || fixups == NULL || c == NULL
+      || !find_region(m, header, &r)) {
+    goto fail;
+  }
+  allocate_locals(m, &r);
+
+  unsigned int reached = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    reached += r.depth[i] != NOT_REACHED;
+  }
+  size_t size = PROLOGUE_SIZE + (OSR_MAX_DEPTH + 1) * EXIT_SIZE
+                + reached * (STUB_SIZE + MAX_ENTRY_SIZE);
+  byte *buf = alloc_code(size);
+  if (buf == NULL) {
+    goto fail;
+  }
+  emitter e = { buf, 0 };
+  emit_region(&e, m, header, &r, label, fixups);
+  if (!seal_code(buf, size)) {
+    free_code(buf, size);
+    goto fail;
+  }
+
+  d3printf("osr at pc %u: %u instructions into %zu bytes\n", m->code[header].pc, reached, e.pos);
+  c->code = buf;
+  c->size = size;
+  c->window = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    if (r.inside[i] && accesses_local(unfused_op(m->code[i].op)) && m->code[i].local >= c->window) {
+      c->window = m->code[i].local + 1u;
+    }
+  }
+  c->max_depth = r.max_depth;
+  CODE_AS(osr_fn, c->enter, buf);
+  free(r.depth);
+  free(r.inside);
+  free(label);
+  free(fixups);
+  return c;
+
+fail:
+  d3printf("osr at pc %u: not compiled\n", m->code[header].pc);
+  free(r.depth);
+  free(r.inside);
+  free(label);
+  free(fixups);
+  free(c);
+  return NULL;
+}
+
+static void free_osr_code(osr_code *c)
+{
+  if (c != NULL) {
+    free_code(c->code, c->size);
+    free(c);
+  }
+}
+
+#else
+
+// no code generator for this platform, loops stay interpreted
+
+static osr_code *compile_osr(ijvm *m, uint32_t header)
+{
+  (void)m;
+  (void)header;
+  return NULL;
+}
+
+static void free_osr_code(osr_code *c)
+{
+  (void)c;
+}
+
+#endif
+
+// Compiles the hot loop at header if that was not tried yet, and switches
+// the current frame over to its code. The interpreter continues at the
+// program counter the code deoptimized at.
+static void run_osr(ijvm *m, uint32_t header)
+{
+  osr_cache *oc = m->osr;
+  if (oc->code[header] == NULL) {
+    oc->code[header] = compile_osr(m, header);
+    if (oc->code[header] == NULL) {
+      return; // the counter is past hot now, so this is not tried again
+    }
+    oc->loops.compiled[header] = 1;
+  }
+  osr_code *c = oc->code[header];
+
+  if (c->window > frame_locals(m)) {
+    return; // the code would access locals outside the frame
+  }
+  // the code writes its stack slots directly, check they are all there
+  if (!reserve_stack(m, c->max_depth)) {
+    return;
+  }
+  m->program_counter = c->enter(m, m->lv, m->sp);
+}
+
+void free_osr(ijvm *m)
+{
+  osr_cache *oc = m->osr;
+  if (oc == NULL) {
+    return;
+  }
+  if (oc->code != NULL) {
+    for (unsigned int i = 0; i < m->code_count; i++) {
+      free_osr_code(oc->code[i]);
+    }
+  }
+  free(oc->loops.counters);
+  free(oc->loops.compiled);
+  free(oc->code);
+  free(oc);
+  m->osr = NULL;
+}
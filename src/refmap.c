@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "interp.h"
+#include "refmap.h"
+#include "util.h"
+
+// See refmap.h.
+
+#define NOT_REACHED UINT32_MAX
+#define NO_MAP UINT32_MAX
+#define NO_OWNER UINT32_MAX
+#define SHARED (UINT32_MAX - 1)
+
+typedef struct frame_map {
+  uint32_t locals;  // the frame's locals, then the operands
+  uint32_t depth;
+  uint32_t kinds;   // where they start in ref_maps.kinds
+} frame_map;
+
+struct ref_maps {
+  byte *tos;          // per entry, the kind of the top operand before it
+  uint32_t *map_of;   // per entry, its frame map, NO_MAP if it has none
+  frame_map *maps;
+  uint32_t map_count;
+  byte *kinds;
+  size_t kind_count;
+};
+
+// Working out the kinds of one method at a time.
+typedef struct builder {
+  ijvm *m;
+  struct ref_maps *r;
+  uint32_t *owner;      // per entry, the method it was worked out for
+  byte *built;          // per entry, whether the method starting there is done
+  uint32_t *depth;      // per entry, its depth in the method, or NOT_REACHED
+  uint32_t *state;      // per entry, where its kinds are in states
+  uint32_t *reached;    // entries reached so far, in the order reached
+  uint32_t count;
+  uint32_t *work;       // entries to look at again
+  uint32_t work_count;
+  byte *queued;
+  byte *states;         // per entry reached, the kinds before it
+  size_t states_size;
+  uint32_t width;       // kinds per entry: locals and the deepest stack
+} builder;
+
+static bool grow(void **p, size_t size)
+{
+  void *q = realloc(*p, size);
+  if (q == NULL) {
+    return false;
+  }
+  *p = q;
+  return true;
+}
+
+// The same as in verify.c.
+static unsigned int successors(const decoded_insn *d, uint32_t i, uint32_t next[2])
+{
+  switch (unfused_op(d->op)) {
+    case DOP_GOTO:
+      next[0] = d->target;
+      return 1;
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_IF_ICMPEQ:
+      next[0] = i + 1;
+      next[1] = d->target;
+      return 2;
+    case DOP_IRETURN:
+    case DOP_HALT:
+    case DOP_ERR:
+    case DOP_END:
+    case DOP_SLOW:
+      return 0;
+    default:
+      next[0] = i + 1;
+      return 1;
+  }
+}
+
+// Whether a collection can happen while entry d runs, see refmap.h.
+static bool collects(const decoded_insn *d)
+{
+  switch (unfused_op(d->op)) {
+    case DOP_NEWARRAY:
+    case DOP_ANEWARRAY:
+    case DOP_GC:
+    case DOP_INVOKEVIRTUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Applies entry d to the kinds s of a frame with locals locals and *depth
+// operands. The program verified, so there are enough operands.
+static void transfer(const decoded_insn *d, byte *s, uint32_t locals, uint32_t *depth)
+{
+  byte *top = s + locals + *depth; // one past the top operand
+  switch (unfused_op(d->op)) {
+    case DOP_PUSH:
+    case DOP_IN:
+      *top++ = SLOT_INT;
+      break;
+    case DOP_ILOAD:
+      *top++ = s[d->local];
+      break;
+    case DOP_ISTORE:
+      s[d->local] = *--top;
+      break;
+    case DOP_IINC:
+      s[d->local] = SLOT_INT;
+      break;
+    case DOP_DUP:
+      top[0] = top[-1];
+      top++;
+      break;
+    case DOP_SWAP: {
+      byte k = top[-1];
+      top[-1] = top[-2];
+      top[-2] = k;
+      break;
+    }
+    case DOP_POP:
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_OUT:
+    case DOP_IRETURN:
+      top--;
+      break;
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR:
+      top--;
+      top[-1] = SLOT_INT;
+      break;
+    case DOP_IALOAD:
+      top--;
+      top[-1] = SLOT_ANY;
+      break;
+    case DOP_AIALOAD:
+      top--;
+      top[-1] = SLOT_REF;
+      break;
+    case DOP_IF_ICMPEQ:
+      top -= 2;
+      break;
+    case DOP_IASTORE:
+    case DOP_AIASTORE:
+      top -= 3;
+      break;
+    case DOP_NEWARRAY:
+    case DOP_ANEWARRAY:
+      top[-1] = SLOT_REF;
+      break;
+    case DOP_INVOKEVIRTUAL:
+      top -= d->local;
+      *top++ = SLOT_ANY;
+      break;
+    default:
+      break;
+  }
+  *depth = (uint32_t)(top - (s + locals));
+}
+
+// Records that entry i is reached with kinds s (of locals and depth
+// operands), or joins them with the kinds it was reached with before: a
+// word of two different kinds is SLOT_ANY.
+// Returns false if there is no memory left for them.
+static bool reach(builder *b, uint32_t i, const byte *s, uint32_t words, uint32_t depth)
+{
+  if (b->depth[i] == NOT_REACHED) {
+    size_t size = (size_t)(b->count + 1) * b->width;
+    if (size > REFMAP_MAX_BYTES) {
+      return false;
+    }
+    if (size > b->states_size) {
+      size_t bigger = 2 * b->states_size > size ? 2 * b->states_size : size;
+      if (!grow((void **)&b->states, bigger)) {
+        return false;
+      }
+      b->states_size = bigger;
+    }
+    b->depth[i] = depth;
+    b->state[i] = b->count * b->width;
+    b->reached[b->count++] = i;
+    memcpy(b->states + b->state[i], s, words);
+  } else {
+    byte *t = b->states + b->state[i];
+    bool changed = false;
+    for (uint32_t k = 0; k < words; k++) {
+      if (t[k] != s[k] && t[k] != SLOT_ANY) {
+        t[k] = SLOT_ANY;
+        changed = true;
+      }
+    }
+    if (!changed) {
+      return true;
+    }
+  }
+  if (!b->queued[i]) {
+    b->queued[i] = true;
+    b->work[b->work_count++] = i;
+  }
+  return true;
+}
+
+// Keeps what was worked out for entry i of the method starting at start,
+// unless another method got there first.
+static bool keep(builder *b, uint32_t start, uint32_t i, uint32_t locals)
+{
+  struct ref_maps *r = b->r;
+  if (b->owner[i] != NO_OWNER) {
+    b->owner[i] = SHARED;
+    r->tos[i] = SLOT_ANY;
+    r->map_of[i] = NO_MAP;
+    return true;
+  }
+  b->owner[i] = start;
+  const byte *s = b->states + b->state[i];
+  uint32_t depth = b->depth[i];
+  r->tos[i] = depth > 0 ? s[locals + depth - 1] : SLOT_ANY;
+  if (i == 0 || !collects(&b->m->code[i - 1])) {
+    return true;
+  }
+  uint32_t words = locals + depth;
+  if (!grow((void **)&r->kinds, r->kind_count + words)
+      || !grow((void **)&r->maps, (r->map_count + 1) * sizeof(frame_map))) {
+    return false;
+  }
+  memcpy(r->kinds + r->kind_count, s, words);
+  r->maps[r->map_count] = (frame_map){ locals, depth, (uint32_t)r->kind_count };
+  r->map_of[i] = r->map_count++;
+  r->kind_count += words;
+  return true;
+}
+
+// Works out the kinds for the method starting at entry start, with locals
+// locals, the first args of them arguments. Returns false if there is no
+// memory left, the method then has no maps.
+static bool build_method(builder *b, uint32_t start, uint32_t locals, uint32_t args)
+{
+  ijvm *m = b->m;
+  b->built[start] = true;
+  b->width = locals + m->max_stack;
+  byte *s = malloc(b->width);
+  bool ok = s != NULL;
+  if (ok) {
+    memset(s, SLOT_INT, locals);
+    memset(s, SLOT_ANY, args);
+    ok = reach(b, start, s, locals, 0);
+  }
+  while (ok && b->work_count > 0) {
+    uint32_t i = b->work[--b->work_count];
+    b->queued[i] = false;
+    decoded_insn *d = &m->code[i];
+    uint32_t depth = b->depth[i];
+    memcpy(s, b->states + b->state[i], locals + depth);
+    transfer(d, s, locals, &depth);
+
+    uint32_t targets[2];
+    unsigned int n = successors(d, i, targets);
+    for (unsigned int k = 0; ok && k < n; k++) {
+      ok = reach(b, targets[k], s, locals + depth, depth);
+    }
+  }
+  for (uint32_t k = 0; ok && k < b->count; k++) {
+    ok = keep(b, start, b->reached[k], locals);
+  }
+  if (!ok) {
+    d3printf("refmap: no maps for the method at pc %u\n", m->code[start].pc);
+  }
+
+  // leave the per entry arrays clean for the next method
+  for (uint32_t k = 0; k < b->count; k++) {
+    b->depth[b->reached[k]] = NOT_REACHED;
+    b->queued[b->reached[k]] = false;
+  }
+  b->count = 0;
+  b->work_count = 0;
+  free(s);
+  return ok;
+}
+
+// The maps of m's program, NULL if it did not verify or there was no memory
+// for them.
+static struct ref_maps *build_ref_maps(ijvm *m)
+{
+  uint32_t n = m->code_count;
+  struct ref_maps *r = calloc(1, sizeof(struct ref_maps));
+  builder b = { 0 };
+  b.m = m;
+  b.r = r;
+  b.owner = malloc(n * sizeof(uint32_t));
+  b.depth = malloc(n * sizeof(uint32_t));
+  b.state = malloc(n * sizeof(uint32_t));
+  b.reached = malloc(n * sizeof(uint32_t));
+  b.work = malloc(n * sizeof(uint32_t));
+  b.queued = calloc(n, 1);
+  b.built = calloc(n, 1);
+  bool ok = r != NULL && b.owner != NULL && b.depth != NULL && b.state != NULL
+            && b.reached != NULL && b.work != NULL && b.queued != NULL
+            && b.built != NULL;
+  if (ok) {
+    r->tos = malloc(n);
+    r->map_of = malloc(n * sizeof(uint32_t));
+    ok = r->tos != NULL && r->map_of != NULL;
+  }
+  for (uint32_t i = 0; ok && i < n; i++) {
+    b.owner[i] = NO_OWNER;
+    b.depth[i] = NOT_REACHED;
+    r->tos[i] = SLOT_ANY;
+    r->map_of[i] = NO_MAP;
+  }
+
+  // main, then every method called, once (methods without maps are scanned
+  // whole, so running out of memory for one leaves the others be)
+  if (ok) {
+    build_method(&b, 0, m->main_locals, 0);
+  }
+  for (uint32_t i = 0; ok && i < n; i++) {
+    decoded_insn *d = &m->code[i];
+    if (unfused_op(d->op) == DOP_INVOKEVIRTUAL && !b.built[d->target]) {
+      method_info *method = &m->methods[d->arg];
+      build_method(&b, d->target, method->frame_size, method->arg_count);
+    }
+  }
+  free(b.owner);
+  free(b.depth);
+  free(b.state);
+  free(b.reached);
+  free(b.work);
+  free(b.queued);
+  free(b.built);
+  free(b.states);
+  if (!ok && r != NULL) {
+    free(r->tos);
+    free(r->map_of);
+    free(r);
+    r = NULL;
+  }
+  d3printf("refmap: %u frame maps, %zu kinds\n", r != NULL ? r->map_count : 0, r != NULL ? r->kind_count : (size_t)0);
+  return r;
+}
+
+static struct ref_maps *get_ref_maps(ijvm *m)
+{
+  if (!m->ref_maps_built) {
+    m->ref_maps = m->verified ? build_ref_maps(m) : NULL;
+    m->ref_maps_built = true;
+  }
+  return m->ref_maps;
+}
+
+// The entry execution continues at from pc, -1 if there is none.
+static int32_t entry_at(ijvm *m, uint32_t pc)
+{
+  return pc <= m->text_size ? m->pc_map[pc] : -1;
+}
+
+size_t stack_roots(ijvm *m, word *roots)
+{
+  struct ref_maps *r = get_ref_maps(m);
+  size_t count = 0;
+  if (r == NULL) {
+    for (word *p = m->stack; p < m->sp; p++) {
+      roots[count++] = *p;
+    }
+    return count;
+  }
+
+  // the frames from the top down, each stopped at pc
+  word *lv = m->lv;
+  word *operands = m->operands;
+  word *top = m->sp;
+  uint32_t pc = m->program_counter;
+  for (uint32_t depth = m->call_depth;; depth--) {
+    uint32_t locals = (uint32_t)(operands - lv) - (depth > 0 ? FRAME_SAVED : 0);
+    uint32_t used = (uint32_t)(top - operands);
+    int32_t e = entry_at(m, pc);
+    const frame_map *f = e >= 0 && r->map_of[e] != NO_MAP ? &r->maps[r->map_of[e]] : NULL;
+    if (f == NULL || f->locals != locals || used > f->depth) {
+      for (word *p = lv; p < top; p++) {
+        roots[count++] = *p;
+      }
+    } else {
+      const byte *kinds = r->kinds + f->kinds;
+      for (uint32_t k = 0; k < locals; k++) {
+        if (kinds[k] != SLOT_INT) {
+          roots[count++] = lv[k];
+        }
+      }
+      for (uint32_t k = 0; k < used; k++) {
+        if (kinds[locals + k] != SLOT_INT) {
+          roots[count++] = operands[k];
+        }
+      }
+    }
+    if (depth == 0) {
+      break;
+    }
+    word *saved = operands - FRAME_SAVED;
+    pc = (uint32_t)saved[0];
+    top = lv;
+    lv = m->stack + saved[1];
+    operands = m->stack + saved[2];
+  }
+  return count;
+}
+
+byte tos_kind(ijvm *m)
+{
+  struct ref_maps *r = get_ref_maps(m);
+  int32_t e = r != NULL ? entry_at(m, m->program_counter) : -1;
+  return e >= 0 ? r->tos[e] : SLOT_ANY;
+}
+
+void free_ref_maps(ijvm *m)
+{
+  struct ref_maps *r = m->ref_maps;
+  if (r != NULL) {
+    free(r->tos);
+    free(r->map_of);
+    free(r->maps);
+    free(r->kinds);
+    free(r);
+  }
+  m->ref_maps = NULL;
+  m->ref_maps_built = false;
+}
@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "regir.h"
+#include "util.h"
+
+// Translation of the decoded program to register IR, see regir.h.
+//
+// First the stack depth of every entry is computed, starting with depth 0 at
+// the main body and at every method body. An entry reached with two
+// different depths, or popping below the depth its method started at, is
+// run in stack mode, and so is everything reachable from it. Then the
+// entries are translated in order. Execution can only continue in the
+// middle of register code at a block start: a method body, a branch target,
+// the instruction after one that leaves register code, and every entry run
+// in stack mode. The symbolic stack is written back to the S registers
+// before each of those, before every branch and before leaving.
+
+// depth of entries not reached from any method
+#define NOT_REACHED (-2)
+
+// where the value at a symbolic stack position is
+enum { SYM_SLOT, SYM_LOCAL, SYM_CONST };
+
+typedef struct sym {
+  byte kind;
+  word value;           // S index, L index or the constant
+} sym;
+
+// a branch whose target is resolved once all block starts are known
+typedef struct fixup {
+  uint32_t insn;
+  uint32_t entry;       // target entry
+  int32_t depth;        // stack depth at the branch
+} fixup;
+
+typedef struct translator {
+  ijvm *m;
+  reg_program *p;
+  bool *block;          // per entry, whether it is a block start
+  uint32_t capacity;    // of p->insns
+  sym *stack;           // symbolic stack
+  int32_t depth;
+  bool live;            // whether the previous entry falls through
+  fixup *fixups;
+  uint32_t fixup_count;
+  uint32_t fixup_capacity;
+  bool failed;          // out of memory
+} translator;
+
+// Words popped and pushed by the instruction at d.
+static void stack_effect(const decoded_insn *d, int *pops, int *pushes)
+{
+  *pops = 0;
+  *pushes = 0;
+  switch (unfused_op(d->op)) {
+    case DOP_PUSH:
+    case DOP_ILOAD:
+    case DOP_IN:
+      *pushes = 1;
+      break;
+    case DOP_DUP:
+      *pops = 1;
+      *pushes = 2;
+      break;
+    case DOP_NEWARRAY:
+    case DOP_ANEWARRAY:
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case DOP_POP:
+    case DOP_ISTORE:
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_OUT:
+      *pops = 1;
+      break;
+    case DOP_SWAP:
+      *pops = 2;
+      *pushes = 2;
+      break;
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR:
+    case DOP_IALOAD:
+    case DOP_AIALOAD:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case DOP_IF_ICMPEQ:
+      *pops = 2;
+      break;
+    case DOP_IASTORE:
+    case DOP_AIASTORE:
+      *pops = 3;
+      break;
+    case DOP_INVOKEVIRTUAL:
+      *pops = d->local;
+      *pushes = 1;
+      break;
+    default:
+      break;
+  }
+}
+
+// Stores the entries execution may continue at after entry i in next[],
+// returns how many there are.
+static unsigned int successors(const decoded_insn *d, uint32_t i, uint32_t next[2])
+{
+  switch (unfused_op(d->op)) {
+    case DOP_GOTO:
+      next[0] = d->target;
+      return 1;
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_IF_ICMPEQ:
+      next[0] = i + 1;
+      next[1] = d->target;
+      return 2;
+    case DOP_IRETURN:
+    case DOP_HALT:
+    case DOP_ERR:
+    case DOP_END:
+    case DOP_SLOW:
+      return 0;
+    default:
+      next[0] = i + 1;
+      return 1;
+  }
+}
+
+// whether the instruction leaves register code, see ROP_EXIT
+static bool leaves(byte op)
+{
+  switch (op) {
+    case DOP_INVOKEVIRTUAL:
+    case DOP_IRETURN:
+    case DOP_IN:
+    case DOP_OUT:
+    case DOP_NEWARRAY:
+    case DOP_IALOAD:
+    case DOP_IASTORE:
+    case DOP_ANEWARRAY:
+    case DOP_AIALOAD:
+    case DOP_AIASTORE:
+    case DOP_GC:
+    case DOP_HALT:
+    case DOP_ERR:
+    case DOP_END:
+    case DOP_SLOW:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void reach(int32_t *depth, uint32_t *work, uint32_t *count, uint32_t i, int32_t d)
+{
+  if (depth[i] == d || depth[i] == STACK_MODE) {
+    return;
+  }
+  depth[i] = depth[i] == NOT_REACHED ? d : STACK_MODE;
+  work[(*count)++] = i; // at most twice per entry
+}
+
+// Computes p->depth and p->max_depth.
+static bool compute_depths(ijvm *m, reg_program *p)
+{
+  uint32_t *work = malloc(2 * (size_t)m->code_count * sizeof(uint32_t));
+  if (work == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < m->code_count; i++) {
+    p->depth[i] = NOT_REACHED;
+  }
+  p->max_depth = 0;
+
+  uint32_t count = 0;
+  reach(p->depth, work, &count, 0, 0);
+  for (uint32_t i = 0; i < m->code_count; i++) {
+    if (unfused_op(m->code[i].op) == DOP_INVOKEVIRTUAL) {
+      reach(p->depth, work, &count, m->code[i].target, 0);
+    }
+  }
+
+  while (count > 0) {
+    uint32_t i = work[--count];
+    decoded_insn *d = &m->code[i];
+    byte op = unfused_op(d->op);
+    int32_t depth = p->depth[i];
+    int pops, pushes;
+    stack_effect(d, &pops, &pushes);
+    bool local = op == DOP_ILOAD || op == DOP_ISTORE || op == DOP_IINC;
+    if (depth != STACK_MODE && (pops > depth || depth - pops + pushes > VREG_MAX_INDEX
+                                || (local && d->local > VREG_MAX_INDEX))) {
+      p->depth[i] = depth = STACK_MODE;
+    }
+    if (depth != STACK_MODE) {
+      depth += pushes - pops;
+      uint32_t used = (uint32_t)(depth > p->depth[i] ? depth : p->depth[i]);
+      if (used > p->max_depth) {
+        p->max_depth = used;
+      }
+    }
+
+    uint32_t next[2];
+    unsigned int n = successors(d, i, next);
+    for (unsigned int k = 0; k < n; k++) {
+      reach(p->depth, work, &count, next[k], depth);
+    }
+  }
+  free(work);
+  return true;
+}
+
+// Marks the block starts, see above.
+static void find_blocks(ijvm *m, reg_program *p, bool *block)
+{
+  for (uint32_t i = 0; i < m->code_count; i++) {
+    block[i] = p->depth[i] == STACK_MODE;
+  }
+  block[0] = true;
+  for (uint32_t i = 0; i < m->code_count; i++) {
+    decoded_insn *d = &m->code[i];
+    byte op = unfused_op(d->op);
+    if (p->depth[i] == NOT_REACHED) {
+      continue;
+    }
+    if (op == DOP_INVOKEVIRTUAL || op == DOP_GOTO || op == DOP_IFEQ || op == DOP_IFLT
+        || op == DOP_IF_ICMPEQ) {
+      block[d->target] = true;
+    }
+    if (leaves(op) && i + 1 < m->code_count) {
+      block[i + 1] = true;
+    }
+  }
+}
+
+// The operands op has, as a string of d, a and b.
+static const char *operands(byte op)
+{
+  switch (op) {
+    case ROP_MOV:
+    case ROP_ADDK:
+    case ROP_ANDK:
+    case ROP_ORK:
+      return "da";
+    case ROP_MOVK:
+      return "d";
+    case ROP_ADD:
+    case ROP_SUB:
+    case ROP_AND:
+    case ROP_OR:
+      return "dab";
+    case ROP_IFEQ:
+    case ROP_IFLT:
+    case ROP_IF_CMPEQK:
+      return "a";
+    case ROP_IF_CMPEQ:
+      return "ab";
+    default: // no variants
+      return "";
+  }
+}
+
+// Emits op (a base opcode) with vreg operands. Returns the index of the
+// instruction.
+static uint32_t emit(translator *t, byte op, vreg d, vreg a, vreg b, word k, uint32_t target)
+{
+  reg_program *p = t->p;
+  if (p->count == t->capacity) {
+    uint32_t capacity = t->capacity * 2;
+    reg_insn *insns = realloc(p->insns, capacity * sizeof(reg_insn));
+    if (insns == NULL) {
+      t->failed = true;
+      return 0;
+    }
+    p->insns = insns;
+    t->capacity = capacity;
+  }
+  byte variant = 0;
+  for (const char *o = operands(op); *o != '\0'; o++) {
+    vreg r = *o == 'd' ? d : *o == 'a' ? a : b;
+    variant = (byte)(variant << 1 | (r & 1));
+  }
+  reg_insn *insn = &p->insns[p->count];
+  insn->op = op + variant;
+  insn->d = d >> 1;
+  insn->a = a >> 1;
+  insn->b = b >> 1;
+  insn->k = k;
+  insn->target = target;
+  return p->count++;
+}
+
+// emits a branch to entry, resolved later
+static void emit_branch(translator *t, byte op, vreg a, vreg b, word k, uint32_t entry)
+{
+  uint32_t insn = emit(t, op, 0, a, b, k, 0);
+  if (t->failed) {
+    return;
+  }
+  if (t->fixup_count == t->fixup_capacity) {
+    uint32_t capacity = t->fixup_capacity * 2;
+    fixup *fixups = realloc(t->fixups, capacity * sizeof(fixup));
+    if (fixups == NULL) {
+      t->failed = true;
+      return;
+    }
+    t->fixups = fixups;
+    t->fixup_capacity = capacity;
+  }
+  t->fixups[t->fixup_count].insn = insn;
+  t->fixups[t->fixup_count].entry = entry;
+  t->fixups[t->fixup_count].depth = t->depth;
+  t->fixup_count++;
+}
+
+// The register holding s, which must not be a constant.
+static vreg operand(sym s)
+{
+  return s.kind == SYM_SLOT ? VREG_SLOT(s.value) : VREG_LOCAL(s.value);
+}
+
+// Moves the value at symbolic stack position k into S k. Only values at
+// positions from k on can be in S k, so this never overwrites one still
+// needed.
+static void materialize(translator *t, int32_t k)
+{
+  sym s = t->stack[k];
+  if (s.kind == SYM_SLOT && s.value == k) {
+    return;
+  }
+  if (s.kind == SYM_CONST) {
+    emit(t, ROP_MOVK, VREG_SLOT(k), 0, 0, s.value, 0);
+  } else {
+    emit(t, ROP_MOV, VREG_SLOT(k), operand(s), 0, 0, 0);
+  }
+  t->stack[k].kind = SYM_SLOT;
+  t->stack[k].value = k;
+}
+
+static void flush(translator *t)
+{
+  for (int32_t k = 0; k < t->depth; k++) {
+    materialize(t, k);
+  }
+}
+
+// before local x changes
+static void flush_local(translator *t, uint16_t x)
+{
+  for (int32_t k = 0; k < t->depth; k++) {
+    if (t->stack[k].kind == SYM_LOCAL && t->stack[k].value == x) {
+      materialize(t, k);
+    }
+  }
+}
+
+static void push_sym(translator *t, byte kind, word value)
+{
+  t->stack[t->depth].kind = kind;
+  t->stack[t->depth].value = value;
+  t->depth++;
+}
+
+static word fold(byte op, word a, word b)
+{
+  uint32_t x = (uint32_t)a;
+  uint32_t y = (uint32_t)b;
+  switch (op) {
+    case DOP_IADD: return (word)(x + y);
+    case DOP_ISUB: return (word)(x - y);
+    case DOP_IAND: return (word)(x & y);
+    default: return (word)(x | y);
+  }
+}
+
+// IADD, ISUB, IAND and IOR at entry i. Returns the number of entries
+// translated: 2 if the result went straight into the local of the ISTORE
+// after it.
+static uint32_t translate_alu(translator *t, uint32_t i, byte op)
+{
+  ijvm *m = t->m;
+  sym a = t->stack[t->depth - 2];
+  sym b = t->stack[t->depth - 1];
+  if (op == DOP_ISUB && a.kind == SYM_CONST && b.kind != SYM_CONST) {
+    materialize(t, t->depth - 2); // k - b has no immediate form
+    a = t->stack[t->depth - 2];
+  }
+  t->depth -= 2;
+
+  vreg dest = VREG_SLOT(t->depth);
+  uint32_t n = 1;
+  if (i + 1 < m->code_count && unfused_op(m->code[i + 1].op) == DOP_ISTORE
+      && !t->block[i + 1] && t->p->depth[i + 1] != STACK_MODE) {
+    dest = VREG_LOCAL(m->code[i + 1].local);
+    flush_local(t, m->code[i + 1].local);
+    n = 2;
+  }
+
+  if (a.kind == SYM_CONST && b.kind == SYM_CONST) {
+    word v = fold(op, a.value, b.value);
+    if (n == 2) {
+      emit(t, ROP_MOVK, dest, 0, 0, v, 0);
+    } else {
+      push_sym(t, SYM_CONST, v);
+    }
+    return n;
+  }
+
+  if (a.kind == SYM_CONST) { // commutative here, the constant goes last
+    sym s = a;
+    a = b;
+    b = s;
+  }
+  if (b.kind == SYM_CONST) {
+    switch (op) {
+      case DOP_IADD:
+        emit(t, ROP_ADDK, dest, operand(a), 0, b.value, 0);
+        break;
+      case DOP_ISUB:
+        emit(t, ROP_ADDK, dest, operand(a), 0, (word)(0u - (uint32_t)b.value), 0);
+        break;
+      case DOP_IAND:
+        emit(t, ROP_ANDK, dest, operand(a), 0, b.value, 0);
+        break;
+      default:
+        emit(t, ROP_ORK, dest, operand(a), 0, b.value, 0);
+        break;
+    }
+  } else {
+    byte rop = op == DOP_IADD ? ROP_ADD : op == DOP_ISUB ? ROP_SUB : op == DOP_IAND ? ROP_AND : ROP_OR;
+    emit(t, rop, dest, operand(a), operand(b), 0, 0);
+  }
+  if (n == 1) {
+    push_sym(t, SYM_SLOT, t->depth);
+  }
+  return n;
+}
+
+// Translates entry i, which has a known stack depth. Returns the number of
+// entries translated.
+static uint32_t translate_entry(translator *t, uint32_t i)
+{
+  decoded_insn *d = &t->m->code[i];
+  byte op = unfused_op(d->op);
+  switch (op) {
+    case DOP_NOP:
+      break;
+    case DOP_PUSH:
+      push_sym(t, SYM_CONST, d->arg);
+      break;
+    case DOP_ILOAD:
+      push_sym(t, SYM_LOCAL, d->local);
+      break;
+    case DOP_DUP:
+      t->stack[t->depth] = t->stack[t->depth - 1];
+      t->depth++;
+      break;
+    case DOP_POP:
+      t->depth--;
+      break;
+    case DOP_SWAP: {
+      int32_t k = t->depth - 2;
+      sym a = t->stack[k];
+      sym b = t->stack[k + 1];
+      if ((a.kind == SYM_SLOT && a.value >= k) || (b.kind == SYM_SLOT && b.value >= k)) {
+        materialize(t, k);
+        materialize(t, k + 1);
+        emit(t, ROP_SWAP, 0, VREG_SLOT(k), VREG_SLOT(k + 1), 0, 0);
+      } else {
+        t->stack[k] = b;
+        t->stack[k + 1] = a;
+      }
+      break;
+    }
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR:
+      return translate_alu(t, i, op);
+    case DOP_ISTORE: {
+      sym s = t->stack[--t->depth];
+      flush_local(t, d->local);
+      if (s.kind == SYM_CONST) {
+        emit(t, ROP_MOVK, VREG_LOCAL(d->local), 0, 0, s.value, 0);
+      } else {
+        emit(t, ROP_MOV, VREG_LOCAL(d->local), operand(s), 0, 0, 0);
+      }
+      break;
+    }
+    case DOP_IINC:
+      flush_local(t, d->local);
+      emit(t, ROP_INC, VREG_LOCAL(d->local), 0, 0, d->arg, 0);
+      break;
+    case DOP_GOTO:
+      flush(t);
+      emit_branch(t, ROP_GOTO, 0, 0, 0, d->target);
+      t->live = false;
+      break;
+    case DOP_IFEQ:
+    case DOP_IFLT: {
+      sym s = t->stack[--t->depth];
+      flush(t);
+      if (s.kind == SYM_CONST) {
+        if (op == DOP_IFEQ ? s.value == 0 : s.value < 0) {
+          emit_branch(t, ROP_GOTO, 0, 0, 0, d->target);
+          t->live = false;
+        }
+      } else {
+        emit_branch(t, op == DOP_IFEQ ? ROP_IFEQ : ROP_IFLT, operand(s), 0, 0, d->target);
+      }
+      break;
+    }
+    case DOP_IF_ICMPEQ: {
+      sym b = t->stack[--t->depth];
+      sym a = t->stack[--t->depth];
+      flush(t);
+      if (a.kind == SYM_CONST && b.kind == SYM_CONST) {
+        if (a.value == b.value) {
+          emit_branch(t, ROP_GOTO, 0, 0, 0, d->target);
+          t->live = false;
+        }
+      } else if (a.kind == SYM_CONST || b.kind == SYM_CONST) {
+        sym r = a.kind == SYM_CONST ? b : a;
+        word k = a.kind == SYM_CONST ? a.value : b.value;
+        emit_branch(t, ROP_IF_CMPEQK, operand(r), 0, k, d->target);
+      } else {
+        emit_branch(t, ROP_IF_CMPEQ, operand(a), operand(b), 0, d->target);
+      }
+      break;
+    }
+    default: // leaves register code
+      flush(t);
+      emit(t, ROP_EXIT, 0, 0, 0, t->depth, i);
+      t->live = false;
+      break;
+  }
+  return 1;
+}
+
+static void translate(translator *t)
+{
+  ijvm *m = t->m;
+  reg_program *p = t->p;
+  t->live = false;
+  for (uint32_t i = 0; i < m->code_count && !t->failed;) {
+    int32_t depth = p->depth[i];
+    if (depth == NOT_REACHED) {
+      t->live = false;
+      i++;
+      continue;
+    }
+    if (depth == STACK_MODE) {
+      if (t->live) { // falling into stack mode
+        flush(t);
+        emit(t, ROP_SYNC, 0, 0, 0, t->depth, p->count + 1);
+      }
+      t->live = false;
+      p->start[i] = p->count;
+      decoded_insn *d = &m->code[i];
+      if (leaves(unfused_op(d->op))) {
+        emit(t, ROP_EXIT, 0, 0, 0, -1, i);
+      } else {
+        emit(t, ROP_STACK, 0, 0, 0, 0, i);
+      }
+      i++;
+      continue;
+    }
+    if (!t->live || t->block[i]) {
+      if (t->live) {
+        flush(t);
+      }
+      p->start[i] = p->count;
+      t->depth = depth;
+      for (int32_t k = 0; k < depth; k++) {
+        t->stack[k].kind = SYM_SLOT;
+        t->stack[k].value = k;
+      }
+      t->live = true;
+    }
+    i += translate_entry(t, i);
+  }
+
+  // branches into stack mode go through a ROP_SYNC of their own
+  for (uint32_t k = 0; k < t->fixup_count && !t->failed; k++) {
+    fixup *f = &t->fixups[k];
+    uint32_t target = p->start[f->entry];
+    if (p->depth[f->entry] == STACK_MODE) {
+      target = emit(t, ROP_SYNC, 0, 0, 0, f->depth, target);
+    }
+    p->insns[f->insn].target = target;
+  }
+
+  // the increment closing most loops takes the jump back with it
+  for (uint32_t k = 0; k + 1 < p->count && !t->failed; k++) {
+    if (p->insns[k].op == ROP_INC && p->insns[k + 1].op == ROP_GOTO) {
+      p->insns[k].op = ROP_INC_GOTO;
+      p->insns[k].target = p->insns[k + 1].target;
+    }
+  }
+}
+
+reg_program *translate_registers(ijvm *m)
+{
+  uint32_t count = m->code_count;
+  reg_program *p = calloc(1, sizeof(reg_program));
+  if (p == NULL) {
+    return NULL;
+  }
+  translator t = { 0 };
+  t.m = m;
+  t.p = p;
+  t.capacity = count + 16;
+  t.fixup_capacity = 16;
+  p->insns = malloc(t.capacity * sizeof(reg_insn));
+  p->start = malloc(count * sizeof(uint32_t));
+  p->depth = malloc(count * sizeof(int32_t));
+  t.block = malloc(count * sizeof(bool));
+  t.fixups = malloc(t.fixup_capacity * sizeof(fixup));
+  if (p->insns == NULL || p->start == NULL || p->depth == NULL || t.block == NULL
+      || t.fixups == NULL || !compute_depths(m, p)) {
+    t.failed = true;
+  } else {
+    t.stack = malloc(((size_t)p->max_depth + 1) * sizeof(sym));
+    t.failed = t.stack == NULL;
+  }
+  if (!t.failed) {
+    for (uint32_t i = 0; i < count; i++) {
+      p->start[i] = NO_START;
+    }
+    find_blocks(m, p, t.block);
+    translate(&t);
+  }
+
+  free(t.block);
+  free(t.fixups);
+  free(t.stack);
+  if (t.failed) {
+    free_reg_program(p);
+    return NULL;
+  }
+  d3printf("translated %u instructions into %u register instructions\n", count, p->count);
+  return p;
+}
+
+void free_reg_program(reg_program *p)
+{
+  if (p != NULL) {
+    free(p->insns);
+    free(p->start);
+    free(p->depth);
+    free(p);
+  }
+}
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "interp.h"
+#include "regir.h"
+#include "util.h"
+
+// Register VM used by run() with ENGINE_REGISTER, see regir.h.
+//
+// Dispatches like the threaded interpreter, one indirect jump per
+// instruction. Virtual registers are addressed through two base pointers:
+// lv for the L registers (the locals of the current frame) and st for the S
+// registers (the operand stack of the current frame, m->operands). Both
+// are set up whenever execution enters register code, which is at the start
+// and after every instruction handed to the call and return code or step(),
+// as those may switch frames.
+
+// labels-as-values and computed goto are GNU extensions (gcc and clang)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// virtual registers, by kind
+#define L(x) lv[x]
+#define S(x) st[x]
+
+#define SET_L(x, v) (lv[x] = (v))
+#define SET_S(x, v) (st[x] = (v))
+
+#define NEXT() do { ip++; goto *dispatch[ip->op]; } while (0)
+#define JUMP() do { ip = code + ip->target; goto *dispatch[ip->op]; } while (0)
+
+// continue in stack mode at entry i
+#define STACK_NEXT(i) do { ip = code + p->start[i]; goto *dispatch[ip->op]; } while (0)
+
+// Handler generators. Each expands to a variant for every combination of
+// operand kinds (see regir.h), named after them. expr is given the accessor
+// for each source operand.
+
+#define OP_D(name, expr, D) name##_##D: SET_##D(ip->d, expr); NEXT();
+#define OP_DA(name, expr, D, A) name##_##D##A: SET_##D(ip->d, expr(A)); NEXT();
+#define OP_DAB(name, expr, D, A, B) name##_##D##A##B: SET_##D(ip->d, expr(A, B)); NEXT();
+#define IF_A(name, cond, A) name##_##A: if (cond(A)) { JUMP(); } NEXT();
+#define IF_AB(name, cond, A, B) name##_##A##B: if (cond(A, B)) { JUMP(); } NEXT();
+
+// d = expr
+#define D_OP(name, expr) OP_D(name, expr, L) OP_D(name, expr, S)
+
+// d = expr(a)
+#define DA_OP(name, expr) \
+  OP_DA(name, expr, L, L) OP_DA(name, expr, L, S) \
+  OP_DA(name, expr, S, L) OP_DA(name, expr, S, S)
+
+// d = expr(a, b)
+#define DAB_OP(name, expr) \
+  OP_DAB(name, expr, L, L, L) OP_DAB(name, expr, L, L, S) \
+  OP_DAB(name, expr, L, S, L) OP_DAB(name, expr, L, S, S) \
+  OP_DAB(name, expr, S, L, L) OP_DAB(name, expr, S, L, S) \
+  OP_DAB(name, expr, S, S, L) OP_DAB(name, expr, S, S, S)
+
+// branches if cond(a), or cond(a, b)
+#define A_IF(name, cond) IF_A(name, cond, L) IF_A(name, cond, S)
+#define AB_IF(name, cond) \
+  IF_AB(name, cond, L, L) IF_AB(name, cond, L, S) \
+  IF_AB(name, cond, S, L) IF_AB(name, cond, S, S)
+
+// the dispatch table entries of the variants, in opcode order
+#define D_TABLE(op, name) [op] = &&name##_L, [op + 1] = &&name##_S,
+#define DA_TABLE(op, name) \
+  [op] = &&name##_LL, [op + 1] = &&name##_LS, [op + 2] = &&name##_SL, [op + 3] = &&name##_SS,
+#define DAB_TABLE(op, name) \
+  [op] = &&name##_LLL, [op + 1] = &&name##_LLS, [op + 2] = &&name##_LSL, \
+  [op + 3] = &&name##_LSS, [op + 4] = &&name##_SLL, [op + 5] = &&name##_SLS, \
+  [op + 6] = &&name##_SSL, [op + 7] = &&name##_SSS,
+
+// operations, on the operand accessors
+#define X_MOV(A) A(ip->a)
+#define X_ADD(A, B) (word)((uint32_t)A(ip->a) + (uint32_t)B(ip->b))
+#define X_SUB(A, B) (word)((uint32_t)A(ip->a) - (uint32_t)B(ip->b))
+#define X_AND(A, B) (A(ip->a) & B(ip->b))
+#define X_OR(A, B) (A(ip->a) | B(ip->b))
+#define X_ADDK(A) (word)((uint32_t)A(ip->a) + (uint32_t)ip->k)
+#define X_ANDK(A) (A(ip->a) & ip->k)
+#define X_ORK(A) (A(ip->a) | ip->k)
+#define C_EQ(A) (A(ip->a) == 0)
+#define C_LT(A) (A(ip->a) < 0)
+#define C_CMPEQ(A, B) (A(ip->a) == B(ip->b))
+#define C_CMPEQK(A) (A(ip->a) == ip->k)
+
+void run_register(ijvm *m)
+{
+  if (m->regs == NULL) {
+    m->regs = translate_registers(m);
+    if (m->regs == NULL) {
+      run_threaded(m);
+      return;
+    }
+  }
+
+  static void *const dispatch[ROP_COUNT] = {
+    DA_TABLE(ROP_MOV, r_mov)
+    D_TABLE(ROP_MOVK, r_movk)
+    DAB_TABLE(ROP_ADD, r_add)
+    DAB_TABLE(ROP_SUB, r_sub)
+    DAB_TABLE(ROP_AND, r_and)
+    DAB_TABLE(ROP_OR, r_or)
+    DA_TABLE(ROP_ADDK, r_addk)
+    DA_TABLE(ROP_ANDK, r_andk)
+    DA_TABLE(ROP_ORK, r_ork)
+    [ROP_INC] = &&r_inc,
+    [ROP_INC_GOTO] = &&r_inc_goto,
+    [ROP_SWAP] = &&r_swap,
+    [ROP_GOTO] = &&r_goto,
+    D_TABLE(ROP_IFEQ, r_ifeq)
+    D_TABLE(ROP_IFLT, r_iflt)
+    DA_TABLE(ROP_IF_CMPEQ, r_if_cmpeq)
+    D_TABLE(ROP_IF_CMPEQK, r_if_cmpeqk)
+    [ROP_SYNC] = &&r_sync,
+    [ROP_STACK] = &&r_stack,
+    [ROP_EXIT] = &&r_exit,
+  };
+
+  reg_program *p = m->regs;
+  const reg_insn *code = p->insns;
+  const reg_insn *ip;
+  word *lv;
+  word *st = NULL;
+
+resume:
+  if (!resync(m)) {
+    return;
+  }
+  {
+    uint32_t entry = (uint32_t)m->pc_map[m->program_counter];
+    int32_t depth = p->depth[entry];
+    if (p->start[entry] == NO_START
+        || (depth != STACK_MODE && m->sp - m->operands != depth)) {
+      step(m); // somewhere the translation did not expect execution to be
+      goto resume;
+    }
+    if (depth != STACK_MODE) {
+      if (!reserve_stack(m, p->max_depth - (uint32_t)depth)) {
+        step(m);
+        goto resume;
+      }
+      st = m->operands;
+    }
+    lv = m->lv;
+    ip = code + p->start[entry];
+    goto *dispatch[ip->op];
+  }
+
+  DA_OP(r_mov, X_MOV)
+  D_OP(r_movk, ip->k)
+  DAB_OP(r_add, X_ADD)
+  DAB_OP(r_sub, X_SUB)
+  DAB_OP(r_and, X_AND)
+  DAB_OP(r_or, X_OR)
+  DA_OP(r_addk, X_ADDK)
+  DA_OP(r_andk, X_ANDK)
+  DA_OP(r_ork, X_ORK)
+  A_IF(r_ifeq, C_EQ)
+  A_IF(r_iflt, C_LT)
+  AB_IF(r_if_cmpeq, C_CMPEQ)
+  A_IF(r_if_cmpeqk, C_CMPEQK)
+
+  r_inc:
+    lv[ip->d] = (word)((uint32_t)lv[ip->d] + (uint32_t)ip->k);
+    NEXT();
+  r_inc_goto:
+    lv[ip->d] = (word)((uint32_t)lv[ip->d] + (uint32_t)ip->k);
+    JUMP();
+  r_swap: {
+    word v = st[ip->a];
+    st[ip->a] = st[ip->b];
+    st[ip->b] = v;
+    NEXT();
+  }
+  r_goto:
+    JUMP();
+
+  r_sync:
+    m->sp = st + ip->k;
+    JUMP();
+
+  // the entry on m->stack, like the interpreter's state 0 handlers
+  r_stack: {
+    uint32_t i = ip->target;
+    decoded_insn *d = &m->code[i];
+    switch (unfused_op(d->op)) {
+      case DOP_PUSH:
+        push(m, d->arg);
+        break;
+      case DOP_DUP:
+        push(m, top(m));
+        break;
+      case DOP_POP:
+        pop(m);
+        break;
+      case DOP_SWAP: {
+        word b = pop(m);
+        word a = pop(m);
+        push(m, b);
+        push(m, a);
+        break;
+      }
+      case DOP_IADD:
+      case DOP_ISUB:
+      case DOP_IAND:
+      case DOP_IOR: {
+        byte op = unfused_op(d->op);
+        uint32_t b = (uint32_t)pop(m);
+        uint32_t a = (uint32_t)pop(m);
+        push(m, (word)(op == DOP_IADD ? a + b : op == DOP_ISUB ? a - b : op == DOP_IAND ? a & b : a | b));
+        break;
+      }
+      case DOP_ILOAD:
+        push(m, lv[d->local]);
+        break;
+      case DOP_ISTORE:
+        lv[d->local] = pop(m);
+        break;
+      case DOP_IINC:
+        lv[d->local] = (word)((uint32_t)lv[d->local] + (uint32_t)d->arg);
+        break;
+      case DOP_GOTO:
+        STACK_NEXT(d->target);
+      case DOP_IFEQ:
+        if (pop(m) == 0) {
+          STACK_NEXT(d->target);
+        }
+        break;
+      case DOP_IFLT:
+        if (pop(m) < 0) {
+          STACK_NEXT(d->target);
+        }
+        break;
+      case DOP_IF_ICMPEQ:
+        if (pop(m) == pop(m)) {
+          STACK_NEXT(d->target);
+        }
+        break;
+      default: // DOP_NOP
+        break;
+    }
+    STACK_NEXT(i + 1);
+  }
+
+  r_exit: {
+    decoded_insn *d = &m->code[ip->target];
+    if (ip->k != STACK_MODE) {
+      m->sp = st + ip->k;
+    }
+    m->program_counter = d->pc;
+    switch (unfused_op(d->op)) {
+      case DOP_INVOKEVIRTUAL:
+        invoke_method(m, d);
+        break;
+      case DOP_IRETURN:
+        if (!return_method(m)) {
+          step(m);
+        }
+        break;
+      case DOP_END:
+        break; // finished already
+      default: // I/O, halting and everything left to step()
+        step(m);
+        break;
+    }
+    goto resume;
+  }
+}
+
+#pragma GCC diagnostic pop
@@ -0,0 +1,353 @@
+#define _DEFAULT_SOURCE // mmap(), mincore(), sigaction() and sigsetjmp() under -std=c11
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ijvm.h"
+#include "ijvm_ext.h"
+#include "arena.h"
+#include "stack.h"
+#include "heap.h"
+
+// See stack.h.
+
+// what the handler jumps back to run_guarded() with
+#define FAULT_BELOW 1
+#define FAULT_ABOVE 2
+
+typedef struct stack_guard {
+  sigjmp_buf env;
+  ijvm *m;
+  struct stack_guard *prev;
+} stack_guard;
+
+static size_t page;
+static ijvm *stacks;                          // every mapped stack, through next_stack
+static bool stacks_locked;                    // held while stacks is changed
+static bool installed;                        // on_fault() handles SIGSEGV
+static _Thread_local stack_guard *active;     // innermost run_guarded() on this thread
+static struct sigaction previous;             // the SIGSEGV handler before ours
+
+static const char overflow_message[] = "Stack overflow\n";
+static const char underflow_message[] = "Stack underflow\n";
+
+// The machine whose guard pages addr is in, NULL if none.
+static ijvm *stack_at(const byte *addr, int *fault)
+{
+  // the list may be changing on another thread, but every link stored in
+  // it points to the rest of a whole list
+  for (ijvm *m = __atomic_load_n(&stacks, __ATOMIC_ACQUIRE); m != NULL;
+       m = __atomic_load_n(&m->next_stack, __ATOMIC_ACQUIRE)) {
+    const byte *bottom = (const byte *)m->stack;
+    const byte *end = (const byte *)(m->stack + m->stack_max);
+    if (addr >= bottom - page && addr < bottom) {
+      *fault = FAULT_BELOW;
+      return m;
+    }
+    if (addr >= end && addr < end + 2 * page) {
+      *fault = FAULT_ABOVE;
+      return m;
+    }
+  }
+  return NULL;
+}
+
+static void on_fault(int sig, siginfo_t *info, void *context)
+{
+  int fault = 0;
+  ijvm *m = stack_at(info->si_addr, &fault);
+  if (m == NULL) {
+    // not a stack, for the handler from before
+    if ((previous.sa_flags & SA_SIGINFO) != 0) {
+      previous.sa_sigaction(sig, info, context);
+    } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+      previous.sa_handler(sig);
+    } else {
+      // fault again without a handler, ending the process
+      installed = false;
+      sigaction(SIGSEGV, &previous, NULL);
+    }
+    return;
+  }
+  if (active != NULL && active->m == m) {
+    siglongjmp(active->env, fault);
+  }
+
+  // open the page for the faulting access and let the instruction complete,
+  // the machine stops after it
+  byte *at = (byte *)((uintptr_t)info->si_addr & ~(uintptr_t)(page - 1));
+  if (!m->stack_opened) {
+    if (fault == FAULT_BELOW) {
+      write(STDERR_FILENO, underflow_message, sizeof(underflow_message) - 1);
+    } else {
+      write(STDERR_FILENO, overflow_message, sizeof(overflow_message) - 1);
+    }
+  }
+  m->stack_opened = true;
+  m->done = true;
+  mprotect(at, page, PROT_READ | PROT_WRITE);
+}
+
+// The handler is installed with the first stack and stays, unless a fault
+// outside of the stacks has to end the process.
+static bool install_handler(void)
+{
+  if (installed) {
+    return true;
+  }
+  struct sigaction action = { 0 };
+  action.sa_sigaction = on_fault;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER; // left with siglongjmp()
+  sigemptyset(&action.sa_mask);
+  installed = sigaction(SIGSEGV, &action, &previous) == 0;
+  return installed;
+}
+
+// Machines on other threads may be mapping stacks too. The handler only
+// reads the list, so it does not take the lock.
+static void lock_stacks(void)
+{
+  while (__atomic_test_and_set(&stacks_locked, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+static void unlock_stacks(void)
+{
+  __atomic_clear(&stacks_locked, __ATOMIC_RELEASE);
+}
+
+static void unmap(word *stack, unsigned int stack_max)
+{
+  munmap((byte *)stack - page, stack_max * sizeof(word) + 3 * page);
+}
+
+bool map_stack(ijvm *m, size_t words)
+{
+  if (page == 0) {
+    page = (size_t)sysconf(_SC_PAGESIZE);
+  }
+  ijvm_arena *arena = m->arena;
+  size_t size = ((words > STACK_WORDS ? words : STACK_WORDS) * sizeof(word) + page - 1) / page * page;
+  if (size / sizeof(word) > UINT32_MAX / sizeof(word) || !install_handler()) {
+    return false;
+  }
+
+  if (arena->stack != NULL && arena->stack_max * sizeof(word) >= size) {
+    // the last machine's, its pages above STACK_KEEP_BYTES are released
+    m->stack = arena->stack;
+    m->stack_max = arena->stack_max;
+    arena->stack = NULL;
+    memset(m->stack, 0, words * sizeof(word));
+  } else {
+    byte *map = mmap(NULL, size + 3 * page, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    if (mprotect(map + page, size, PROT_READ | PROT_WRITE) != 0) {
+      munmap(map, size + 3 * page);
+      return false;
+    }
+    m->stack = (word *)(map + page);
+    m->stack_max = (unsigned int)(size / sizeof(word));
+  }
+  m->stack_opened = false;
+  m->stack_peak = 0;
+  m->stack_window = 0;
+  m->stack_trim_countdown = STACK_TRIM_INTERVAL;
+  m->stack_touched = 0;
+  lock_stacks();
+  m->next_stack = stacks;
+  __atomic_store_n(&stacks, m, __ATOMIC_RELEASE);
+  unlock_stacks();
+  return true;
+}
+
+static size_t touched_top(ijvm *m);
+
+void unmap_stack(ijvm *m)
+{
+  if (m->stack == NULL) {
+    return;
+  }
+  lock_stacks();
+  for (ijvm **p = &stacks; *p != NULL; p = &(*p)->next_stack) {
+    if (*p == m) {
+      __atomic_store_n(p, m->next_stack, __ATOMIC_RELEASE);
+      break;
+    }
+  }
+  unlock_stacks();
+
+  // kept for the next machine in the arena, with little memory behind it
+  ijvm_arena *arena = m->arena;
+  unmap_arena_stack(arena);
+  size_t top = touched_top(m);
+  if (top > STACK_KEEP_BYTES) {
+    madvise((byte *)m->stack + STACK_KEEP_BYTES, top - STACK_KEEP_BYTES, MADV_DONTNEED);
+  }
+  if (m->stack_opened) {
+    mprotect((byte *)m->stack - page, page, PROT_NONE);
+    mprotect(m->stack + m->stack_max, 2 * page, PROT_NONE);
+  }
+  arena->stack = m->stack;
+  arena->stack_max = m->stack_max;
+  m->stack = NULL;
+}
+
+void unmap_arena_stack(ijvm_arena *arena)
+{
+  if (arena->stack != NULL) {
+    unmap(arena->stack, arena->stack_max);
+    arena->stack = NULL;
+  }
+}
+
+#ifdef __APPLE__
+typedef char mincore_vec;
+#else
+typedef unsigned char mincore_vec;
+#endif
+
+// Counts the pages of the stack that are backed by memory, sets *top to the
+// end (in bytes from m->stack) of the highest of them.
+static size_t resident_pages(ijvm *m, size_t *top)
+{
+  mincore_vec vec[1024];
+  size_t size = m->stack_max * sizeof(word);
+  size_t count = 0;
+  *top = 0;
+  for (size_t start = 0; start < size; start += sizeof(vec) * page) {
+    size_t length = size - start < sizeof(vec) * page ? size - start : sizeof(vec) * page;
+    if (mincore((byte *)m->stack + start, length, vec) != 0) {
+      *top = size; // assume all of it
+      return size / page;
+    }
+    for (size_t i = 0; i < length / page; i++) {
+      if (vec[i] & 1) {
+        count++;
+        *top = start + (i + 1) * page;
+      }
+    }
+  }
+  return count;
+}
+
+static bool page_resident(ijvm *m, size_t index)
+{
+  mincore_vec vec[1];
+  return mincore((byte *)m->stack + index * page, page, vec) != 0 || (vec[0] & 1);
+}
+
+// The end (in bytes from m->stack) of the pages the stack has touched. The
+// stack is touched from the bottom up and released from the top down, so
+// that is the first page that is not resident, found with a few lookups
+// from the highest one m->stack_touched knows of.
+static size_t touched_top(ijvm *m)
+{
+  size_t pages = m->stack_max * sizeof(word) / page;
+  size_t lo = (m->stack_touched * sizeof(word) + page - 1) / page;
+  if (lo >= pages || !page_resident(m, lo)) {
+    return (lo < pages ? lo : pages) * page;
+  }
+  // lo is resident, find a page that is not
+  size_t hi = lo + 1;
+  for (size_t step = 1; hi < pages && page_resident(m, hi); step *= 2) {
+    lo = hi;
+    hi = lo + step;
+  }
+  if (hi > pages) {
+    hi = pages;
+  }
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (page_resident(m, mid)) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return hi * page;
+}
+
+void trim_stack(ijvm *m, bool scan)
+{
+  size_t used = (size_t)(m->sp - m->stack);
+  size_t window = m->stack_window > used ? m->stack_window : used;
+  m->stack_window = 0;
+  m->stack_trim_countdown = STACK_TRIM_INTERVAL;
+  if (window > m->stack_peak) {
+    m->stack_peak = (unsigned int)window;
+  }
+  if (window > m->stack_touched) {
+    m->stack_touched = (unsigned int)window;
+  }
+  if (!m->done) {
+    used = window; // a finished machine will not go that deep again
+  }
+  if (scan) {
+    // pushes between calls are only seen through the pages they touched
+    m->stack_touched = (unsigned int)(touched_top(m) / sizeof(word));
+    if (m->stack_touched > m->stack_peak) {
+      m->stack_peak = m->stack_touched;
+    }
+  }
+
+  size_t touched = m->stack_touched * sizeof(word);
+  size_t keep = (2 * used * sizeof(word) + page - 1) / page * page;
+  if (keep < STACK_KEEP_BYTES) {
+    keep = STACK_KEEP_BYTES;
+  }
+  if (used * sizeof(word) * 4 < touched && keep < touched) {
+    madvise((byte *)m->stack + keep, touched - keep, MADV_DONTNEED);
+    m->stack_touched = (unsigned int)(keep / sizeof(word));
+  }
+}
+
+ijvm_memory_stats get_memory_stats(ijvm *m)
+{
+  ijvm_memory_stats stats;
+  size_t top;
+  size_t resident = resident_pages(m, &top);
+  size_t current = (size_t)(m->sp - m->stack) * sizeof(word);
+  size_t peak = (size_t)m->stack_peak * sizeof(word);
+  if (top > peak) {
+    peak = top;
+  }
+  if (current > peak) {
+    peak = current;
+  }
+  stats.stack.current = current;
+  stats.stack.peak = peak;
+  stats.stack.resident = resident * page;
+  stats.stack.reserved = m->stack_max * sizeof(word) + 3 * page;
+  stats.heap = get_heap_stats(m);
+  return stats;
+}
+
+void stack_overflow(ijvm *m)
+{
+  if (active != NULL && active->m == m) {
+    siglongjmp(active->env, FAULT_ABOVE);
+  }
+  fprintf(stderr, "Stack overflow\n");
+  m->done = true;
+}
+
+void run_guarded(ijvm *m, void (*body)(ijvm *m))
+{
+  stack_guard guard;
+  guard.m = m;
+  guard.prev = active;
+  int fault = sigsetjmp(guard.env, 0);
+  if (fault == 0) {
+    active = &guard;
+    body(m);
+  } else {
+    fprintf(stderr, fault == FAULT_BELOW ? "Stack underflow\n" : "Stack overflow\n");
+    m->done = true;
+  }
+  active = guard.prev;
+}
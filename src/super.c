@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "util.h"
+
+// Static superinstructions.
+//
+// The sequences below were picked with tools/ngrams.py (--decoded --loops)
+// over the programs in files/: they are the most frequent ones inside loops,
+// mostly from mandelbread and the bfi2 interpreter loop. Longer sequences
+// come first so they win over their prefixes.
+
+#define MAX_SUPER_LENGTH 3
+
+typedef struct super_pattern {
+  byte fused;
+  byte length;
+  byte ops[MAX_SUPER_LENGTH];
+} super_pattern;
+
+static const super_pattern patterns[] = {
+  { DOP_ILOAD_PUSH_IF_ICMPEQ, 3, { DOP_ILOAD, DOP_PUSH, DOP_IF_ICMPEQ } },
+  { DOP_ILOAD_ILOAD_IADD, 3, { DOP_ILOAD, DOP_ILOAD, DOP_IADD } },
+  { DOP_ILOAD_ILOAD_ISUB, 3, { DOP_ILOAD, DOP_ILOAD, DOP_ISUB } },
+  { DOP_ILOAD_ILOAD, 2, { DOP_ILOAD, DOP_ILOAD } },
+  { DOP_ILOAD_PUSH, 2, { DOP_ILOAD, DOP_PUSH } },
+  { DOP_ILOAD_IFEQ, 2, { DOP_ILOAD, DOP_IFEQ } },
+  { DOP_ISTORE_ILOAD, 2, { DOP_ISTORE, DOP_ILOAD } },
+  { DOP_ISTORE_GOTO, 2, { DOP_ISTORE, DOP_GOTO } },
+  { DOP_IADD_ISTORE, 2, { DOP_IADD, DOP_ISTORE } },
+  { DOP_PUSH_IF_ICMPEQ, 2, { DOP_PUSH, DOP_IF_ICMPEQ } },
+  { DOP_PUSH_IADD, 2, { DOP_PUSH, DOP_IADD } },
+  { DOP_DUP_IFEQ, 2, { DOP_DUP, DOP_IFEQ } },
+  { DOP_DUP_IADD, 2, { DOP_DUP, DOP_IADD } },
+  { DOP_ISUB_IFLT, 2, { DOP_ISUB, DOP_IFLT } },
+  { DOP_IAND_IFEQ, 2, { DOP_IAND, DOP_IFEQ } },
+  { DOP_IINC_GOTO, 2, { DOP_IINC, DOP_GOTO } },
+};
+
+#define PATTERN_COUNT (sizeof(patterns) / sizeof(patterns[0]))
+
+// Checks whether the entries from code[i] on are the straight-line sequence
+// described by p. Entries inserted by the decoder (size 0) never match.
+static bool matches(ijvm *m, unsigned int i, const super_pattern *p)
+{
+  if (i + p->length > m->code_count) {
+    return false;
+  }
+  for (unsigned int k = 0; k < p->length; k++) {
+    decoded_insn *d = &m->code[i + k];
+    if (d->op != p->ops[k] || d->size == 0) {
+      return false;
+    }
+    if (k > 0 && d->pc != d[-1].pc + d[-1].size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void fuse_superinstructions(ijvm *m)
+{
+  unsigned int fused = 0;
+  unsigned int i = 0;
+  while (i < m->code_count) {
+    unsigned int length = 1;
+    for (unsigned int p = 0; p < PATTERN_COUNT; p++) {
+      if (matches(m, i, &patterns[p])) {
+        m->code[i].op = patterns[p].fused;
+        length = patterns[p].length;
+        fused++;
+        break;
+      }
+    }
+    i += length;
+  }
+  d3printf("fused %u superinstructions\n", fused);
+}
+
+byte unfused_op(byte op)
+{
+  if (op < DOP_FIRST_SUPER) {
+    return op;
+  }
+  for (unsigned int p = 0; p < PATTERN_COUNT; p++) {
+    if (patterns[p].fused == op) {
+      return patterns[p].ops[0];
+    }
+  }
+  return op;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "trace.h"
+#include "util.h"
+
+// Trace recording and the trace cache, see trace.h.
+//
+// Recording executes the loop with step(), so an aborted recording costs
+// nothing but time: the machine state is exactly where the reference
+// interpreter would have left it. Only straight-line stack and local
+// variable instructions and branches are traced; calls, returns, I/O and
+// anything left to step() end the recording.
+
+static void run_trace(ijvm *m, uint32_t header);
+
+loop_profile *get_trace_profile(ijvm *m)
+{
+  if (m->traces != NULL) {
+    return &m->traces->loops;
+  }
+  trace_cache *tc = malloc(sizeof(trace_cache));
+  if (tc == NULL) {
+    return NULL;
+  }
+  tc->loops.counters = calloc(m->code_count, sizeof(uint32_t));
+  tc->loops.compiled = calloc(m->code_count, 1);
+  tc->loops.hot = TRACE_HOT;
+  tc->loops.enter = run_trace;
+  tc->traces = calloc(m->code_count, sizeof(struct native_trace *));
+  tc->aborts = calloc(m->code_count, 1);
+  m->traces = tc;
+  if (tc->loops.counters == NULL || tc->loops.compiled == NULL
+      || tc->traces == NULL || tc->aborts == NULL) {
+    free_traces(m);
+    return NULL;
+  }
+  return &tc->loops;
+}
+
+static bool traceable(byte op)
+{
+  switch (op) {
+    case DOP_NOP:
+    case DOP_PUSH:
+    case DOP_DUP:
+    case DOP_POP:
+    case DOP_SWAP:
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR:
+    case DOP_ILOAD:
+    case DOP_ISTORE:
+    case DOP_IINC:
+    case DOP_GOTO:
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_IF_ICMPEQ:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Executes one iteration of the loop at header, recording it. Returns the
+// compiled trace, or NULL if the iteration did not make it back to the
+// header as a traceable straight line.
+static struct native_trace *record_trace(ijvm *m, uint32_t header)
+{
+  trace_insn *insns = malloc(TRACE_MAX_LENGTH * sizeof(trace_insn));
+  if (insns == NULL) {
+    return NULL;
+  }
+
+  uint32_t header_pc = m->code[header].pc;
+  unsigned int length = 0;
+  do {
+    int32_t index = m->pc_map[m->program_counter];
+    if (index < 0 || length == TRACE_MAX_LENGTH) {
+      break;
+    }
+    decoded_insn *d = &m->code[index];
+    byte op = unfused_op(d->op);
+    if (!traceable(op)) {
+      break;
+    }
+    step(m);
+    if (finished(m)) {
+      break;
+    }
+    insns[length].index = (uint32_t)index;
+    insns[length].taken = (op == DOP_IFEQ || op == DOP_IFLT || op == DOP_IF_ICMPEQ)
+                          && m->program_counter == m->code[d->target].pc;
+    length++;
+  } while (m->program_counter != header_pc);
+
+  struct native_trace *trace = NULL;
+  if (length > 0 && m->program_counter == header_pc && !finished(m)) {
+    trace = compile_trace(m, insns, length);
+    d3printf("trace at pc %u: %u instructions%s\n", header_pc, length,
+             trace == NULL ? ", not compiled" : "");
+  } else {
+    d3printf("trace at pc %u aborted at pc %u\n", header_pc, m->program_counter);
+  }
+  free(insns);
+  return trace;
+}
+
+// Records and compiles a trace at the hot loop header if there is none yet,
+// and runs it.
+static void run_trace(ijvm *m, uint32_t header)
+{
+  trace_cache *tc = m->traces;
+  if (tc->traces[header] == NULL) {
+    tc->traces[header] = record_trace(m, header);
+    if (tc->traces[header] == NULL) {
+      if (++tc->aborts[header] < TRACE_MAX_ABORTS) {
+        tc->loops.counters[header] = 0; // try again once it is hot again
+      }
+      return;
+    }
+    tc->loops.compiled[header] = 1;
+  }
+  m->program_counter = run_native_trace(m, tc->traces[header]);
+}
+
+void free_traces(ijvm *m)
+{
+  trace_cache *tc = m->traces;
+  if (tc == NULL) {
+    return;
+  }
+  if (tc->traces != NULL) {
+    for (unsigned int i = 0; i < m->code_count; i++) {
+      free_native_trace(tc->traces[i]);
+    }
+  }
+  free(tc->loops.counters);
+  free(tc->loops.compiled);
+  free(tc->traces);
+  free(tc->aborts);
+  free(tc);
+  m->traces = NULL;
+}
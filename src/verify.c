@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "interp.h"
+#include "verify.h"
+#include "util.h"
+
+// See verify.h.
+
+#define NOT_REACHED (-1)
+
+typedef struct verifier {
+  ijvm *m;
+  int32_t *depth;       // per entry, depth in the method being verified
+  uint32_t *reached;    // entries reached so far, in the order reached
+  uint32_t count;
+} verifier;
+
+// Stack words popped and pushed by d.
+static void stack_effect(const decoded_insn *d, int *pops, int *pushes)
+{
+  *pops = 0;
+  *pushes = 0;
+  switch (unfused_op(d->op)) {
+    case DOP_PUSH:
+    case DOP_ILOAD:
+    case DOP_IN:
+      *pushes = 1;
+      break;
+    case DOP_DUP:
+      *pops = 1;
+      *pushes = 2;
+      break;
+    case DOP_NEWARRAY:
+    case DOP_ANEWARRAY:
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case DOP_POP:
+    case DOP_ISTORE:
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_OUT:
+    case DOP_IRETURN:
+      *pops = 1;
+      break;
+    case DOP_SWAP:
+      *pops = 2;
+      *pushes = 2;
+      break;
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR:
+    case DOP_IALOAD:
+    case DOP_AIALOAD:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case DOP_IF_ICMPEQ:
+      *pops = 2;
+      break;
+    case DOP_IASTORE:
+    case DOP_AIASTORE:
+      *pops = 3;
+      break;
+    case DOP_INVOKEVIRTUAL:
+      *pops = d->local;
+      *pushes = 1;
+      break;
+    default:
+      break;
+  }
+}
+
+// Stores the entries execution may continue at after entry i in next[],
+// returns how many there are.
+static unsigned int successors(const decoded_insn *d, uint32_t i, uint32_t next[2])
+{
+  switch (unfused_op(d->op)) {
+    case DOP_GOTO:
+      next[0] = d->target;
+      return 1;
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_IF_ICMPEQ:
+      next[0] = i + 1;
+      next[1] = d->target;
+      return 2;
+    case DOP_IRETURN:
+    case DOP_HALT:
+    case DOP_ERR:
+    case DOP_END:
+    case DOP_SLOW:
+      return 0;
+    default:
+      next[0] = i + 1;
+      return 1;
+  }
+}
+
+// Records that entry i is reached with depth. Returns false if it was
+// reached with another depth before.
+static bool reach(verifier *v, uint32_t i, int32_t depth)
+{
+  if (v->depth[i] == NOT_REACHED) {
+    v->depth[i] = depth;
+    v->reached[v->count++] = i;
+    return true;
+  }
+  return v->depth[i] == depth;
+}
+
+// Verifies the method starting at entry start, with a frame of frame
+// locals (UINT32_MAX for main, which has room for all, see decode.h). Sets
+// *max_stack to the deepest its operand stack gets.
+static bool verify_method(verifier *v, uint32_t start, uint32_t frame, uint32_t *max_stack)
+{
+  ijvm *m = v->m;
+  *max_stack = 0;
+  bool ok = reach(v, start, 0);
+  // entries past next in reached[] still have to be looked at
+  for (uint32_t next = 0; ok && next < v->count; next++) {
+    uint32_t i = v->reached[next];
+    decoded_insn *d = &m->code[i];
+    byte op = unfused_op(d->op);
+    int32_t depth = v->depth[i];
+    int pops, pushes;
+    stack_effect(d, &pops, &pushes);
+
+    if (op == DOP_SLOW || pops > depth) {
+      ok = false;
+    } else if (op == DOP_IRETURN && start == 0) {
+      ok = false;
+    } else if ((op == DOP_ILOAD || op == DOP_ISTORE || op == DOP_IINC) && d->local >= frame) {
+      ok = false;
+    }
+    depth += pushes - pops;
+    if ((uint32_t)depth > *max_stack) {
+      *max_stack = (uint32_t)depth;
+    }
+
+    uint32_t targets[2];
+    unsigned int n = successors(d, i, targets);
+    for (unsigned int k = 0; ok && k < n; k++) {
+      ok = reach(v, targets[k], depth);
+    }
+  }
+  if (!ok) {
+    d3printf("verifier: method at pc %u fails to verify\n", m->code[start].pc);
+  }
+
+  // leave depth[] clean for the next method
+  for (uint32_t k = 0; k < v->count; k++) {
+    v->depth[v->reached[k]] = NOT_REACHED;
+  }
+  v->count = 0;
+  return ok;
+}
+
+bool verify_program(ijvm *m)
+{
+  m->verified = false;
+  m->max_stack = 0;
+
+  verifier v = { 0 };
+  v.m = m;
+  v.depth = malloc(m->code_count * sizeof(int32_t));
+  v.reached = malloc(m->code_count * sizeof(uint32_t));
+  bool ok = v.depth != NULL && v.reached != NULL;
+  for (uint32_t i = 0; ok && i < m->code_count; i++) {
+    v.depth[i] = NOT_REACHED;
+  }
+
+  // every method once, with the frame from its header; per entry, the
+  // deepest stack of the method starting there
+  uint32_t *method_max = ok ? malloc(m->code_count * sizeof(uint32_t)) : NULL;
+  uint32_t max_stack = 0;
+  ok = ok && method_max != NULL && verify_method(&v, 0, UINT32_MAX, &max_stack);
+  for (uint32_t i = 0; ok && i < m->code_count; i++) {
+    method_max[i] = NOT_REACHED;
+  }
+  for (uint32_t i = 0; ok && i < m->code_count; i++) {
+    decoded_insn *d = &m->code[i];
+    if (unfused_op(d->op) == DOP_INVOKEVIRTUAL && method_max[d->target] == (uint32_t)NOT_REACHED) {
+      ok = verify_method(&v, d->target, m->methods[d->arg].frame_size, &method_max[d->target]);
+      if (method_max[d->target] > max_stack) {
+        max_stack = method_max[d->target];
+      }
+    }
+  }
+
+  // calls reserve the deepest stack of their method along with the frame
+  for (uint32_t k = 0; ok && k < m->constant_pool_count; k++) {
+    method_info *method = &m->methods[k];
+    if (method->pc != 0 && m->pc_map[method->pc] >= 0
+        && method_max[m->pc_map[method->pc]] != (uint32_t)NOT_REACHED) {
+      method->max_stack = method_max[m->pc_map[method->pc]];
+      method->call_words = method->local_count + FRAME_SAVED + method->max_stack;
+    }
+  }
+  free(method_max);
+  free(v.depth);
+  free(v.reached);
+
+  m->verified = ok;
+  m->max_stack = ok ? max_stack : 0;
+  d3printf("verifier: %s, max stack %u\n", ok ? "verified" : "not verified", m->max_stack);
+  return ok;
+}
@@ -0,0 +1,88 @@
+#define _DEFAULT_SOURCE // mmap() and MAP_ANONYMOUS under -std=c11
+#include <string.h>
+#include "ijvm.h"
+#include "x86.h"
+
+// See x86.h.
+
+#ifdef HAVE_X86_JIT
+
+#include <sys/mman.h>
+
+byte *alloc_code(size_t size)
+{
+  void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return code == MAP_FAILED ? NULL : code;
+}
+
+bool seal_code(byte *code, size_t size)
+{
+  return mprotect(code, size, PROT_READ | PROT_EXEC) == 0;
+}
+
+void free_code(byte *code, size_t size)
+{
+  munmap(code, size);
+}
+
+void emit(emitter *e, const byte *bytes, size_t n)
+{
+  memcpy(e->buf + e->pos, bytes, n);
+  e->pos += n;
+}
+
+void emit32(emitter *e, uint32_t value)
+{
+  memcpy(e->buf + e->pos, &value, 4); // x86 is little endian
+  e->pos += 4;
+}
+
+void emit64(emitter *e, uint64_t value)
+{
+  memcpy(e->buf + e->pos, &value, 8);
+  e->pos += 8;
+}
+
+void patch_rel32(emitter *e, size_t pos, size_t dest)
+{
+  uint32_t rel = (uint32_t)(dest - (pos + 4));
+  memcpy(e->buf + pos, &rel, 4);
+}
+
+void emit_jump(emitter *e, byte cc, size_t dest)
+{
+  if (cc == 0) {
+    EMIT(e, 0xE9);
+  } else {
+    byte op[2] = { 0x0F, cc };
+    emit(e, op, 2);
+  }
+  emit32(e, 0);
+  patch_rel32(e, e->pos - 4, dest);
+}
+
+void emit_save_registers(emitter *e)
+{
+  EMIT(e, 0x53,                           // push rbx
+          0x55,                           // push rbp
+          0x41, 0x54,                     // push r12
+          0x41, 0x55,                     // push r13
+          0x41, 0x56,                     // push r14
+          0x41, 0x57,                     // push r15
+          0x48, 0x83, 0xEC, 0x08,         // sub rsp, 8 (align calls)
+          0x49, 0x89, 0xFE);              // mov r14, rdi
+}
+
+void emit_return(emitter *e)
+{
+  EMIT(e, 0x48, 0x83, 0xC4, 0x08,         // add rsp, 8
+          0x41, 0x5F,                     // pop r15
+          0x41, 0x5E,                     // pop r14
+          0x41, 0x5D,                     // pop r13
+          0x41, 0x5C,                     // pop r12
+          0x5D,                           // pop rbp
+          0x5B,                           // pop rbx
+          0xC3);                          // ret
+}
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/ijvm.h"
+#include "../include/ijvm_ext.h"
+#include "testutil.h"
+
+/*****************************************************************************
+ * testbonusengines: every engine of run() against step()
+ *****************************************************************************
+ * run() has to leave the machine as calling step() until finished() would
+ * have, whichever engine set_engine() picked. Each program here is run once
+ * by step() and once by run() with every engine, after which the output and
+ * the program counter have to be the same.
+ ****************************************************************************/
+
+#define ENGINES 5 // ENGINE_INTERPRETER up to ENGINE_REGISTER
+#define MAX_OUTPUT 4096
+
+typedef struct {
+    char output[MAX_OUTPUT];
+    size_t length;
+    uint32_t program_counter;
+    bool finished;
+} result;
+
+static FILE *input_of(const char *text)
+{
+    FILE *input = tmpfile();
+    assert(input);
+    fputs(text, input);
+    rewind(input);
+    return input;
+}
+
+// Runs binary on input with engine, step() for -1.
+static void run_with(char *binary, FILE *input, int engine, result *r)
+{
+    FILE *output = tmpfile();
+    assert(output);
+    rewind(input);
+    ijvm *m = init_ijvm(binary, input, output);
+    assert(m != NULL);
+
+    if (engine < 0) {
+        while (!finished(m))
+            step(m);
+    } else {
+        set_engine(m, (ijvm_engine)engine);
+        run(m);
+    }
+    r->program_counter = get_program_counter(m);
+    r->finished = finished(m);
+    destroy_ijvm(m);
+
+    rewind(output);
+    r->length = fread(r->output, 1, sizeof(r->output), output);
+    fclose(output);
+}
+
+static void check_engines(char *binary, FILE *input)
+{
+    result expected, actual;
+    run_with(binary, input, -1, &expected);
+    assert(expected.finished);
+    for (int engine = 0; engine < ENGINES; engine++) {
+        run_with(binary, input, engine, &actual);
+        assert(actual.finished);
+        assert(actual.program_counter == expected.program_counter);
+        assert(actual.length == expected.length);
+        assert(memcmp(actual.output, expected.output, actual.length) == 0);
+    }
+}
+
+static void check_all(char **binaries, size_t count)
+{
+    FILE *input = input_of("");
+    for (size_t i = 0; i < count; i++)
+        check_engines(binaries[i], input);
+    fclose(input);
+}
+
+void test_engines_basic(void)
+{
+    char *binaries[] = {
+        "files/task2/TestBipush1.ijvm", "files/task2/TestIadd1.ijvm",
+        "files/task2/TestIsub1.ijvm", "files/task2/TestIAND1.ijvm",
+        "files/task2/TestIOR1.ijvm", "files/task2/TestSwap1.ijvm",
+        "files/task2/TestErr.ijvm", "files/task2/TestNoHalt.ijvm",
+        "files/task3/GOTO1.ijvm", "files/task3/IFEQ1.ijvm",
+        "files/task3/IFLT1.ijvm", "files/task3/IFICMPEQ1.ijvm",
+        "files/task4/IINCTest.ijvm", "files/task4/LoadStoreTest.ijvm",
+        "files/task4/WIDETest.ijvm", "files/task4/WIDEAlternateTest.ijvm",
+    };
+    check_all(binaries, sizeof(binaries) / sizeof(binaries[0]));
+}
+
+void test_engines_calls(void)
+{
+    char *binaries[] = {
+        "files/task5/TestInvokeArgs.ijvm", "files/task5/fib.ijvm",
+        "files/task5/recursive_sum.ijvm", "files/task5/test-nestedinvoke.ijvm",
+        "files/examples/collatz.ijvm", "files/advanced/deep_recursion.ijvm",
+        "files/advanced/Tanenbaum.ijvm", "files/advanced/all_regular.ijvm",
+        "files/bonus/tailfib.ijvm", "files/bonus/test_tailcall.ijvm",
+    };
+    check_all(binaries, sizeof(binaries) / sizeof(binaries[0]));
+}
+
+void test_engines_arrays(void)
+{
+    char *binaries[] = {
+        "files/bonus/TestGC1.ijvm", "files/bonus/TestGC2.ijvm",
+        "files/bonus/TestGC3.ijvm", "files/bonus/TestGC4.ijvm",
+        "files/bonus/TestAltGC3.ijvm", "files/bonus/TestAltGC5.ijvm",
+        "files/bonus/TestPreciseGC.ijvm",
+    };
+    check_all(binaries, sizeof(binaries) / sizeof(binaries[0]));
+}
+
+void test_engines_input(void)
+{
+    FILE *input = input_of("ABCDE\n");
+    check_engines("files/task2/TestInOut.ijvm", input);
+    fclose(input);
+
+    input = input_of("99 5 + 4 / 22 1*- ! ? 99 5+4/22v1*-!?.\n");
+    check_engines("files/advanced/SimpleCalc.ijvm", input);
+    fclose(input);
+}
+
+// bfi2 does not verify, so every engine has to fall back to running it
+// checked.
+void test_engines_unverified(void)
+{
+    FILE *input = fopen("files/bonus/brainfuck/hello_world.bf", "r");
+    assert(input);
+    check_engines("files/bonus/bfi2.ijvm", input);
+    fclose(input);
+}
+
+int main(void)
+{
+    RUN_TEST(test_engines_basic);
+    RUN_TEST(test_engines_calls);
+    RUN_TEST(test_engines_arrays);
+    RUN_TEST(test_engines_input);
+    RUN_TEST(test_engines_unverified);
+    return END_TEST();
+}
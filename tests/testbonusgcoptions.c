@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/ijvm.h"
+#include "../include/ijvm_ext.h"
+#include "testutil.h"
+
+/*****************************************************************************
+ * testbonusgcoptions: collecting with the options of set_gc_options()
+ *****************************************************************************
+ * However the heap is collected, GC has to free the same arrays at the same
+ * time as with the defaults. The GC tests are stepped through next to a
+ * machine with the defaults, comparing is_heap_freed() for every array after
+ * every instruction.
+ *
+ * TestGCChurn fills a table with 1 MB of arrays (enough to be marked in
+ * parallel), drops every other one (leaving their size class half empty, to
+ * be compacted) and makes garbage for the old generation to be collected
+ * incrementally, before it checks that the arrays it kept still hold what
+ * it put in them. get_memory_stats() shows what each option did.
+ ****************************************************************************/
+
+#define OPTION_SETS 5
+#define MAX_ARRAYS 64
+#define CHURN_ARRAYS 1024 // in the table
+#define CHURN_KEPT (CHURN_ARRAYS / 2 + 1) // with the table itself
+
+// Option set i, starting from the defaults of m: 0 the defaults, 1
+// incremental, 2 parallel, 3 concurrent, 4 all of them.
+static ijvm_gc_options options_of(ijvm *m, int i)
+{
+    ijvm_gc_options options = get_gc_options(m);
+    switch (i) {
+    case 1:
+        options.nursery_bytes = 0; // every array old, in the cycles
+        options.pause_words = 64;
+        break;
+    case 2:
+        options.nursery_bytes = 0;
+        options.mark_threads = 4;
+        break;
+    case 3:
+        options.nursery_bytes = 0;
+        options.concurrent_marking = true;
+        break;
+    case 4:
+        options.pause_words = 64;
+        options.mark_threads = 4;
+        options.concurrent_marking = true;
+        break;
+    }
+    return options;
+}
+
+static ijvm *init_with(char *binary, FILE *output, int i)
+{
+    ijvm *m = init_ijvm(binary, stdin, output);
+    assert(m != NULL);
+    assert(set_gc_options(m, options_of(m, i)));
+    return m;
+}
+
+static bool allocates(byte op)
+{
+    return op == OP_NEWARRAY || op == OP_ANEWARRAY;
+}
+
+// Steps binary with option set i next to a machine with the defaults.
+static void check_same_as_defaults(char *binary, int i)
+{
+    FILE *expected_output = tmpfile();
+    FILE *output = tmpfile();
+    ijvm *expected = init_with(binary, expected_output, 0);
+    ijvm *m = init_with(binary, output, i);
+
+    word expected_refs[MAX_ARRAYS], refs[MAX_ARRAYS];
+    int count = 0;
+    while (!finished(expected)) {
+        assert(!finished(m));
+        byte op = get_instruction(expected);
+        step(expected);
+        step(m);
+        assert(get_program_counter(m) == get_program_counter(expected));
+        if (allocates(op)) {
+            assert(count < MAX_ARRAYS);
+            expected_refs[count] = tos(expected);
+            refs[count] = tos(m);
+            count++;
+        }
+        for (int k = 0; k < count; k++)
+            assert(is_heap_freed(m, refs[k]) == is_heap_freed(expected, expected_refs[k]));
+    }
+    assert(finished(m));
+
+    ijvm_memory_stats expected_stats = get_memory_stats(expected);
+    ijvm_memory_stats stats = get_memory_stats(m);
+    assert(stats.heap.arrays == expected_stats.heap.arrays);
+    assert(stats.heap.used == expected_stats.heap.used);
+
+    char expected_text[256], text[256];
+    rewind(expected_output);
+    rewind(output);
+    size_t length = fread(expected_text, 1, sizeof(expected_text), expected_output);
+    assert(fread(text, 1, sizeof(text), output) == length);
+    assert(memcmp(text, expected_text, length) == 0);
+
+    destroy_ijvm(expected);
+    destroy_ijvm(m);
+    fclose(expected_output);
+    fclose(output);
+}
+
+void test_gc_programs(void)
+{
+    char *binaries[] = {
+        "files/bonus/TestGC1.ijvm", "files/bonus/TestGC2.ijvm",
+        "files/bonus/TestGC3.ijvm", "files/bonus/TestGC4.ijvm",
+        "files/bonus/TestAltGC3.ijvm", "files/bonus/TestAltGC4.ijvm",
+        "files/bonus/TestAltGC5.ijvm",
+    };
+    for (int i = 1; i < OPTION_SETS; i++) {
+        for (size_t b = 0; b < sizeof(binaries) / sizeof(binaries[0]); b++)
+            check_same_as_defaults(binaries[b], i);
+    }
+}
+
+// Runs TestGCChurn with option set i, checking it printed A and kept
+// exactly the arrays it should have.
+static ijvm_heap_stats run_churn(int i)
+{
+    FILE *output = tmpfile();
+    ijvm *m = init_with("files/bonus/TestGCChurn.ijvm", output, i);
+    run(m);
+    assert(finished(m));
+    ijvm_heap_stats stats = get_memory_stats(m).heap;
+    assert(stats.arrays == CHURN_KEPT);
+
+    rewind(output);
+    assert(fgetc(output) == 'A');
+    assert(fgetc(output) == EOF);
+    destroy_ijvm(m);
+    fclose(output);
+    return stats;
+}
+
+void test_churn_options(void)
+{
+    ijvm_heap_stats defaults = run_churn(0);
+    assert(defaults.slices == 0);
+    assert(defaults.compactions > 0);
+
+    ijvm_heap_stats incremental = run_churn(1);
+    assert(incremental.slices > 0);
+    assert(incremental.collections > defaults.collections);
+    assert(incremental.compactions > 0);
+
+    ijvm_heap_stats parallel = run_churn(2);
+    assert(parallel.slices == 0);
+    assert(parallel.collections == defaults.collections);
+
+    ijvm_heap_stats concurrent = run_churn(3);
+    assert(concurrent.collections > defaults.collections);
+
+    run_churn(4);
+}
+
+// Steps through TestGCChurn stopping the world (with one thread or four),
+// looking at the heap after each GC.
+static void check_churn_compacted(int i)
+{
+    FILE *output = tmpfile();
+    ijvm *m = init_with("files/bonus/TestGCChurn.ijvm", output, i);
+
+    word refs[CHURN_ARRAYS];
+    int count = 0;
+    int gcs = 0;
+    size_t full_reserved = 0;
+    while (!finished(m)) {
+        byte op = get_instruction(m);
+        step(m);
+        if (op == OP_NEWARRAY && count < CHURN_ARRAYS) {
+            refs[count++] = tos(m);
+        }
+        if (op != OP_GC) {
+            continue;
+        }
+        ijvm_heap_stats stats = get_memory_stats(m).heap;
+        gcs++;
+        if (gcs == 1) {
+            // all of the table
+            assert(stats.arrays == CHURN_ARRAYS + 1);
+            assert(stats.compactions == 0);
+            full_reserved = stats.reserved;
+            for (int k = 0; k < count; k++)
+                assert(!is_heap_freed(m, refs[k]));
+        } else if (gcs == 2) {
+            // every other one freed, their slabs given back
+            assert(stats.arrays == CHURN_KEPT);
+            assert(stats.compactions > 0);
+            assert(stats.reserved < full_reserved);
+            for (int k = 0; k < count; k++)
+                assert(is_heap_freed(m, refs[k]) == (k % 2 == 1));
+        }
+    }
+    assert(gcs == 4);
+    assert(count == CHURN_ARRAYS);
+    // the arrays moved, their references still work
+    for (int k = 0; k < count; k += 2)
+        assert(!is_heap_freed(m, refs[k]));
+    rewind(output);
+    assert(fgetc(output) == 'A');
+
+    destroy_ijvm(m);
+    fclose(output);
+}
+
+void test_churn_compacted(void)
+{
+    check_churn_compacted(0);
+    check_churn_compacted(2);
+}
+
+int main(void)
+{
+    RUN_TEST(test_gc_programs);
+    RUN_TEST(test_churn_options);
+    RUN_TEST(test_churn_compacted);
+    return END_TEST();
+}
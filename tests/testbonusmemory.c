@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include "../include/ijvm.h"
+#include "../include/ijvm_ext.h"
+#include "../include/arena.h"
+#include "testutil.h"
+
+/*****************************************************************************
+ * testbonusmemory: memory given back
+ *****************************************************************************
+ * The stack keeps its pages backed after a deep recursion only until it has
+ * stayed much shallower for a while, get_memory_stats() shows how much of it
+ * is resident. A recycled arena hands its block and its stack to the next
+ * machine.
+ ****************************************************************************/
+
+#define DEEP_BYTES (1u << 20) // deep_recursion goes about 1.5 MB deep
+
+void test_stack_shrinks_step(void)
+{
+    FILE *output = tmpfile();
+    ijvm *m = init_ijvm("files/advanced/deep_recursion.ijvm", stdin, output);
+    assert(m != NULL);
+
+    while (!finished(m))
+        step(m);
+
+    ijvm_memory_stats stats = get_memory_stats(m);
+    assert(stats.stack.peak >= DEEP_BYTES);
+    assert(stats.stack.resident < stats.stack.peak / 4);
+    assert(stats.stack.resident <= stats.stack.reserved);
+
+    destroy_ijvm(m);
+    fclose(output);
+}
+
+void test_stack_shrinks_run(void)
+{
+    for (int engine = ENGINE_INTERPRETER; engine <= ENGINE_REGISTER; engine++) {
+        FILE *output = tmpfile();
+        ijvm *m = init_ijvm("files/advanced/deep_recursion.ijvm", stdin, output);
+        assert(m != NULL);
+
+        set_engine(m, (ijvm_engine)engine);
+        run(m);
+        assert(finished(m));
+
+        ijvm_memory_stats stats = get_memory_stats(m);
+        assert(stats.stack.peak >= DEEP_BYTES);
+        assert(stats.stack.resident < stats.stack.peak / 4);
+
+        destroy_ijvm(m);
+        fclose(output);
+    }
+}
+
+// Runs m to the end, returns how many bytes it printed to output, which it
+// copies to text.
+static size_t run_to_end(ijvm *m, FILE *output, char *text, size_t size)
+{
+    assert(m != NULL);
+    run(m);
+    assert(finished(m));
+    rewind(output);
+    return fread(text, 1, size, output);
+}
+
+void test_arena_recycled(void)
+{
+    char expected[1024], actual[1024];
+    FILE *input = tmpfile();
+    FILE *output = tmpfile();
+    ijvm *m = init_ijvm("files/examples/ones.ijvm", input, output);
+    size_t expected_length = run_to_end(m, output, expected, sizeof(expected));
+    assert(expected_length > 0);
+    destroy_ijvm(m);
+    fclose(output);
+
+    ijvm_arena *arena = create_arena();
+    assert(arena != NULL);
+
+    // the larger program first, so that the second fits in its block
+    output = tmpfile();
+    m = init_ijvm_in(arena, "files/advanced/mandelbread.ijvm", input, output);
+    assert(m != NULL);
+    assert(init_ijvm_in(arena, "files/examples/ones.ijvm", input, output) == NULL);
+    run_to_end(m, output, actual, sizeof(actual));
+    word *stack = m->stack;
+    destroy_ijvm(m);
+    fclose(output);
+    byte *block = arena->block;
+    size_t size = arena->size;
+
+    output = tmpfile();
+    m = init_ijvm_in(arena, "files/examples/ones.ijvm", input, output);
+    assert(m != NULL);
+    assert(m->stack == stack);
+    assert(arena->block == block && arena->size == size);
+    assert(arena->extra == NULL);
+    size_t length = run_to_end(m, output, actual, sizeof(actual));
+    assert(length == expected_length);
+    assert(memcmp(actual, expected, length) == 0);
+    destroy_ijvm(m);
+    fclose(output);
+
+    destroy_arena(arena);
+    fclose(input);
+}
+
+int main(void)
+{
+    RUN_TEST(test_stack_shrinks_step);
+    RUN_TEST(test_stack_shrinks_run);
+    RUN_TEST(test_arena_recycled);
+    return END_TEST();
+}
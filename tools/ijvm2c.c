@@ -0,0 +1,803 @@
+#define _DEFAULT_SOURCE // mkstemp() and fork() under -std=c11
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "ijvm.h"
+#include "decode.h"
+#include "interp.h"
+#include "util.h"
+
+// Ahead-of-time translator from IJVM to C.
+//
+//   ./ijvm2c binary [out.c]        writes a standalone C program for binary
+//   ./ijvm2c --test binary [input]  translates and compiles binary, runs it
+//                                   and the interpreter on input (a file,
+//                                   empty if left out) and compares them
+//
+// The program is loaded with init_ijvm(), so the translation starts from the
+// same decoded program (see decode.h) the interpreter runs. Every method
+// becomes a C function taking its arguments as parameters, with its locals as
+// C variables and branches as gotos. Where the operand stack depth is known
+// at every instruction of a method, stack slots are C variables as well (s0
+// the bottom one), so the C compiler can keep everything in registers.
+// Methods whose depth depends on the path taken keep their operand stack in a
+// growable array instead, and if any method pops words it did not push (which
+// reach into its caller's stack), all of them do. IN and OUT read stdin and
+// write stdout like init_ijvm_std() sets up m->in and m->out, and errors are
+// reported with the messages step() uses.
+//
+// A return discards whatever the method left on its operand stack below the
+// return value, as IRETURN is specified to do. Programs using arrays
+// (NEWARRAY, IALOAD, IASTORE) are not translated, the runtime has no heap.
+
+#define NOT_REACHED (-2)
+#define PATH_DEPENDENT (-1)
+
+typedef struct translator {
+  ijvm *m;
+  FILE *out;
+  int32_t *depth;       // per entry, depth in the method being looked at
+  uint32_t *work;
+  bool *label;          // per entry, whether something branches to it
+  bool *is_method;      // per entry, whether it is the start of a method
+  uint16_t *args;       // per method start, argument and local count
+  uint16_t *locals;
+  bool all_dynamic;     // every method keeps its stack in the array
+
+  // the method being looked at
+  uint32_t start;
+  uint32_t first;       // lowest and highest entry reached from start
+  uint32_t last;
+  uint32_t max_depth;
+  uint32_t local_count;
+  bool dynamic;
+  bool underflow;       // pops words it did not push
+  bool unsupported;     // has an instruction that can not be translated
+} translator;
+
+// Stack words popped and pushed by d.
+static void stack_effect(const decoded_insn *d, int *pops, int *pushes)
+{
+  *pops = 0;
+  *pushes = 0;
+  switch (unfused_op(d->op)) {
+    case DOP_PUSH:
+    case DOP_ILOAD:
+    case DOP_IN:
+      *pushes = 1;
+      break;
+    case DOP_DUP:
+      *pops = 1;
+      *pushes = 2;
+      break;
+    case DOP_NEWARRAY:
+    case DOP_ANEWARRAY:
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case DOP_POP:
+    case DOP_ISTORE:
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_OUT:
+    case DOP_IRETURN:
+      *pops = 1;
+      break;
+    case DOP_SWAP:
+      *pops = 2;
+      *pushes = 2;
+      break;
+    case DOP_IADD:
+    case DOP_ISUB:
+    case DOP_IAND:
+    case DOP_IOR:
+    case DOP_IALOAD:
+    case DOP_AIALOAD:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case DOP_IF_ICMPEQ:
+      *pops = 2;
+      break;
+    case DOP_IASTORE:
+    case DOP_AIASTORE:
+      *pops = 3;
+      break;
+    case DOP_INVOKEVIRTUAL:
+      *pops = d->local;
+      *pushes = 1;
+      break;
+    default:
+      break;
+  }
+}
+
+// Stores the entries execution may continue at after entry i in next[],
+// returns how many there are.
+static unsigned int successors(const decoded_insn *d, uint32_t i, uint32_t next[2])
+{
+  switch (unfused_op(d->op)) {
+    case DOP_GOTO:
+      next[0] = d->target;
+      return 1;
+    case DOP_IFEQ:
+    case DOP_IFLT:
+    case DOP_IF_ICMPEQ:
+      next[0] = i + 1;
+      next[1] = d->target;
+      return 2;
+    case DOP_IRETURN:
+    case DOP_HALT:
+    case DOP_ERR:
+    case DOP_END:
+    case DOP_SLOW:
+      return 0;
+    default:
+      next[0] = i + 1;
+      return 1;
+  }
+}
+
+// Whether step() implements opcode, everything else halts the machine.
+static bool implemented(byte opcode)
+{
+  switch (opcode) {
+    case OP_BIPUSH: case OP_DUP: case OP_ERR: case OP_GOTO: case OP_HALT:
+    case OP_IADD: case OP_IAND: case OP_IFEQ: case OP_IFLT: case OP_IF_ICMPEQ:
+    case OP_IINC: case OP_ILOAD: case OP_IN: case OP_INVOKEVIRTUAL: case OP_IOR:
+    case OP_IRETURN: case OP_ISTORE: case OP_ISUB: case OP_LDC_W: case OP_NOP:
+    case OP_OUT: case OP_POP: case OP_SWAP: case OP_WIDE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether the DOP_SLOW entry d can be translated, see emit_slow().
+static bool slow_supported(ijvm *m, const decoded_insn *d)
+{
+  byte opcode = m->text[d->pc];
+  if (!implemented(opcode)) {
+    return true;
+  }
+  if (d->pc + 3 > m->text_size) {
+    return false; // truncated
+  }
+  return opcode == OP_LDC_W || opcode == OP_WIDE;
+}
+
+static void reach(translator *t, uint32_t *count, uint32_t i, int32_t depth)
+{
+  if (t->depth[i] == depth || t->depth[i] == PATH_DEPENDENT) {
+    return;
+  }
+  if (t->depth[i] == NOT_REACHED) {
+    t->first = i < t->first ? i : t->first;
+    t->last = i > t->last ? i : t->last;
+  }
+  t->depth[i] = t->depth[i] == NOT_REACHED ? depth : PATH_DEPENDENT;
+  t->work[(*count)++] = i; // at most twice per entry
+}
+
+// Finds the entries of the method starting at entry start (args is its
+// argument count and locals its local variable count), computing the depth
+// at each and what else the method needs to be emitted. The depths are
+// left in t->depth until forget() resets them.
+static void analyze(translator *t, uint32_t start, uint32_t args, uint32_t locals)
+{
+  ijvm *m = t->m;
+  t->start = start;
+  t->first = start;
+  t->last = start;
+  t->max_depth = 0;
+  t->local_count = args + locals;
+  t->dynamic = t->all_dynamic;
+  t->underflow = false;
+  t->unsupported = false;
+
+  uint32_t count = 0;
+  reach(t, &count, start, 0);
+  while (count > 0) {
+    uint32_t i = t->work[--count];
+    decoded_insn *d = &m->code[i];
+    byte op = unfused_op(d->op);
+    int32_t depth = t->depth[i];
+    int pops, pushes;
+    stack_effect(d, &pops, &pushes);
+    if (depth == PATH_DEPENDENT || pops > depth) {
+      t->dynamic = true;
+      depth = PATH_DEPENDENT;
+    } else {
+      uint32_t used = (uint32_t)(depth + (pushes > pops ? pushes - pops : 0));
+      t->max_depth = used > t->max_depth ? used : t->max_depth;
+      depth += pushes - pops;
+    }
+    if ((op == DOP_ILOAD || op == DOP_ISTORE || op == DOP_IINC) && d->local >= t->local_count) {
+      t->local_count = d->local + 1u;
+    }
+    if ((op == DOP_SLOW && !slow_supported(m, d))
+        || op == DOP_NEWARRAY || op == DOP_IALOAD || op == DOP_IASTORE
+        || op == DOP_ANEWARRAY || op == DOP_AIALOAD || op == DOP_AIASTORE) {
+      t->unsupported = true;
+    }
+    if (op == DOP_GOTO || op == DOP_IFEQ || op == DOP_IFLT || op == DOP_IF_ICMPEQ) {
+      t->label[d->target] = true;
+    }
+
+    uint32_t next[2];
+    unsigned int n = successors(d, i, next);
+    for (unsigned int k = 0; k < n; k++) {
+      reach(t, &count, next[k], depth);
+    }
+  }
+
+  // only a pop at a depth known for every path is sure to reach below the
+  // method's stack, the depth at other entries is only known at run time
+  for (uint32_t i = t->first; i <= t->last; i++) {
+    int pops, pushes;
+    stack_effect(&m->code[i], &pops, &pushes);
+    if (t->depth[i] >= 0 && pops > t->depth[i]) {
+      t->underflow = true;
+    }
+  }
+}
+
+static void forget(translator *t)
+{
+  for (uint32_t i = t->first; i <= t->last; i++) {
+    t->depth[i] = NOT_REACHED;
+    t->label[i] = false;
+  }
+}
+
+// The C function name of the method starting at entry start.
+static void method_name(translator *t, uint32_t start, char *name, size_t size)
+{
+  if (start == 0) {
+    snprintf(name, size, "ijvm_main");
+  } else {
+    snprintf(name, size, "method_%u", t->m->code[start].pc - 4); // at its header
+  }
+}
+
+// Emits the signature of the method starting at entry start.
+static void emit_signature(translator *t, uint32_t start, uint32_t args)
+{
+  char name[32];
+  method_name(t, start, name, sizeof(name));
+  if (start == 0) {
+    fprintf(t->out, "static void %s(void)", name);
+    return;
+  }
+  fprintf(t->out, "static word %s(", name);
+  for (uint32_t k = 0; k < args; k++) {
+    fprintf(t->out, "%sword l%u", k == 0 ? "" : ", ", k);
+  }
+  fprintf(t->out, "%s)", args == 0 ? "void" : "");
+}
+
+// Emits a call of the method of d, its arguments and its result are stack
+// slots from depth - d->local on.
+static void emit_call(translator *t, const decoded_insn *d, int32_t depth)
+{
+  char name[32];
+  method_name(t, d->target, name, sizeof(name));
+  int32_t base = depth - d->local;
+  if (t->dynamic) {
+    fprintf(t->out, "  {\n");
+    for (uint32_t k = d->local; k-- > 0;) {
+      fprintf(t->out, "    word a%u = pop();\n", k);
+    }
+    fprintf(t->out, "    push(%s(", name);
+    for (uint32_t k = 0; k < d->local; k++) {
+      fprintf(t->out, "%sa%u", k == 0 ? "" : ", ", k);
+    }
+    fprintf(t->out, "));\n  }\n");
+    return;
+  }
+  fprintf(t->out, "  s%d = %s(", base, name);
+  for (int32_t k = base; k < depth; k++) {
+    fprintf(t->out, "%ss%d", k == base ? "" : ", ", k);
+  }
+  fprintf(t->out, ");\n");
+}
+
+// Emits what step() does for the DOP_SLOW entry d.
+static void emit_slow(translator *t, const decoded_insn *d)
+{
+  ijvm *m = t->m;
+  byte opcode = m->text[d->pc];
+  if (opcode == OP_LDC_W) {
+    fprintf(t->out, "  fprintf(stderr, \"Invalid constant index: %%d\\n\", %u);\n  exit(1);\n",
+            read_uint16(&m->text[d->pc + 1]));
+  } else if (opcode == OP_WIDE) {
+    fprintf(t->out, "  fprintf(stderr, \"Invalid WIDE instruction\");\n  halt();\n");
+  } else {
+    fprintf(t->out, "  halt();\n");
+  }
+}
+
+// Emits entry i, depth is the stack depth before it.
+static void emit_entry(translator *t, uint32_t i, int32_t depth)
+{
+  FILE *out = t->out;
+  decoded_insn *d = &t->m->code[i];
+  const char *alu = NULL;
+  const char *cond = NULL;
+  int32_t a = depth - 2;
+  int32_t b = depth - 1;
+  switch (unfused_op(d->op)) {
+    case DOP_NOP:
+      break;
+    case DOP_PUSH:
+      if (t->dynamic) {
+        fprintf(out, "  push(%d);\n", d->arg);
+      } else {
+        fprintf(out, "  s%d = %d;\n", depth, d->arg);
+      }
+      break;
+    case DOP_DUP:
+      if (t->dynamic) {
+        fprintf(out, "  push(top());\n");
+      } else {
+        fprintf(out, "  s%d = s%d;\n", depth, b);
+      }
+      break;
+    case DOP_POP:
+      if (t->dynamic) {
+        fprintf(out, "  pop();\n");
+      }
+      break;
+    case DOP_SWAP:
+      if (t->dynamic) {
+        fprintf(out, "  {\n    word a = pop();\n    word b = pop();\n    push(a);\n    push(b);\n  }\n");
+      } else {
+        fprintf(out, "  {\n    word v = s%d;\n    s%d = s%d;\n    s%d = v;\n  }\n", a, a, b, b);
+      }
+      break;
+    case DOP_IADD:
+      alu = "+";
+      break;
+    case DOP_ISUB:
+      alu = "-";
+      break;
+    case DOP_IAND:
+      alu = "&";
+      break;
+    case DOP_IOR:
+      alu = "|";
+      break;
+    case DOP_ILOAD:
+      if (t->dynamic) {
+        fprintf(out, "  push(l%u);\n", d->local);
+      } else {
+        fprintf(out, "  s%d = l%u;\n", depth, d->local);
+      }
+      break;
+    case DOP_ISTORE:
+      if (t->dynamic) {
+        fprintf(out, "  l%u = pop();\n", d->local);
+      } else {
+        fprintf(out, "  l%u = s%d;\n", d->local, b);
+      }
+      break;
+    case DOP_IINC:
+      fprintf(out, "  l%u = (word)((uint32_t)l%u + (uint32_t)%d);\n", d->local, d->local, d->arg);
+      break;
+    case DOP_GOTO:
+      fprintf(out, "  goto e%u;\n", d->target);
+      break;
+    case DOP_IFEQ:
+      cond = "== 0";
+      break;
+    case DOP_IFLT:
+      cond = "< 0";
+      break;
+    case DOP_IF_ICMPEQ:
+      if (t->dynamic) {
+        fprintf(out, "  if (pop() == pop()) {\n    goto e%u;\n  }\n", d->target);
+      } else {
+        fprintf(out, "  if (s%d == s%d) {\n    goto e%u;\n  }\n", a, b, d->target);
+      }
+      break;
+    case DOP_INVOKEVIRTUAL:
+      emit_call(t, d, depth);
+      break;
+    case DOP_IRETURN:
+      if (t->start == 0) { // nothing to return to
+        if (t->dynamic) {
+          fprintf(out, "  pop();\n");
+        }
+        fprintf(out, "  fprintf(stderr, \"Control stack underflow\\n\");\n  exit(1);\n");
+      } else if (t->dynamic) {
+        fprintf(out, "  {\n    word v = pop();\n    if (stack_size > base) {\n"
+                     "      stack_size = base;\n    }\n    return v;\n  }\n");
+      } else {
+        fprintf(out, "  return s%d;\n", b);
+      }
+      break;
+    case DOP_IN:
+      if (t->dynamic) {
+        fprintf(out, "  push(in());\n");
+      } else {
+        fprintf(out, "  s%d = in();\n", depth);
+      }
+      break;
+    case DOP_OUT:
+      if (t->dynamic) {
+        fprintf(out, "  out(pop());\n");
+      } else {
+        fprintf(out, "  out(s%d);\n", b);
+      }
+      break;
+    case DOP_ERR:
+      fprintf(out, "  fprintf(stdout, \"!!!Error!!!\\n\");\n  halt();\n");
+      break;
+    case DOP_GC:
+      break; // no arrays to collect
+    case DOP_HALT:
+    case DOP_END:
+      fprintf(out, "  halt();\n");
+      break;
+    default: // DOP_SLOW
+      emit_slow(t, d);
+      break;
+  }
+
+  if (alu != NULL) {
+    if (t->dynamic) {
+      fprintf(out, "  {\n    word b = pop();\n    word a = pop();\n"
+                   "    push((word)((uint32_t)a %s (uint32_t)b));\n  }\n", alu);
+    } else {
+      fprintf(out, "  s%d = (word)((uint32_t)s%d %s (uint32_t)s%d);\n", a, a, alu, b);
+    }
+  }
+  if (cond != NULL) {
+    if (t->dynamic) {
+      fprintf(out, "  if (pop() %s) {\n    goto e%u;\n  }\n", cond, d->target);
+    } else {
+      fprintf(out, "  if (s%d %s) {\n    goto e%u;\n  }\n", b, cond, d->target);
+    }
+  }
+}
+
+// Emits the method analyze() looked at last.
+static void emit_method(translator *t, uint32_t args)
+{
+  FILE *out = t->out;
+  emit_signature(t, t->start, args);
+  fprintf(out, "\n{\n");
+  for (uint32_t k = args; k < t->local_count; k++) {
+    fprintf(out, "  word l%u = 0;\n", k);
+  }
+  if (t->dynamic) {
+    if (t->start != 0) {
+      fprintf(out, "  size_t base = stack_size;\n");
+    }
+  } else {
+    for (uint32_t k = 0; k < t->max_depth; k++) {
+      fprintf(out, "  word s%u;\n", k);
+    }
+  }
+  if (t->first != t->start) {
+    fprintf(out, "  goto e%u;\n", t->start);
+    t->label[t->start] = true;
+  }
+
+  // entries are laid out in text order, so falling through to the next
+  // entry is falling through in C as well
+  for (uint32_t i = t->first; i <= t->last; i++) {
+    if (t->depth[i] == NOT_REACHED) {
+      continue;
+    }
+    if (t->label[i]) {
+      fprintf(out, "e%u:\n", i);
+    }
+    emit_entry(t, i, t->depth[i]);
+  }
+  fprintf(out, "}\n\n");
+}
+
+// Runtime the translated methods call, the stack array only exists when
+// some method keeps its stack in it.
+static const char *const runtime =
+  "#include <stdint.h>\n"
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "\n"
+  "typedef int32_t word;\n"
+  "\n"
+  "static word in(void)\n"
+  "{\n"
+  "  int c = fgetc(stdin);\n"
+  "  return c == EOF ? 0 : (word)c;\n"
+  "}\n"
+  "\n"
+  "static void out(word v)\n"
+  "{\n"
+  "  fprintf(stdout, \"%c\", v);\n"
+  "}\n"
+  "\n"
+  "static _Noreturn void halt(void)\n"
+  "{\n"
+  "  exit(0);\n"
+  "}\n"
+  "\n";
+
+static const char *const stack_runtime =
+  "static word *stack;\n"
+  "static size_t stack_size;\n"
+  "static size_t stack_max;\n"
+  "\n"
+  "static void push(word v)\n"
+  "{\n"
+  "  if (stack_size == stack_max) {\n"
+  "    stack_max = stack_max == 0 ? 64 : stack_max * 2;\n"
+  "    stack = realloc(stack, stack_max * sizeof(word));\n"
+  "    if (stack == NULL) {\n"
+  "      fprintf(stderr, \"Out of memory\\n\");\n"
+  "      exit(1);\n"
+  "    }\n"
+  "  }\n"
+  "  stack[stack_size++] = v;\n"
+  "}\n"
+  "\n"
+  "static word pop(void)\n"
+  "{\n"
+  "  if (stack_size == 0) {\n"
+  "    fprintf(stderr, \"Stack uderflow!\");\n"
+  "    exit(1);\n"
+  "  }\n"
+  "  return stack[--stack_size];\n"
+  "}\n"
+  "\n"
+  "static word top(void)\n"
+  "{\n"
+  "  if (stack_size == 0) {\n"
+  "    fprintf(stderr, \"Stack empty.\");\n"
+  "    exit(1);\n"
+  "  }\n"
+  "  return stack[stack_size - 1];\n"
+  "}\n"
+  "\n";
+
+// Translates m to C, written to out. Returns false (after saying why) if
+// it has instructions that can not be translated.
+static bool translate(ijvm *m, const char *binary, FILE *out)
+{
+  uint32_t n = m->code_count;
+  translator t = { 0 };
+  t.m = m;
+  t.out = out;
+  t.depth = malloc(n * sizeof(int32_t));
+  t.work = malloc(2 * (size_t)n * sizeof(uint32_t));
+  t.label = calloc(n, sizeof(bool));
+  t.is_method = calloc(n, sizeof(bool));
+  t.args = calloc(n, sizeof(uint16_t));
+  t.locals = calloc(n, sizeof(uint16_t));
+  bool ok = t.depth != NULL && t.work != NULL && t.label != NULL && t.is_method != NULL
+            && t.args != NULL && t.locals != NULL;
+  if (!ok) {
+    fprintf(stderr, "Out of memory\n");
+  }
+
+  // the methods, whether any of them can reach into its caller's stack and
+  // whether any needs the stack array
+  bool any_dynamic = false;
+  for (uint32_t i = 0; ok && i < n; i++) {
+    t.depth[i] = NOT_REACHED;
+  }
+  t.is_method[0] = true;
+  for (uint32_t i = 0; ok && i < n; i++) {
+    decoded_insn *d = &m->code[i];
+    if (unfused_op(d->op) == DOP_INVOKEVIRTUAL) {
+      t.is_method[d->target] = true;
+      t.args[d->target] = d->local;
+      t.locals[d->target] = m->methods[d->arg].local_count;
+    }
+  }
+  for (uint32_t i = 0; ok && i < n; i++) {
+    if (!t.is_method[i]) {
+      continue;
+    }
+    analyze(&t, i, t.args[i], t.locals[i]);
+    if (t.unsupported) {
+      fprintf(stderr, "%s: can not translate an instruction reachable from pc %u\n",
+              binary, (unsigned int)m->code[i].pc);
+      ok = false;
+    }
+    t.all_dynamic = t.all_dynamic || t.underflow;
+    any_dynamic = any_dynamic || t.dynamic;
+    forget(&t);
+  }
+
+  if (ok) {
+    fprintf(out, "// Translated from %s by ijvm2c.\n\n%s", binary, runtime);
+    fprintf(out, "%s", any_dynamic ? stack_runtime : "");
+    for (uint32_t i = 1; i < n; i++) {
+      if (t.is_method[i]) {
+        emit_signature(&t, i, t.args[i]);
+        fprintf(out, ";\n");
+      }
+    }
+    fprintf(out, "\n");
+    for (uint32_t i = 0; i < n; i++) {
+      if (t.is_method[i]) {
+        analyze(&t, i, t.args[i], t.locals[i]);
+        emit_method(&t, t.args[i]);
+        forget(&t);
+      }
+    }
+    fprintf(out, "int main(void)\n{\n  ijvm_main();\n  return 0;\n}\n");
+  }
+
+  free(t.depth);
+  free(t.work);
+  free(t.label);
+  free(t.is_method);
+  free(t.args);
+  free(t.locals);
+  return ok;
+}
+
+// Runs the interpreter on m in a child process with stdout redirected to
+// output, like ./ijvm would. Returns its wait status.
+static int run_interpreter(char *binary, const char *input, const char *output)
+{
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    FILE *in = fopen(input, "rb");
+    FILE *out = fopen(output, "wb");
+    ijvm *m = in == NULL || out == NULL ? NULL : init_ijvm(binary, in, out);
+    if (m == NULL) {
+      _exit(1);
+    }
+    run(m);
+    destroy_ijvm(m);
+    fclose(out);
+    exit(0);
+  }
+  int status = -1;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+    return -1;
+  }
+  return status;
+}
+
+// The exit status of a process with wait status status, as a shell reports
+// it (128 plus the signal if it was killed).
+static int exit_code(int status)
+{
+  if (status == -1) {
+    return -1;
+  }
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+// Whether files a and b have the same contents.
+static bool same_file(const char *a, const char *b)
+{
+  FILE *fa = fopen(a, "rb");
+  FILE *fb = fopen(b, "rb");
+  bool same = fa != NULL && fb != NULL;
+  while (same) {
+    int ca = fgetc(fa);
+    same = ca == fgetc(fb);
+    if (ca == EOF) {
+      break;
+    }
+  }
+  if (fa != NULL) {
+    fclose(fa);
+  }
+  if (fb != NULL) {
+    fclose(fb);
+  }
+  return same;
+}
+
+// Creates an empty temporary file from template, returns false if it could
+// not.
+static bool temp_file(char *template)
+{
+  int fd = mkstemp(template);
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+// --test: translates binary, compiles the result with $CC (clang if not
+// set) and runs both it and the interpreter on input. Returns the exit
+// status of ijvm2c, 0 if their output and exit status match.
+static int test(ijvm *m, char *binary, const char *input)
+{
+  char source[] = "/tmp/ijvm2c-XXXXXX";
+  char native[] = "/tmp/ijvm2c-XXXXXX";
+  char expected[] = "/tmp/ijvm2c-XXXXXX";
+  char actual[] = "/tmp/ijvm2c-XXXXXX";
+  if (!temp_file(source) || !temp_file(native) || !temp_file(expected) || !temp_file(actual)) {
+    fprintf(stderr, "Can not create temporary files\n");
+    return 1;
+  }
+
+  int result = 1;
+  FILE *out = fopen(source, "w");
+  bool translated = out != NULL && translate(m, binary, out);
+  if (out != NULL) {
+    fclose(out);
+  }
+  const char *cc = getenv("CC");
+  char command[4096];
+  snprintf(command, sizeof(command), "%s -O2 -x c -o %s %s", cc != NULL ? cc : "clang", native,
+           source);
+  if (!translated) {
+    fprintf(stderr, "%s: not translated\n", binary);
+  } else if (system(command) != 0) {
+    fprintf(stderr, "%s: the translation does not compile (%s)\n", binary, source);
+  } else {
+    snprintf(command, sizeof(command), "%s < %s > %s", native, input, actual);
+    int native_status = exit_code(system(command));
+    int status = exit_code(run_interpreter(binary, input, expected));
+    if (status != native_status) {
+      printf("%s: exit status differs, interpreter %d, native %d\n", binary, status, native_status);
+    } else if (!same_file(expected, actual)) {
+      printf("%s: output differs\n", binary);
+    } else {
+      printf("%s: same output\n", binary);
+      result = 0;
+    }
+  }
+
+  if (result == 0 || !translated) {
+    remove(source);
+  }
+  remove(native);
+  remove(expected);
+  remove(actual);
+  return result;
+}
+
+static void print_help(void)
+{
+  printf("Usage: ./ijvm2c binary [out.c]\n"
+         "       ./ijvm2c --test binary [input]\n");
+}
+
+int main(int argc, char **argv)
+{
+  bool testing = argc > 1 && strcmp(argv[1], "--test") == 0;
+  int arg = testing ? 2 : 1;
+  if (arg >= argc || argc > arg + 2) {
+    print_help();
+    return 1;
+  }
+  char *binary = argv[arg];
+  ijvm *m = init_ijvm(binary, stdin, stdout);
+  if (m == NULL) {
+    fprintf(stderr, "Couldn't load binary %s\n", binary);
+    return 1; // nothing to compare, not a passed test either
+  }
+
+  int result;
+  if (testing) {
+    result = test(m, binary, arg + 1 < argc ? argv[arg + 1] : "/dev/null");
+  } else {
+    FILE *out = arg + 1 < argc ? fopen(argv[arg + 1], "w") : stdout;
+    if (out == NULL) {
+      fprintf(stderr, "Couldn't open %s\n", argv[arg + 1]);
+      result = 1;
+    } else {
+      result = translate(m, binary, out) ? 0 : 1;
+      if (out != stdout) {
+        fclose(out);
+      }
+    }
+  }
+  destroy_ijvm(m);
+  return result;
+}
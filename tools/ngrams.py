@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""Mines the most frequent opcode n-grams from a corpus of .ijvm binaries.
+
+Used to pick the superinstructions fused by src/super.c. Every binary is
+decoded the same way src/decode.c does it (following control flow from pc 0
+and from every INVOKEVIRTUAL target), then all straight-line opcode
+sequences of length 2 up to --max-n are counted. Only the last instruction
+of a sequence may transfer control, since nothing can be fused past it.
+
+With --decoded, opcodes are named the way the interpreter sees them after
+decoding (BIPUSH and LDC_W are both PUSH, WIDE forms are plain ILOAD etc).
+With --loops, a sequence counts 10^d times where d is the number of loops
+(ranges between a backward branch and its target) around it, the usual
+static estimate of how often code runs. Without it every occurrence counts
+once.
+
+usage: python3 tools/ngrams.py [--max-n N] [--top K] [--decoded] [--loops]
+                               [paths...]
+       (paths default to every .ijvm file below files/)
+"""
+
+import argparse
+import collections
+import os
+import struct
+import sys
+
+MAGIC_NUMBER = 0x1DEADFAD
+
+# opcode -> (name, operand bytes)
+OPCODES = {
+    0x10: ("BIPUSH", 1),
+    0x59: ("DUP", 0),
+    0xFE: ("ERR", 0),
+    0xA7: ("GOTO", 2),
+    0xFF: ("HALT", 0),
+    0x60: ("IADD", 0),
+    0x7E: ("IAND", 0),
+    0x99: ("IFEQ", 2),
+    0x9B: ("IFLT", 2),
+    0x9F: ("IF_ICMPEQ", 2),
+    0x84: ("IINC", 2),
+    0x15: ("ILOAD", 1),
+    0xFC: ("IN", 0),
+    0xB6: ("INVOKEVIRTUAL", 2),
+    0xB0: ("IOR", 0),
+    0xAC: ("IRETURN", 0),
+    0x36: ("ISTORE", 1),
+    0x64: ("ISUB", 0),
+    0x13: ("LDC_W", 2),
+    0x00: ("NOP", 0),
+    0xFD: ("OUT", 0),
+    0x57: ("POP", 0),
+    0x5F: ("SWAP", 0),
+    0xC4: ("WIDE", None),
+    0xCB: ("TAILCALL", 2),
+    0xD1: ("NEWARRAY", 0),
+    0xD2: ("IALOAD", 0),
+    0xD3: ("IASTORE", 0),
+    0xBD: ("ANEWARRAY", 0),
+    0x32: ("AIALOAD", 0),
+    0x53: ("AIASTORE", 0),
+    0xD4: ("GC", 0),
+}
+
+BRANCHES = {"GOTO", "IFEQ", "IFLT", "IF_ICMPEQ"}
+TERMINATORS = {"GOTO", "IRETURN", "HALT", "ERR"}
+TRANSFERS = BRANCHES | {"INVOKEVIRTUAL", "TAILCALL", "IRETURN", "HALT", "ERR"}
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < 12 or struct.unpack(">I", data[0:4])[0] != MAGIC_NUMBER:
+        return None
+    pool_size = struct.unpack(">i", data[8:12])[0]
+    if pool_size < 0 or 12 + pool_size + 8 > len(data):
+        return None
+    pool = [struct.unpack(">i", data[12 + i:16 + i])[0]
+            for i in range(0, pool_size - pool_size % 4, 4)]
+    offset = 12 + pool_size + 4
+    text_size = struct.unpack(">i", data[offset:offset + 4])[0]
+    text = data[offset + 4:offset + 4 + text_size]
+    return pool, text
+
+
+def decode(pool, text):
+    """Returns {pc: (name, size, targets, falls_through)} for every
+    reachable instruction."""
+    insns = {}
+    work = [0]
+    while work:
+        pc = work.pop()
+        if pc < 0 or pc >= len(text) or pc in insns:
+            continue
+        op = text[pc]
+        if op not in OPCODES:
+            insns[pc] = ("?%02X" % op, 1, [], False)
+            continue
+        name, operands = OPCODES[op]
+        if name == "WIDE":
+            sub = text[pc + 1] if pc + 1 < len(text) else None
+            if sub not in (0x15, 0x36, 0x84):
+                insns[pc] = ("WIDE?", 1, [], False)
+                continue
+            name = "WIDE_" + OPCODES[sub][0]
+            size = 5 if sub == 0x84 else 4
+        else:
+            size = 1 + operands
+        if pc + size > len(text):
+            insns[pc] = (name, size, [], False)
+            continue
+        targets = []
+        if name in BRANCHES:
+            targets.append(pc + struct.unpack(">h", text[pc + 1:pc + 3])[0])
+        elif name in ("INVOKEVIRTUAL", "TAILCALL"):
+            index = struct.unpack(">H", text[pc + 1:pc + 3])[0]
+            if index < len(pool):
+                targets.append(pool[index] + 4)
+        falls_through = name not in TERMINATORS
+        insns[pc] = (name, size, targets, falls_through)
+        work.extend(targets)
+        if falls_through:
+            work.append(pc + size)
+    return insns
+
+
+DECODED_NAMES = {
+    "BIPUSH": "PUSH",
+    "LDC_W": "PUSH",
+    "WIDE_ILOAD": "ILOAD",
+    "WIDE_ISTORE": "ISTORE",
+    "WIDE_IINC": "IINC",
+}
+
+
+def loop_ranges(insns):
+    """One range per loop header, up to its last backward branch."""
+    ends = {}
+    for pc, (name, _, targets, _) in insns.items():
+        for target in targets:
+            if name in BRANCHES and target <= pc:
+                ends[target] = max(ends.get(target, pc), pc)
+    return list(ends.items())
+
+
+def ngrams(insns, max_n, decoded=False, loops=None):
+    """Yields (sequence, weight) pairs."""
+    for pc in sorted(insns):
+        weight = 1
+        if loops is not None:
+            weight = 10 ** sum(1 for lo, hi in loops if lo <= pc <= hi)
+        seq = []
+        cur = pc
+        while cur in insns and len(seq) < max_n:
+            name, size, _, falls_through = insns[cur]
+            seq.append(DECODED_NAMES.get(name, name) if decoded else name)
+            if len(seq) >= 2:
+                yield tuple(seq), weight
+            if name in TRANSFERS or not falls_through:
+                break
+            cur += size
+
+
+def corpus(paths):
+    for path in paths:
+        if os.path.isdir(path):
+            for root, _, files in os.walk(path):
+                for name in sorted(files):
+                    if name.endswith(".ijvm"):
+                        yield os.path.join(root, name)
+        else:
+            yield path
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--max-n", type=int, default=3,
+                        help="longest sequence to count (default 3)")
+    parser.add_argument("--top", type=int, default=25,
+                        help="number of sequences to print per length")
+    parser.add_argument("--decoded", action="store_true",
+                        help="use the opcode names of the decoded program")
+    parser.add_argument("--loops", action="store_true",
+                        help="weigh sequences by their loop nesting depth")
+    parser.add_argument("paths", nargs="*", default=["files"])
+    args = parser.parse_args()
+
+    counts = collections.Counter()
+    programs = collections.defaultdict(set)
+    for path in corpus(args.paths):
+        loaded = load(path)
+        if loaded is None:
+            continue
+        insns = decode(*loaded)
+        loops = loop_ranges(insns) if args.loops else None
+        for gram, weight in ngrams(insns, args.max_n, args.decoded, loops):
+            counts[gram] += weight
+            programs[gram].add(path)
+
+    for n in range(2, args.max_n + 1):
+        grams = [(c, g) for g, c in counts.items() if len(g) == n]
+        grams.sort(key=lambda x: (-x[0], x[1]))
+        print("%d-grams:" % n)
+        for count, gram in grams[:args.top]:
+            print("  %8d  %3d programs  %s" % (count, len(programs[gram]),
+                                                 "; ".join(gram)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())